@@ -20,6 +20,11 @@ struct _dma_impl
 	DMA_receiver* destination;
 };
 
+/*
+ * each DMA claims a channel the first time it's set up and keeps it, so
+ * several users (eg an SD card on each SSP) can have transfers running at
+ * once without taking each other's channel between transfers
+ */
 static volatile uint8_t dma_claimed_channels = 0;
 
 static volatile DMA* channel_map[8] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
@@ -86,16 +91,23 @@ void DMA::setup(uint32_t size)
 		__disable_irq();
 		for (int i = 7; i >= 0; i--)
 		{
-			if (channel_map[i] == NULL)
+			if ((dma_claimed_channels & (1 << i)) == 0)
 			{
+				dma_claimed_channels |= (1 << i);
+				channel_map[i] = this;
 				data->dma_channel = i;
 				break;
 			}
 		}
 		__enable_irq();
-	}
 
-	channel_map[data->dma_channel] = this;
+		// all eight channels are spoken for
+		if (data->dma_channel < 0)
+		{
+			__debugbreak();
+			return;
+		}
+	}
 	
 	GPDMA_Channel_CFG_Type chconfig;
 	
@@ -168,7 +180,7 @@ void DMA::begin()
 	data->source->dma_begin(this, DMA_SENDER);
 	data->destination->dma_begin(this, DMA_RECEIVER);
 	
-	printf("DMA %d Begin!\n", data->dma_channel);
+// 	printf("DMA %d Begin!\n", data->dma_channel);
 
 	LPC_GPDMACH_TypeDef *pDMAch = (LPC_GPDMACH_TypeDef*) pGPDMACh[data->dma_channel];
 	
@@ -196,14 +208,12 @@ void DMA::isr()
 	LPC_GPDMA->DMACIntTCClear = (1 << data->dma_channel);
 	LPC_GPDMA->DMACIntErrClr  = (1 << data->dma_channel);
 
-    printf("DMA %d ISR ", data->dma_channel);
+//     printf("DMA %d ISR ", data->dma_channel);
 
     data->source->dma_complete(this, DMA_SENDER);
 	data->destination->dma_complete(this, DMA_RECEIVER);
 
-    printf(" OK!\n");
-	
-	channel_map[data->dma_channel] = NULL;
+//     printf(" OK!\n");
 }
 
 void DMA::debug()
@@ -12,8 +12,6 @@
 
 #include "mri.h"
 
-#define uabs(a, b) (((a) >= (b))?((a) - (b)):((b) - (a)))
-
 struct _spi_platform_data
 {
 	GPIO* ss;
@@ -28,6 +26,8 @@ struct _spi_platform_data
 	
 	LPC_SSP_TypeDef* ssp;
 	
+	uint32_t frequency;
+	
 	volatile uint32_t dummy;
 };
 
@@ -100,7 +100,7 @@ SPI::SPI(PinName mosi, PinName miso, PinName sck, PinName ss)
 	data->ssp->CR1 |=  SSP_CR1_SSP_EN;
 }
 
-void SPI::set_frequency(uint32_t f)
+uint32_t SPI::set_frequency(uint32_t f)
 {
 	// frequency = PCLK / (CPSR * (SCR + 1))
 	uint32_t pclk = CLKPWR_GetPCLK(data->ssp_index?CLKPWR_PCLKSEL_SSP1:CLKPWR_PCLKSEL_SSP0);
@@ -117,50 +117,53 @@ void SPI::set_frequency(uint32_t f)
 	 *      (c + 1) = p / 2bf
 	 *       c      = p / 2bf - 1
 	 * 
-	 * so now we can search b:[127..1], find c for each b then compute actual frequency and compare to desired
+	 * so now we can search b:[127..1], find c for each b then compute actual frequency and compare to desired.
 	 * 
+	 * devices only care that we don't clock them faster than they asked
+	 * for, so round c + 1 up, and take the fastest result that isn't over f
 	 */
 	
 	int best_b = 127;
-	uint32_t best_f_delta = pclk;
+	int best_s = 256;
+	uint32_t best_f = 0;
 	
 	for (int b = 127; b; b--)
 	{
-		int s = pclk / b / f;
+		uint32_t s = (uint32_t) ((pclk + (2ULL * b * f) - 1) / (2ULL * b * f));
+		
+		if (s < 1)
+			s = 1;
+		if (s > 256)
+			continue;
 		
-		// round s up or down for better accuracy
-		if (s & 1) s++;
-		s /= 2;
+		uint32_t actual_f = pclk / b / s / 2;
 		
-		if (s >= 1 && s <= 256)
+		if (actual_f > best_f)
 		{
-			uint32_t actual_f = pclk / b / s / 2;
+			best_b = b;
+			best_s = s;
+			best_f = actual_f;
 			
-			if (uabs(actual_f, f) < best_f_delta)
-			{
-				best_b = b;
-				best_f_delta = uabs(actual_f, f);
-				
-				if (f == actual_f)
-					break;
-			}
+			if (f == actual_f)
+				break;
 		}
 	}
 	
-	int s = pclk / best_b / f;
-	
-	if (s & 1) s++;
-	s /= 2;
-	
-	if (s < 1)
-		s = 1;
-	if (s > 256)
-		s = 256;
+	// slowest we can go, if f is below that
+	if (best_f == 0)
+		best_f = pclk / best_b / best_s / 2;
 	
-	data->ssp->CR0 = (data->ssp->CR0 & ~(0xFF << 8)) | (s - 1) << 8;
+	data->ssp->CR0 = (data->ssp->CR0 & ~(0xFF << 8)) | (best_s - 1) << 8;
 	data->ssp->CPSR = 2 * best_b;
 	
-	return;
+	data->frequency = best_f;
+	
+	return best_f;
+}
+
+uint32_t SPI::get_frequency()
+{
+	return data->frequency;
 }
 
 uint8_t SPI::transfer(uint8_t out)
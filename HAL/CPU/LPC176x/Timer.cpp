@@ -0,0 +1,193 @@
+#include "Timer.h"
+
+#include <cstdlib>
+#include <cstdio>
+
+#include "LPC17xx.h"
+#include "lpc17xx_clkpwr.h"
+
+#include "mri.h"
+
+#define TIM_IR_MR0  (1<<0)
+#define TIM_MCR_MR0I (1<<0)
+#define TIM_TCR_EN  (1<<0)
+
+struct _timer_platform_data
+{
+	int index;
+
+	LPC_TIM_TypeDef* tim;
+	IRQn_Type irq;
+
+	Timer_receiver* receiver;
+
+	volatile uint8_t triggered;
+};
+
+static Timer* instance[4] = { NULL, NULL, NULL, NULL };
+
+extern "C" {
+	void TIMER0_IRQHandler(void)
+	{
+		if (instance[0]) instance[0]->isr();
+	}
+	void TIMER1_IRQHandler(void)
+	{
+		if (instance[1]) instance[1]->isr();
+	}
+	void TIMER2_IRQHandler(void)
+	{
+		if (instance[2]) instance[2]->isr();
+	}
+	void TIMER3_IRQHandler(void)
+	{
+		if (instance[3]) instance[3]->isr();
+	}
+}
+
+static void timer_claim(Timer* t, timer_platform_data* data)
+{
+	data->index = -1;
+
+	__disable_irq();
+	for (int i = 0; i < 4; i++)
+	{
+		if (instance[i] == NULL)
+		{
+			instance[i] = t;
+			data->index = i;
+			break;
+		}
+	}
+	__enable_irq();
+
+	uint32_t pclk;
+
+	switch(data->index)
+	{
+		case 0:
+			data->tim = LPC_TIM0;
+			data->irq = TIMER0_IRQn;
+			CLKPWR_ConfigPPWR(CLKPWR_PCONP_PCTIM0, ENABLE);
+			CLKPWR_SetPCLKDiv(CLKPWR_PCLKSEL_TIMER0, CLKPWR_PCLKSEL_CCLK_DIV_4);
+			pclk = CLKPWR_GetPCLK(CLKPWR_PCLKSEL_TIMER0);
+			break;
+		case 1:
+			data->tim = LPC_TIM1;
+			data->irq = TIMER1_IRQn;
+			CLKPWR_ConfigPPWR(CLKPWR_PCONP_PCTIM1, ENABLE);
+			CLKPWR_SetPCLKDiv(CLKPWR_PCLKSEL_TIMER1, CLKPWR_PCLKSEL_CCLK_DIV_4);
+			pclk = CLKPWR_GetPCLK(CLKPWR_PCLKSEL_TIMER1);
+			break;
+		case 2:
+			data->tim = LPC_TIM2;
+			data->irq = TIMER2_IRQn;
+			CLKPWR_ConfigPPWR(CLKPWR_PCONP_PCTIM2, ENABLE);
+			CLKPWR_SetPCLKDiv(CLKPWR_PCLKSEL_TIMER2, CLKPWR_PCLKSEL_CCLK_DIV_4);
+			pclk = CLKPWR_GetPCLK(CLKPWR_PCLKSEL_TIMER2);
+			break;
+		case 3:
+			data->tim = LPC_TIM3;
+			data->irq = TIMER3_IRQn;
+			CLKPWR_ConfigPPWR(CLKPWR_PCONP_PCTIM3, ENABLE);
+			CLKPWR_SetPCLKDiv(CLKPWR_PCLKSEL_TIMER3, CLKPWR_PCLKSEL_CCLK_DIV_4);
+			pclk = CLKPWR_GetPCLK(CLKPWR_PCLKSEL_TIMER3);
+			break;
+		default:
+			// all four hardware timers are taken
+			__debugbreak();
+			return;
+	}
+
+	// count microseconds
+	data->tim->TCR  = 2;
+	data->tim->CTCR = 0;
+	data->tim->PR   = (pclk / 1000000) - 1;
+	data->tim->MCR  = 0;
+	data->tim->IR   = 0x3F;
+	data->tim->TCR  = TIM_TCR_EN;
+
+	NVIC_EnableIRQ(data->irq);
+}
+
+Timer::Timer()
+{
+	data = (timer_platform_data*) malloc(sizeof(timer_platform_data));
+	data->receiver  = NULL;
+	data->triggered = 0;
+
+	timer_claim(this, data);
+}
+
+Timer::Timer(Timer_receiver* receiver)
+{
+	data = (timer_platform_data*) malloc(sizeof(timer_platform_data));
+	data->receiver  = receiver;
+	data->triggered = 0;
+
+	timer_claim(this, data);
+}
+
+void Timer::set_receiver(Timer_receiver* receiver)
+{
+	data->receiver = receiver;
+}
+
+void Timer::start_us(uint32_t us)
+{
+	// a match must be at least one tick in the future or we'll miss it
+	if (us < 2)
+		us = 2;
+
+	data->tim->MCR &= ~TIM_MCR_MR0I;
+	data->tim->IR   = TIM_IR_MR0;
+	data->tim->MR0  = data->tim->TC + us;
+	data->tim->MCR |= TIM_MCR_MR0I;
+
+	// if we were held up long enough for the counter to pass the match, fire now
+	if ((int32_t) (data->tim->TC - data->tim->MR0) >= 0)
+		trigger();
+}
+
+void Timer::trigger()
+{
+	data->triggered = 1;
+	NVIC_SetPendingIRQ(data->irq);
+}
+
+void Timer::stop()
+{
+	data->tim->MCR &= ~TIM_MCR_MR0I;
+	data->tim->IR   = TIM_IR_MR0;
+	data->triggered = 0;
+}
+
+int Timer::pending()
+{
+	return data->triggered || (data->tim->MCR & TIM_MCR_MR0I);
+}
+
+uint32_t Timer::now_us()
+{
+	return data->tim->TC;
+}
+
+void Timer::isr()
+{
+	uint8_t fire = data->triggered;
+
+	if (data->tim->IR & TIM_IR_MR0)
+	{
+		data->tim->IR = TIM_IR_MR0;
+		if (data->tim->MCR & TIM_MCR_MR0I)
+		{
+			data->tim->MCR &= ~TIM_MCR_MR0I;
+			fire = 1;
+		}
+	}
+
+	data->triggered = 0;
+
+	if (fire && data->receiver)
+		data->receiver->timer_expired(this);
+}
@@ -10,4 +10,45 @@
 #define htons(l) __REV16(l)
 #define ntohs(l) __REV16(l)
 
+/*
+ * mask interrupts, and put them back how they were. For code that can be
+ * called both with them masked and without
+ */
+static inline uint32_t irq_save(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+}
+
+static inline void irq_restore(uint32_t primask)
+{
+	if (primask == 0)
+		__enable_irq();
+}
+
+/*
+ * core cycle counter, for timing things finer than Clock can. Free-running,
+ * wraps every 2^32 cycles (about 43s at 100MHz)
+ */
+#define DWT_CTRL          (*((volatile uint32_t*) 0xE0001000))
+#define DWT_CYCCNT        (*((volatile uint32_t*) 0xE0001004))
+#define DWT_CTRL_CYCCNTENA (1UL << 0)
+
+static inline void cycle_counter_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+static inline uint32_t cycle_counter(void)
+{
+	return DWT_CYCCNT;
+}
+
+static inline uint32_t cycle_counter_hz(void)
+{
+	return SystemCoreClock;
+}
+
 #endif /* _PLATFORM_UTILS_H */
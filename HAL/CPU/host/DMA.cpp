@@ -0,0 +1,200 @@
+#include "DMA.h"
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#include "sim.h"
+#include "sim_spi.h"
+
+#include "mri.h"
+
+/*
+ * host stand-in for the GPDMA
+ *
+ * a memory->SPI channel and an SPI->memory channel on the same port are
+ * run together as one full-duplex transfer as soon as both have begun.
+ * Completion interrupts arrive once the simulated bus has moved the bytes
+ */
+
+struct _dma_impl
+{
+	int dma_channel;
+
+	DMA_receiver* source;
+	DMA_receiver* destination;
+
+	dma_config sconfig;
+	dma_config dconfig;
+
+	uint32_t size;
+	bool     active;
+};
+
+// channels are claimed on first use and kept, as on the target
+static DMA* channel_map[8] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+
+static void dma_isr_event(void* context)
+{
+	((DMA*) context)->isr();
+}
+
+static uint8_t mem_read(dma_config* c, uint32_t i)
+{
+	uint8_t* b = (uint8_t*) c->mem_buf;
+	return b[(c->auto_increment == DMA_NO_INCREMENT)?(i & 3):i];
+}
+
+static void mem_write(dma_config* c, uint32_t i, uint8_t v)
+{
+	uint8_t* b = (uint8_t*) c->mem_buf;
+	b[(c->auto_increment == DMA_NO_INCREMENT)?(i & 3):i] = v;
+}
+
+DMA::DMA()
+{
+	data = (dma_impl*) malloc(sizeof(dma_impl));
+	data->dma_channel = -1;
+
+	data->source = NULL;
+	data->destination = NULL;
+	data->active = false;
+}
+
+DMA::DMA(DMA_receiver* source, DMA_receiver* dest)
+{
+	data = (dma_impl*) malloc(sizeof(dma_impl));
+	data->dma_channel = -1;
+	data->active = false;
+
+	set_source(source);
+	set_destination(dest);
+}
+
+void DMA::set_source(DMA_receiver* source)
+{
+	data->source = source;
+}
+
+void DMA::set_destination(DMA_receiver* destination)
+{
+	data->destination = destination;
+}
+
+void DMA::setup(uint32_t size)
+{
+	if (data->dma_channel < 0)
+	{
+		for (int i = 7; i >= 0; i--)
+		{
+			if (channel_map[i] == NULL)
+			{
+				channel_map[i] = this;
+				data->dma_channel = i;
+				break;
+			}
+		}
+		if (data->dma_channel < 0)
+			__debugbreak();
+	}
+
+	data->sconfig.direction = DMA_SENDER;
+	data->source->dma_configure(&data->sconfig);
+	data->dconfig.direction = DMA_RECEIVER;
+	data->destination->dma_configure(&data->dconfig);
+
+	data->size = size;
+}
+
+static void dma_run(DMA* tx, dma_impl* t, DMA* rx, dma_impl* r)
+{
+	void* peripheral = t->dconfig.mem_buf;
+
+	uint32_t n = (t->size < r->size)?t->size:r->size;
+
+	for (uint32_t i = 0; i < n; i++)
+		mem_write(&r->dconfig, i, sim_spi_dma_exchange(peripheral, mem_read(&t->sconfig, i)));
+
+	t->active = false;
+	r->active = false;
+
+	uint64_t done = sim_spi_bus_time(peripheral);
+
+	// transmit side finishes first, as on hardware
+	sim_event_at(done, dma_isr_event, tx);
+	sim_event_at(done, dma_isr_event, rx);
+}
+
+void DMA::begin()
+{
+	data->source->dma_begin(this, DMA_SENDER);
+	data->destination->dma_begin(this, DMA_RECEIVER);
+
+	data->active = true;
+
+	if (data->sconfig.mem_or_peripheral == DMA_MEM && data->dconfig.mem_or_peripheral == DMA_MEM)
+	{
+		for (uint32_t i = 0; i < data->size; i++)
+			mem_write(&data->dconfig, i, mem_read(&data->sconfig, i));
+		data->active = false;
+		sim_event_at(sim_now_ns(), dma_isr_event, this);
+		return;
+	}
+
+	// look for our partner on the same port
+	for (int i = 0; i < 8; i++)
+	{
+		DMA* other = channel_map[i];
+		if ((other == NULL) || (other == this) || (other->data->active == false))
+			continue;
+
+		dma_impl* o = other->data;
+
+		if ((data->dconfig.mem_or_peripheral == DMA_PERIPHERAL) &&
+			(o->sconfig.mem_or_peripheral == DMA_PERIPHERAL) &&
+			(o->sconfig.mem_buf == data->dconfig.mem_buf))
+		{
+			dma_run(this, data, other, o);
+			return;
+		}
+
+		if ((data->sconfig.mem_or_peripheral == DMA_PERIPHERAL) &&
+			(o->dconfig.mem_or_peripheral == DMA_PERIPHERAL) &&
+			(o->dconfig.mem_buf == data->sconfig.mem_buf))
+		{
+			dma_run(other, o, this, data);
+			return;
+		}
+	}
+}
+
+int DMA::running()
+{
+	return data->active?(int) data->size:0;
+}
+
+void DMA::isr()
+{
+	data->source->dma_complete(this, DMA_SENDER);
+	data->destination->dma_complete(this, DMA_RECEIVER);
+}
+
+void DMA::debug()
+{
+	printf("*** DMA Channel: %d (sim) size %u %s\n", data->dma_channel, data->size, data->active?"active":"idle");
+}
+
+/*
+ * DMA_mem
+ */
+
+void DMA_mem::dma_configure(dma_config* config)
+{
+	config->mem_or_peripheral = DMA_MEM;
+	config->mem_buf = addr;
+	config->mem_size = size;
+	config->endianness = DMA_BIG_ENDIAN;
+	config->word_size = DMA_WS_32BIT;
+	config->burst_size = DMA_BS_128;
+	config->auto_increment = auto_increment;
+}
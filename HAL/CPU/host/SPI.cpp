@@ -0,0 +1,164 @@
+#include "SPI.h"
+
+#include <cstdlib>
+#include <cstdio>
+
+#include "platform_pins.h"
+#include "platform_utils.h"
+
+#include "sim.h"
+#include "sim_spi.h"
+
+struct _spi_platform_data
+{
+	int ssp_index;
+
+	uint32_t frequency;
+	bool     selected;
+
+	// bus time of the next free byte slot. DMA runs ahead of the CPU's clock
+	uint64_t bus_ns;
+};
+
+static SimSPIDevice* devices[2] = { NULL, NULL };
+
+void sim_spi_attach(int ssp_index, SimSPIDevice* device)
+{
+	devices[ssp_index & 1] = device;
+}
+
+static uint8_t spi_exchange(spi_platform_data* data, uint8_t mosi)
+{
+	if (data->bus_ns < sim_now_ns())
+		data->bus_ns = sim_now_ns();
+
+	uint8_t miso = 0xFF;
+
+	SimSPIDevice* d = devices[data->ssp_index];
+	if (d && data->selected)
+		miso = d->spi_exchange(mosi, data->bus_ns);
+
+	data->bus_ns += 8000000000ULL / data->frequency;
+
+	return miso;
+}
+
+uint8_t sim_spi_dma_exchange(void* peripheral, uint8_t mosi)
+{
+	return spi_exchange((spi_platform_data*) peripheral, mosi);
+}
+
+uint64_t sim_spi_bus_time(void* peripheral)
+{
+	return ((spi_platform_data*) peripheral)->bus_ns;
+}
+
+SPI::SPI(PinName mosi, PinName miso, PinName sck, PinName ss)
+{
+	data = (spi_platform_data*) malloc(sizeof(spi_platform_data));
+
+	if (mosi == SSP1_MOSI && miso == SSP1_MISO && sck == SSP1_SCK)
+		data->ssp_index = 1;
+	else
+		data->ssp_index = 0;
+
+	data->selected = false;
+	data->bus_ns   = 0;
+
+	dma_locked = false;
+
+	set_frequency(400000);
+}
+
+uint32_t SPI::set_frequency(uint32_t f)
+{
+	// same divider rules as the real SSP with a 100MHz PCLK: PCLK / even
+	// number, no faster than asked for
+	uint32_t pclk = 100000000;
+
+	uint32_t div = (pclk + f - 1) / f;
+	if (div & 1)
+		div++;
+	if (div < 2)
+		div = 2;
+	if (div > 254 * 256)
+		div = 254 * 256;
+
+	data->frequency = pclk / div;
+
+	return data->frequency;
+}
+
+uint32_t SPI::get_frequency()
+{
+	return data->frequency;
+}
+
+uint8_t SPI::transfer(uint8_t out)
+{
+	while (dma_locked)
+		__WFI();
+
+	uint8_t r = spi_exchange(data, out);
+
+	// the CPU waits for the byte to finish
+	sim_advance_to_ns(data->bus_ns);
+
+	return r;
+}
+
+void SPI::transfer_block(const uint8_t* tx, uint8_t* rx, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		uint8_t r = transfer(tx[i]);
+		if (rx)
+			rx[i] = r;
+	}
+}
+
+void SPI::send_block(const uint8_t* tx, int length)
+{
+	for (int i = 0; i < length; i++)
+		transfer(tx[i]);
+}
+
+void SPI::recv_block(uint8_t* rx, int length, uint8_t txchar)
+{
+	for (int i = 0; i < length; i++)
+		rx[i] = transfer(txchar);
+}
+
+void SPI::dma_begin(DMA* dma, dma_direction_t direction)
+{
+	dma_locked = 1;
+}
+
+void SPI::dma_complete(DMA* dma, dma_direction_t direction)
+{
+	dma_locked = 0;
+}
+
+void SPI::dma_configure(dma_config* config)
+{
+	config->mem_or_peripheral = DMA_PERIPHERAL;
+	config->peripheral_index  = data->ssp_index * 2 + ((config->direction == DMA_SENDER)?1:0);
+	config->mem_buf           = (void*) data;
+	config->endianness        = DMA_LITTLE_ENDIAN;
+	config->word_size         = DMA_WS_8BIT;
+	config->burst_size        = DMA_BS_8;
+}
+
+void SPI::begin_transaction(void)
+{
+	data->selected = true;
+	if (devices[data->ssp_index])
+		devices[data->ssp_index]->spi_select(true, sim_now_ns());
+}
+
+void SPI::end_transaction(void)
+{
+	data->selected = false;
+	if (devices[data->ssp_index])
+		devices[data->ssp_index]->spi_select(false, sim_now_ns());
+}
@@ -0,0 +1,98 @@
+#include "Timer.h"
+
+#include <cstdlib>
+
+#include "sim.h"
+
+/*
+ * host stand-in for a hardware timer, running on simulated time
+ */
+
+struct _timer_platform_data
+{
+	Timer*          owner;
+	Timer_receiver* receiver;
+
+	bool armed;
+	bool triggered;
+};
+
+// a match and a software trigger are independent, as with the match
+// register and the NVIC pending bit on hardware
+static void timer_match_event(void* context)
+{
+	timer_platform_data* data = (timer_platform_data*) context;
+	data->armed = false;
+	data->owner->isr();
+}
+
+static void timer_trigger_event(void* context)
+{
+	timer_platform_data* data = (timer_platform_data*) context;
+	data->owner->isr();
+}
+
+Timer::Timer()
+{
+	data = (timer_platform_data*) malloc(sizeof(timer_platform_data));
+	data->owner     = this;
+	data->receiver  = NULL;
+	data->armed     = false;
+	data->triggered = false;
+}
+
+Timer::Timer(Timer_receiver* receiver)
+{
+	data = (timer_platform_data*) malloc(sizeof(timer_platform_data));
+	data->owner     = this;
+	data->receiver  = receiver;
+	data->armed     = false;
+	data->triggered = false;
+}
+
+void Timer::set_receiver(Timer_receiver* receiver)
+{
+	data->receiver = receiver;
+}
+
+void Timer::start_us(uint32_t us)
+{
+	sim_event_cancel(timer_match_event, data);
+	sim_event_at(sim_now_ns() + us * 1000ULL, timer_match_event, data);
+	data->armed = true;
+}
+
+void Timer::trigger()
+{
+	if (data->triggered)
+		return;
+
+	sim_event_at(sim_now_ns(), timer_trigger_event, data);
+	data->triggered = true;
+}
+
+void Timer::stop()
+{
+	sim_event_cancel(timer_match_event, data);
+	sim_event_cancel(timer_trigger_event, data);
+	data->armed     = false;
+	data->triggered = false;
+}
+
+int Timer::pending()
+{
+	return data->armed || data->triggered;
+}
+
+uint32_t Timer::now_us()
+{
+	return (uint32_t) (sim_now_ns() / 1000);
+}
+
+void Timer::isr()
+{
+	data->triggered = false;
+
+	if (data->receiver)
+		data->receiver->timer_expired(this);
+}
@@ -0,0 +1,13 @@
+#ifndef _MRI_H_
+#define _MRI_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/* host stand-in for the debug monitor: a breakpoint just stops the simulation */
+#define __debugbreak() do { fprintf(stderr, "__debugbreak at %s:%d\n", __FILE__, __LINE__); abort(); } while (0)
+
+static inline void __mriInit(const char*) {}
+
+#endif /* _MRI_H_ */
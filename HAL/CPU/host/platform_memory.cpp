@@ -0,0 +1,8 @@
+#include "platform_memory.h"
+
+// stand-ins for the two 16k AHB SRAM banks
+static uint32_t ahb0_ram[16384 / 4];
+static uint32_t ahb1_ram[16384 / 4];
+
+MemoryPool AHB0(ahb0_ram, sizeof(ahb0_ram));
+MemoryPool AHB1(ahb1_ram, sizeof(ahb1_ram));
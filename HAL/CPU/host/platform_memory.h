@@ -0,0 +1,9 @@
+#ifndef _PLATFORM_MEMORY_H
+#define _PLATFORM_MEMORY_H
+
+#include "MemoryPool.h"
+
+extern MemoryPool AHB0;
+extern MemoryPool AHB1;
+
+#endif /* _PLATFORM_MEMORY_H */
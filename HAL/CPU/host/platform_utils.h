@@ -0,0 +1,26 @@
+#ifndef _PLATFORM_UTILS_H
+#define _PLATFORM_UTILS_H
+
+#include <mri.h>
+
+#include "sim.h"
+
+#define htonl(l) __builtin_bswap32(l)
+#define ntohl(l) __builtin_bswap32(l)
+#define htons(l) __builtin_bswap16(l)
+#define ntohs(l) __builtin_bswap16(l)
+
+#define __disable_irq() sim_irq_disable()
+#define __enable_irq()  sim_irq_enable()
+#define __WFI()         sim_wfi()
+
+// masking nests in the simulator, so there's nothing to remember
+static inline uint32_t irq_save(void)      { sim_irq_disable(); return 0; }
+static inline void     irq_restore(uint32_t) { sim_irq_enable(); }
+
+// simulated time, counted as if by a 100MHz core
+static inline void     cycle_counter_init(void) {}
+static inline uint32_t cycle_counter(void)      { return sim_now_ns() / 10; }
+static inline uint32_t cycle_counter_hz(void)   { return 100000000; }
+
+#endif /* _PLATFORM_UTILS_H */
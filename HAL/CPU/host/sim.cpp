@@ -0,0 +1,135 @@
+#include "sim.h"
+
+#include <cstdlib>
+#include <cstdio>
+
+#include "mri.h"
+
+struct sim_event
+{
+	uint64_t     time;
+	uint64_t     seq;
+	sim_event_fn fn;
+	void*        context;
+
+	sim_event*   next;
+};
+
+static uint64_t   now_ns    = 0;
+static uint64_t   event_seq = 0;
+static sim_event* events    = NULL;
+
+static int        in_isr    = 0;
+static int        irq_off   = 0;
+static uint64_t   isr_longest = 0;
+
+uint64_t sim_now_ns()
+{
+	return now_ns;
+}
+
+void sim_advance_ns(uint64_t ns)
+{
+	now_ns += ns;
+}
+
+void sim_advance_to_ns(uint64_t t)
+{
+	if (t > now_ns)
+		now_ns = t;
+}
+
+void sim_event_at(uint64_t t, sim_event_fn fn, void* context)
+{
+	sim_event* e = (sim_event*) malloc(sizeof(sim_event));
+
+	e->time    = t;
+	e->seq     = event_seq++;
+	e->fn      = fn;
+	e->context = context;
+
+	// keep the list sorted by time, then by order of arrival
+	sim_event** p = &events;
+	while (*p && ((*p)->time <= t))
+		p = &(*p)->next;
+
+	e->next = *p;
+	*p = e;
+}
+
+void sim_event_cancel(sim_event_fn fn, void* context)
+{
+	sim_event** p = &events;
+	while (*p)
+	{
+		if (((*p)->fn == fn) && ((*p)->context == context))
+		{
+			sim_event* e = *p;
+			*p = e->next;
+			free(e);
+		}
+		else
+			p = &(*p)->next;
+	}
+}
+
+static void sim_deliver(sim_event* e)
+{
+	sim_advance_to_ns(e->time);
+
+	uint64_t t0 = now_ns;
+
+	in_isr++;
+	e->fn(e->context);
+	in_isr--;
+
+	if (now_ns - t0 > isr_longest)
+		isr_longest = now_ns - t0;
+
+	free(e);
+}
+
+int sim_wfi()
+{
+	// interrupts can't nest, and can't be delivered while masked
+	if (in_isr || irq_off)
+		return 0;
+
+	if (events == NULL)
+		return 0;
+
+	if (events->time > now_ns)
+		sim_advance_to_ns(events->time);
+
+	while (events && (events->time <= now_ns))
+	{
+		sim_event* e = events;
+		events = e->next;
+		sim_deliver(e);
+	}
+
+	return 1;
+}
+
+int sim_in_isr()
+{
+	return in_isr;
+}
+
+uint64_t sim_isr_longest_ns()
+{
+	uint64_t t = isr_longest;
+	isr_longest = 0;
+	return t;
+}
+
+void sim_irq_disable()
+{
+	irq_off++;
+}
+
+void sim_irq_enable()
+{
+	if (irq_off)
+		irq_off--;
+}
@@ -0,0 +1,39 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <cstdint>
+
+/*
+ * host simulation core
+ *
+ * there's no real concurrency on the host. Instead, time is virtual: it only
+ * moves forward when bytes cross a simulated bus or the CPU sleeps in __WFI(),
+ * and anything that would be an interrupt on hardware is queued as an event
+ * and delivered from __WFI()
+ */
+
+typedef void (*sim_event_fn)(void* context);
+
+uint64_t sim_now_ns(void);
+void     sim_advance_ns(uint64_t ns);
+void     sim_advance_to_ns(uint64_t t);
+
+// queue fn(context) to run as an interrupt at (or after) time t
+void     sim_event_at(uint64_t t, sim_event_fn fn, void* context);
+// remove any queued events for (fn, context)
+void     sim_event_cancel(sim_event_fn fn, void* context);
+
+// deliver everything due. If nothing is due, skip ahead to the next event
+// and deliver that. Returns 0 if there was nothing to do at all
+int      sim_wfi(void);
+
+// are we currently delivering an event?
+int      sim_in_isr(void);
+
+// longest any event has run for since the last call, in simulated time
+uint64_t sim_isr_longest_ns(void);
+
+void     sim_irq_disable(void);
+void     sim_irq_enable(void);
+
+#endif /* _SIM_H */
@@ -0,0 +1,24 @@
+#ifndef _SIM_SPI_H
+#define _SIM_SPI_H
+
+#include <cstdint>
+
+/*
+ * something on the far end of a simulated SSP port
+ */
+class SimSPIDevice
+{
+public:
+	// one byte each way. t_ns is the bus time of this byte
+	virtual uint8_t spi_exchange(uint8_t mosi, uint64_t t_ns) = 0;
+	virtual void    spi_select(bool selected, uint64_t t_ns) = 0;
+};
+
+void sim_spi_attach(int ssp_index, SimSPIDevice*);
+
+// used by the DMA stand-in to clock bytes through an SPI whose dma_configure
+// handed it this peripheral address
+uint8_t  sim_spi_dma_exchange(void* peripheral, uint8_t mosi);
+uint64_t sim_spi_bus_time(void* peripheral);
+
+#endif /* _SIM_SPI_H */
@@ -14,7 +14,10 @@ class SPI : public DMA_receiver
 public:
 	SPI(PinName mosi, PinName miso, PinName sck, PinName ss);
 	
-	void    set_frequency(uint32_t frequency);
+	// fastest clock the port can make without going over frequency.
+	// returns what it settled on
+	uint32_t set_frequency(uint32_t frequency);
+	uint32_t get_frequency(void);
 	
 	void    begin_transaction(void);
 	void    end_transaction(void);
@@ -0,0 +1,53 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <cstdint>
+
+/*
+ * one-shot microsecond timer
+ *
+ * each Timer claims its own hardware timer, whose counter also serves as a
+ * free-running microsecond timebase
+ */
+
+class Timer;
+
+/*
+ * receiver interface class
+ */
+
+class Timer_receiver
+{
+public:
+	virtual void timer_expired(Timer*) = 0;
+};
+
+struct _timer_platform_data;
+typedef struct _timer_platform_data timer_platform_data;
+
+class Timer
+{
+public:
+	Timer();
+	Timer(Timer_receiver*);
+
+	void     set_receiver(Timer_receiver*);
+
+	// fire once, us microseconds from now. Replaces any pending expiry
+	void     start_us(uint32_t us);
+	// fire as soon as possible, from interrupt context
+	void     trigger(void);
+	void     stop(void);
+
+	int      pending(void);
+
+	// free-running, wraps every 2^32 us
+	uint32_t now_us(void);
+
+	void     isr(void);
+
+private:
+	timer_platform_data* data;
+};
+
+#endif /* _TIMER_H */
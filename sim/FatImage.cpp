@@ -0,0 +1,403 @@
+#include "FatImage.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PARTITION_LBA 2048
+
+static void put16(uint8_t* p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t* p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+
+FatImage::FatImage(const char* image, uint8_t fat_type, uint32_t n_sectors, uint8_t sectors_per_cluster)
+{
+	type = fat_type;
+	spc  = sectors_per_cluster;
+
+	fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || ftruncate(fd, ((off_t) n_sectors) << 9))
+	{
+		perror(image);
+		exit(1);
+	}
+
+	partition_lba = PARTITION_LBA;
+
+	uint32_t part_sectors = n_sectors - partition_lba;
+	uint32_t reserved     = (type == 32)?32:1;
+	uint32_t root_sectors = (type == 32)?0:32; // 512 entries
+
+	// smallest FAT that covers the clusters left after it
+	for (sectors_per_fat = 1; ; sectors_per_fat++)
+	{
+		n_clusters = (part_sectors - reserved - root_sectors - 2 * sectors_per_fat) / spc;
+		if ((((n_clusters + 2) * type + 7) / 8) <= (sectors_per_fat << 9))
+			break;
+	}
+
+	fat_lba  = partition_lba + reserved;
+	root_lba = fat_lba + 2 * sectors_per_fat;
+	data_lba = root_lba + root_sectors;
+
+	fat.assign(n_clusters + 2, 0);
+	fat[0] = eoc() & ~7;
+	fat[1] = eoc();
+
+	uint8_t s[512];
+
+	// MBR, one partition
+	memset(s, 0, 512);
+	uint8_t* p = s + 446;
+	p[4] = (type == 32)?0x0C:(type == 16)?0x06:0x01;
+	put32(p + 8,  partition_lba);
+	put32(p + 12, part_sectors);
+	s[510] = 0x55; s[511] = 0xAA;
+	write_sector(0, s);
+
+	// boot sector
+	memset(s, 0, 512);
+	s[0] = 0xEB; s[1] = 0x58; s[2] = 0x90;
+	memcpy(s + 3, "SDSIM   ", 8);
+	put16(s + 11, 512);
+	s[13] = spc;
+	put16(s + 14, reserved);
+	s[16] = 2;
+	put16(s + 17, root_sectors * 16);
+	if ((part_sectors < 65536) && (type != 32))
+		put16(s + 19, part_sectors);
+	else
+		put32(s + 32, part_sectors);
+	s[21] = 0xF8;
+	put16(s + 24, 63);
+	put16(s + 26, 255);
+	put32(s + 28, partition_lba);
+	if (type == 32)
+	{
+		put32(s + 36, sectors_per_fat);
+		put32(s + 44, 2);  // root cluster
+		put16(s + 48, 1);  // FSInfo
+		put16(s + 50, 6);  // backup boot sector
+		s[64] = 0x80;
+		s[66] = 0x29;
+		memcpy(s + 71, "NO NAME    FAT32   ", 19);
+	}
+	else
+	{
+		put16(s + 22, sectors_per_fat);
+		s[36] = 0x80;
+		s[38] = 0x29;
+		memcpy(s + 43, (type == 16)?"NO NAME    FAT16   ":"NO NAME    FAT12   ", 19);
+	}
+	s[510] = 0x55; s[511] = 0xAA;
+	write_sector(partition_lba, s);
+	if (type == 32)
+		write_sector(partition_lba + 6, s);
+
+	next_free = 2;
+
+	dir_t root;
+	root.first     = 0;
+	root.n_entries = 0;
+	root.n_aliases = 0;
+	if (type == 32)
+	{
+		root.first = alloc_cluster(0);
+		root.chain.push_back(root.first);
+	}
+	root_cluster = root.first;
+	dirs.push_back(root);
+
+	// volume label
+	uint8_t e[32];
+	memset(e, 0, 32);
+	memcpy(e, "SDSIM      ", 11);
+	e[11] = 0x08;
+	add_entry(&dirs[0], e);
+}
+
+FatImage::~FatImage()
+{
+	flush();
+	close(fd);
+}
+
+uint32_t FatImage::eoc()
+{
+	return (type == 32)?0x0FFFFFFF:(type == 16)?0xFFFF:0xFFF;
+}
+
+uint8_t FatImage::byte(uint32_t seed, uint32_t offset)
+{
+	uint32_t x = seed ^ ((offset >> 2) * 2654435761U);
+	x ^= x >> 15;
+	return x >> ((offset & 3) << 3);
+}
+
+void FatImage::write_sector(uint32_t lba, const void* data)
+{
+	if (pwrite(fd, data, 512, ((off_t) lba) << 9) != 512)
+	{
+		perror("FatImage");
+		exit(1);
+	}
+}
+
+void FatImage::zero_cluster(uint32_t cluster)
+{
+	uint8_t z[512];
+	memset(z, 0, 512);
+	for (uint32_t i = 0; i < spc; i++)
+		write_sector(cluster_lba(cluster) + i, z);
+}
+
+// next free cluster, linked on from prev if there is one
+uint32_t FatImage::alloc_cluster(uint32_t prev)
+{
+	while ((next_free < n_clusters + 2) && fat[next_free])
+		next_free++;
+	if (next_free >= n_clusters + 2)
+	{
+		fprintf(stderr, "FatImage: full\n");
+		exit(1);
+	}
+
+	uint32_t c = next_free++;
+	fat[c] = eoc();
+	if (prev)
+		fat[prev] = c;
+	return c;
+}
+
+FatImage::dir_t* FatImage::find_dir(uint32_t cluster)
+{
+	for (uint32_t i = 0; i < dirs.size(); i++)
+		if (dirs[i].first == cluster)
+			return &dirs[i];
+	fprintf(stderr, "FatImage: no directory at cluster %u\n", cluster);
+	exit(1);
+}
+
+void FatImage::add_entry(dir_t* d, const uint8_t* entry)
+{
+	uint32_t n = d->n_entries++;
+	uint32_t lba;
+
+	if (d->first == 0)
+	{
+		if (n >= 512)
+		{
+			fprintf(stderr, "FatImage: root directory full\n");
+			exit(1);
+		}
+		lba = root_lba + (n >> 4);
+	}
+	else
+	{
+		uint32_t per_cluster = spc << 4;
+		while (n / per_cluster >= d->chain.size())
+		{
+			uint32_t c = alloc_cluster(d->chain.back());
+			zero_cluster(c);
+			d->chain.push_back(c);
+		}
+		lba = cluster_lba(d->chain[n / per_cluster]) + ((n % per_cluster) >> 4);
+	}
+
+	uint8_t s[512];
+	if (pread(fd, s, 512, ((off_t) lba) << 9) != 512)
+		memset(s, 0, 512);
+	memcpy(s + ((n & 15) << 5), entry, 32);
+	write_sector(lba, s);
+}
+
+static int plain_83(const char* name)
+{
+	const char* dot = strchr(name, '.');
+	int base = dot?(dot - name):strlen(name);
+	int ext  = dot?strlen(dot + 1):0;
+
+	if ((base < 1) || (base > 8) || (ext > 3) || (dot && strchr(dot + 1, '.')))
+		return 0;
+	for (const char* c = name; *c; c++)
+		if ((c != dot) && !(isupper(*c) || isdigit(*c) || strchr("_-~!#$%&", *c)))
+			return 0;
+	return 1;
+}
+
+void FatImage::add_named(uint32_t dir, const char* name, uint8_t attr, uint32_t cluster, uint32_t size)
+{
+	dir_t* d = find_dir(dir);
+
+	uint8_t e[32];
+	memset(e, 0, 32);
+	memset(e, ' ', 11);
+
+	const char* dot = strrchr(name, '.');
+	if (plain_83(name))
+	{
+		for (int i = 0; name[i] && (name + i != dot); i++)
+			e[i] = name[i];
+		if (dot)
+			memcpy(e + 8, dot + 1, strlen(dot + 1));
+	}
+	else
+	{
+		// alias: the first six usable characters, ~N, and the extension
+		int j = 0;
+		for (const char* c = name; *c && (c != dot) && (j < 6); c++)
+			if (isalnum(*c))
+				e[j++] = toupper(*c);
+		char tail[8];
+		int  t = snprintf(tail, sizeof(tail), "~%u", ++d->n_aliases);
+		memcpy(e + j, tail, t);
+		for (int i = 0; dot && dot[i + 1] && (i < 3); i++)
+			e[8 + i] = toupper(dot[i + 1]);
+
+		uint8_t sum = 0;
+		for (int i = 0; i < 11; i++)
+			sum = ((sum & 1) << 7) + (sum >> 1) + e[i];
+
+		int len = strlen(name);
+		int n_lfn = (len + 12) / 13;
+		for (int k = n_lfn; k > 0; k--)
+		{
+			uint8_t l[32];
+			memset(l, 0, 32);
+			l[0]  = k | ((k == n_lfn)?0x40:0);
+			l[11] = 0x0F;
+			l[13] = sum;
+
+			static const uint8_t at[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+			for (int i = 0; i < 13; i++)
+			{
+				int c = (k - 1) * 13 + i;
+				uint16_t u = (c < len)?(uint8_t) name[c]:(c == len)?0:0xFFFF;
+				put16(l + at[i], u);
+			}
+			add_entry(d, l);
+		}
+	}
+
+	e[11] = attr;
+	put16(e + 20, cluster >> 16);
+	put16(e + 26, cluster);
+	put32(e + 28, size);
+	add_entry(d, e);
+}
+
+uint32_t FatImage::mkdir(uint32_t dir, const char* name)
+{
+	uint32_t c = alloc_cluster(0);
+	zero_cluster(c);
+
+	dir_t nd;
+	nd.first     = c;
+	nd.chain.push_back(c);
+	nd.n_entries = 0;
+	nd.n_aliases = 0;
+	dirs.push_back(nd);
+
+	uint8_t e[32];
+	memset(e, 0, 32);
+	memset(e, ' ', 11);
+	e[11] = 0x10;
+
+	e[0] = '.';
+	put16(e + 20, c >> 16);
+	put16(e + 26, c);
+	add_entry(&dirs.back(), e);
+
+	e[1] = '.';
+	put16(e + 20, dir >> 16);
+	put16(e + 26, dir);
+	add_entry(&dirs.back(), e);
+
+	add_named(dir, name, 0x10, c, 0);
+	return c;
+}
+
+uint32_t FatImage::add_file(uint32_t dir, const char* name, uint32_t size, uint32_t seed, uint32_t fragment)
+{
+	uint32_t first = 0, prev = 0;
+	uint32_t bytes = cluster_bytes();
+
+	for (uint32_t off = 0, n = 0; off < size; off += bytes, n++)
+	{
+		if (fragment && n && ((n % fragment) == 0))
+		{
+			// leave a hole
+			while (fat[next_free])
+				next_free++;
+			next_free++;
+		}
+
+		uint32_t c = alloc_cluster(prev);
+		if (first == 0)
+			first = c;
+		prev = c;
+
+		uint8_t s[512];
+		for (uint32_t i = 0; (i < spc) && (off + (i << 9) < size); i++)
+		{
+			for (uint32_t b = 0; b < 512; b++)
+				s[b] = byte(seed, off + (i << 9) + b);
+			write_sector(cluster_lba(c) + i, s);
+		}
+	}
+
+	add_named(dir, name, 0x20, first, size);
+	return first;
+}
+
+void FatImage::flush()
+{
+	uint32_t bytes = sectors_per_fat << 9;
+	std::vector<uint8_t> f(bytes, 0);
+
+	for (uint32_t c = 0; c < fat.size(); c++)
+	{
+		if (type == 32)
+			put32(&f[c * 4], fat[c]);
+		else if (type == 16)
+			put16(&f[c * 2], fat[c]);
+		else
+		{
+			uint32_t o = c + (c >> 1);
+			if (c & 1)
+			{
+				f[o]     = (f[o] & 0x0F) | ((fat[c] << 4) & 0xF0);
+				f[o + 1] = fat[c] >> 4;
+			}
+			else
+			{
+				f[o]     = fat[c];
+				f[o + 1] = (f[o + 1] & 0xF0) | ((fat[c] >> 8) & 0x0F);
+			}
+		}
+	}
+
+	for (uint32_t copy = 0; copy < 2; copy++)
+		for (uint32_t i = 0; i < sectors_per_fat; i++)
+			write_sector(fat_lba + copy * sectors_per_fat + i, &f[i << 9]);
+
+	if (type == 32)
+	{
+		uint32_t n_free = 0;
+		for (uint32_t c = 2; c < fat.size(); c++)
+			if (fat[c] == 0)
+				n_free++;
+
+		uint8_t s[512];
+		memset(s, 0, 512);
+		put32(s,       0x41615252);
+		put32(s + 484, 0x61417272);
+		put32(s + 488, n_free);
+		put32(s + 492, next_free);
+		put32(s + 508, 0xAA550000);
+		write_sector(partition_lba + 1, s);
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef _FATIMAGE_H
+#define _FATIMAGE_H
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * builds a FAT12, FAT16 or FAT32 filesystem in a disk image, behind an MBR
+ * with one partition, so the FAT layer has something to mount
+ *
+ * file contents come from byte(), so a reader can check what it got back
+ * without keeping a copy. Names that aren't plain upper case 8.3 get long
+ * name entries in front of a NAME~N.EXT alias, the way Windows does it
+ *
+ * everything goes straight to the image except the FATs and FSInfo, which
+ * are written by flush()
+ */
+class FatImage
+{
+public:
+	FatImage(const char* image, uint8_t fat_type, uint32_t n_sectors, uint8_t sectors_per_cluster);
+	~FatImage();
+
+	// directory handle of the root: its first cluster, or 0 for a fixed
+	// FAT12/16 root directory
+	uint32_t root(void) { return root_cluster; }
+
+	uint32_t mkdir(uint32_t dir, const char* name);
+
+	/*
+	 * a file of size bytes. With fragment set, a free cluster is left
+	 * after every fragment clusters, so the chain isn't one contiguous run
+	 */
+	uint32_t add_file(uint32_t dir, const char* name, uint32_t size, uint32_t seed, uint32_t fragment = 0);
+
+	void flush(void);
+
+	static uint8_t byte(uint32_t seed, uint32_t offset);
+
+	uint32_t partition_lba;
+	uint32_t fat_lba;
+	uint32_t sectors_per_fat;
+	uint32_t data_lba;
+	uint32_t n_clusters;
+
+	uint32_t cluster_bytes(void) { return spc << 9; }
+	uint32_t cluster_lba(uint32_t cluster) { return data_lba + (cluster - 2) * spc; }
+
+	std::vector<uint32_t> fat;
+
+protected:
+	struct dir_t {
+		uint32_t first;
+		std::vector<uint32_t> chain;
+		uint32_t n_entries;
+		uint32_t n_aliases;
+	};
+
+	int      fd;
+	uint8_t  type;
+	uint8_t  spc;
+	uint32_t root_cluster;
+	uint32_t root_lba;      // fixed root only
+	uint32_t next_free;
+
+	std::vector<dir_t> dirs;
+
+	void     write_sector(uint32_t lba, const void* data);
+	void     zero_cluster(uint32_t cluster);
+	uint32_t alloc_cluster(uint32_t prev);
+	dir_t*   find_dir(uint32_t cluster);
+	void     add_entry(dir_t* d, const uint8_t* entry);
+	void     add_named(uint32_t dir, const char* name, uint8_t attr, uint32_t cluster, uint32_t size);
+	uint32_t eoc(void);
+};
+
+#endif /* _FATIMAGE_H */
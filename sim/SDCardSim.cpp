@@ -0,0 +1,542 @@
+#include "SDCardSim.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define R1_IDLE           0x01
+#define R1_ILLEGAL_CMD    0x04
+#define R1_CRC_ERROR      0x08
+#define R1_ERASE_SEQ_ERROR 0x10
+#define R1_ADDRESS_ERROR  0x20
+#define R1_PARAM_ERROR    0x40
+
+#define TOKEN_START_BLOCK       0xFE
+#define TOKEN_START_BLOCK_MULTI 0xFC
+#define TOKEN_STOP_TRAN         0xFD
+
+#define DATA_ACCEPTED     0x05
+#define DATA_CRC_ERROR    0x0B
+
+// store a field the same way SD::ext_bits reads it back
+static void set_bits(uint8_t* data, int msb, int lsb, uint32_t value)
+{
+	for (int i = lsb; i <= msb; i++)
+	{
+		int byte = 15 - (i >> 3);
+		int bit = i & 7;
+
+		if (value & (1UL << (i - lsb)))
+			data[byte] |= (1 << bit);
+		else
+			data[byte] &= ~(1 << bit);
+	}
+}
+
+uint8_t SDCardSim::crc7(const uint8_t* data, int length)
+{
+	uint8_t crc = 0;
+
+	for (int i = 0; i < length; i++)
+	{
+		uint8_t d = data[i];
+		for (int j = 0; j < 8; j++)
+		{
+			crc <<= 1;
+			if ((d & 0x80) ^ (crc & 0x80))
+				crc ^= 0x09;
+			d <<= 1;
+		}
+	}
+
+	return crc & 0x7F;
+}
+
+uint16_t SDCardSim::crc16(const uint8_t* data, int length)
+{
+	uint16_t crc = 0;
+
+	for (int i = 0; i < length; i++)
+	{
+		crc ^= ((uint16_t) data[i]) << 8;
+		for (int j = 0; j < 8; j++)
+			crc = (crc & 0x8000)?((crc << 1) ^ 0x1021):(crc << 1);
+	}
+
+	return crc;
+}
+
+SDCardSim::SDCardSim(const char* image, bool sdhc)
+{
+	fd = open(image, O_RDWR);
+	if (fd < 0)
+	{
+		perror(image);
+		exit(1);
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+
+	sectors = st.st_size / 512;
+
+	this->sdhc = sdhc;
+
+	// something like a reasonable class 10 card
+	timing.init_us        = 50000;
+	timing.read_access_us = 400;
+	timing.read_next_us   = 40;
+	timing.write_busy_us  = 600;
+	timing.stop_busy_us   = 200;
+	timing.erase_busy_us  = 2000;
+
+	memset(&stats, 0, sizeof(stats));
+
+	high_speed_capable = true;
+	high_speed         = false;
+	fail_writes        = 0;
+	fail_reads         = 0;
+	error_read         = 0;
+	reg_len            = 0;
+
+	selected   = false;
+	idle       = true;
+	app_cmd    = false;
+	crc_on     = false;
+	init_start = 0;
+
+	state      = SIM_IDLE;
+	after_busy = SIM_IDLE;
+	busy_until = 0;
+	ready_at   = 0;
+	multi      = false;
+	sector     = 0;
+	erase_start = erase_end = 0xFFFFFFFF;
+	cmd_len    = 0;
+	block_len  = 0;
+
+	memset(csd, 0, sizeof(csd));
+	if (sdhc)
+	{
+		set_bits(csd, 127, 126, 1);           // CSD version 2.0
+		set_bits(csd, 119, 112, 0x0E);        // TAAC: 1.0ms
+		set_bits(csd,  69,  48, (sectors >> 10) - 1);
+	}
+	else
+	{
+		// SDSC: capacity = (C_SIZE + 1) * 2^(C_SIZE_MULT + 2) * 2^READ_BL_LEN
+		uint32_t mult = 7;
+		while ((mult > 0) && ((sectors >> (mult + 2)) > 4096))
+			mult--;
+		set_bits(csd, 119, 112, 0x26);        // TAAC: 1.5ms
+		set_bits(csd, 110, 104, 0);
+		set_bits(csd,  73,  62, (sectors >> (mult + 2)) - 1);
+		set_bits(csd,  49,  47, mult);
+	}
+	set_bits(csd, 103,  96, 0x32);            // TRAN_SPEED: 25MHz
+	set_bits(csd,  95,  84, 0x5B5);           // CCC
+	set_bits(csd,  83,  80, 9);               // READ_BL_LEN: 512
+	set_bits(csd,  46,  46, 1);               // ERASE_BLK_EN
+	set_bits(csd,  45,  39, 0x7F);            // SECTOR_SIZE: 128 blocks
+	set_bits(csd,  28,  26, 2);               // R2W_FACTOR: x4
+	set_bits(csd,  25,  22, 9);               // WRITE_BL_LEN: 512
+	csd[15] = (crc7(csd, 15) << 1) | 1;
+
+	memset(cid, 0, sizeof(cid));
+	cid[0] = 0x53;                            // MID
+	cid[1] = 'S'; cid[2] = 'M';               // OID
+	memcpy(&cid[3], "SIMSD", 5);              // PNM
+	cid[8] = 0x10;                            // PRV 1.0
+	cid[9] = 0x12; cid[10] = 0x34; cid[11] = 0x56; cid[12] = 0x78;
+	cid[13] = 0x01; cid[14] = 0x9A;           // MDT
+	cid[15] = (crc7(cid, 15) << 1) | 1;
+}
+
+SDCardSim::~SDCardSim()
+{
+	close(fd);
+}
+
+void SDCardSim::read_sector(uint32_t s, uint8_t* buf)
+{
+	if (pread(fd, buf, 512, ((off_t) s) * 512) != 512)
+		memset(buf, 0, 512);
+	stats.blocks_read++;
+}
+
+void SDCardSim::write_sector(uint32_t s, const uint8_t* buf)
+{
+	if (pwrite(fd, buf, 512, ((off_t) s) * 512) != 512)
+		perror("SDCardSim: write");
+	stats.blocks_written++;
+}
+
+bool SDCardSim::address(uint32_t arg, uint32_t* s)
+{
+	if (sdhc == false)
+	{
+		if (arg & 511)
+			return false;
+		arg >>= 9;
+	}
+
+	*s = arg;
+
+	return arg < sectors;
+}
+
+void SDCardSim::r1(uint8_t extra_flags)
+{
+	// N_CR: one filler byte before the response
+	out.push_back(0xFF);
+	out.push_back((idle?R1_IDLE:0) | extra_flags);
+}
+
+void SDCardSim::data_block(const uint8_t* data, int length)
+{
+	uint16_t crc = crc16(data, length);
+
+	out.push_back(TOKEN_START_BLOCK);
+	for (int i = 0; i < length; i++)
+		out.push_back(data[i]);
+	if ((length == 512) && fail_reads)
+	{
+		fail_reads--;
+		out[out.size() - 100] ^= 0x10;
+	}
+	out.push_back(crc >> 8);
+	out.push_back(crc & 0xFF);
+}
+
+void SDCardSim::command(uint64_t t_ns)
+{
+	int      index = cmd[0] & 0x3F;
+	uint32_t arg   = (cmd[1] << 24) | (cmd[2] << 16) | (cmd[3] << 8) | cmd[4];
+
+	bool acmd = app_cmd;
+	app_cmd = false;
+
+	if (acmd)
+		stats.acmd[index]++;
+	else
+		stats.cmd[index]++;
+
+	// CMD0 and CMD8 are always checked
+	if (crc_on || (index == 0) || (index == 8))
+	{
+		if ((cmd[5] >> 1) != crc7(cmd, 5))
+		{
+			stats.crc_errors++;
+			r1(R1_CRC_ERROR);
+			return;
+		}
+	}
+
+	if (acmd)
+	{
+		switch (index)
+		{
+			case 41:
+				if (init_start == 0)
+					init_start = t_ns;
+				if ((t_ns - init_start) >= (timing.init_us * 1000ULL))
+					idle = false;
+				r1(0);
+				return;
+			case 23:
+				// pre-erase count. We don't model the saving
+				stats.pre_erase = arg & 0x7FFFFF;
+				r1(0);
+				return;
+			default:
+				// fall through to the normal command set
+				break;
+		}
+	}
+
+	switch (index)
+	{
+		case 0:
+			idle       = true;
+			high_speed = false;
+			init_start = 0;
+			crc_on     = false;
+			state      = SIM_IDLE;
+			r1(0);
+			return;
+		case 6:
+		{
+			if (idle)
+			{
+				r1(R1_ILLEGAL_CMD);
+				return;
+			}
+
+			// only function group 1 (access mode) means anything here
+			uint32_t fn = arg & 0xF;
+			bool ok = (fn == 0) || (fn == 0xF) || ((fn == 1) && high_speed_capable);
+
+			memset(reg, 0, sizeof(reg));
+			reg[0]  = 0x00; reg[1] = 0xC8;                 // 200mA
+			reg[12] = 0x80; reg[13] = high_speed_capable?0x03:0x01;
+			reg[16] = ok?((fn == 0xF)?(high_speed?1:0):fn):0xF;
+			reg_len = 64;
+
+			if (ok && (arg & 0x80000000) && (fn == 1) && !high_speed)
+			{
+				// TRAN_SPEED goes to 50MHz
+				high_speed = true;
+				set_bits(csd, 103, 96, 0x5A);
+				csd[15] = (crc7(csd, 15) << 1) | 1;
+			}
+
+			r1(0);
+			multi    = false;
+			state    = SIM_READ_WAIT;
+			ready_at = t_ns + (timing.read_access_us * 1000ULL);
+			return;
+		}
+		case 8:
+			r1(0);
+			out.push_back(0x00);
+			out.push_back(0x00);
+			out.push_back((arg >> 8) & 0x0F);
+			out.push_back(arg & 0xFF);
+			return;
+		case 9:
+			r1(0);
+			out.push_back(0xFF);
+			data_block(csd, 16);
+			return;
+		case 10:
+			r1(0);
+			out.push_back(0xFF);
+			data_block(cid, 16);
+			return;
+		case 12:
+			// stuff byte, then R1b
+			out.push_back(0xFF);
+			r1(0);
+			state      = SIM_BUSY;
+			after_busy = SIM_IDLE;
+			busy_until = t_ns + (timing.stop_busy_us * 1000ULL);
+			return;
+		case 17:
+		case 18:
+			if (idle || !address(arg, &sector))
+			{
+				r1(idle?R1_ILLEGAL_CMD:R1_ADDRESS_ERROR);
+				return;
+			}
+			r1(0);
+			multi    = (index == 18);
+			state    = SIM_READ_WAIT;
+			ready_at = t_ns + (timing.read_access_us * 1000ULL);
+			return;
+		case 24:
+		case 25:
+			if (idle || !address(arg, &sector))
+			{
+				r1(idle?R1_ILLEGAL_CMD:R1_ADDRESS_ERROR);
+				return;
+			}
+			r1(0);
+			multi = (index == 25);
+			state = SIM_WRITE_WAIT_TOKEN;
+			return;
+		case 32:
+		case 33:
+			if (idle || !address(arg, (index == 32)?&erase_start:&erase_end))
+			{
+				r1(idle?R1_ILLEGAL_CMD:R1_ADDRESS_ERROR);
+				return;
+			}
+			r1(0);
+			return;
+		case 38:
+		{
+			if ((erase_start >= sectors) || (erase_end >= sectors) || (erase_end < erase_start))
+			{
+				erase_start = erase_end = 0xFFFFFFFF;
+				r1(R1_ERASE_SEQ_ERROR);
+				return;
+			}
+
+			// erased blocks read back as 0s
+			uint8_t zero[512];
+			memset(zero, 0, sizeof(zero));
+			for (uint32_t s = erase_start; s <= erase_end; s++)
+			{
+				if (pwrite(fd, zero, 512, ((off_t) s) * 512) != 512)
+					perror("SDCardSim: erase");
+				stats.blocks_erased++;
+			}
+			erase_start = erase_end = 0xFFFFFFFF;
+
+			r1(0);
+			state      = SIM_BUSY;
+			after_busy = SIM_IDLE;
+			busy_until = t_ns + (timing.erase_busy_us * 1000ULL);
+			return;
+		}
+		case 55:
+			app_cmd = true;
+			r1(0);
+			return;
+		case 58:
+			r1(0);
+			out.push_back((idle?0x00:0x80) | ((sdhc && !idle)?0x40:0x00));
+			out.push_back(0xFF);
+			out.push_back(0x80);
+			out.push_back(0x00);
+			return;
+		case 59:
+			crc_on = arg & 1;
+			r1(0);
+			return;
+		default:
+			r1(R1_ILLEGAL_CMD);
+			return;
+	}
+}
+
+uint8_t SDCardSim::spi_exchange(uint8_t mosi, uint64_t t_ns)
+{
+	uint8_t miso = 0xFF;
+
+	// what the card drives this byte
+	if (out.size())
+	{
+		miso = out.front();
+		out.pop_front();
+	}
+	else switch (state)
+	{
+		case SIM_BUSY:
+			if (t_ns < busy_until)
+				miso = 0x00;
+			else
+				state = after_busy;
+			break;
+		case SIM_READ_WAIT:
+			if ((t_ns >= ready_at) && reg_len)
+			{
+				data_block(reg, reg_len);
+				reg_len = 0;
+				state = SIM_READ_DATA;
+			}
+			else if ((t_ns >= ready_at) && error_read && (--error_read == 0))
+			{
+				// card ECC failed
+				out.push_back(0x04);
+				state = SIM_IDLE;
+			}
+			else if (t_ns >= ready_at)
+			{
+				uint8_t buf[512];
+				read_sector(sector, buf);
+				data_block(buf, 512);
+				state = SIM_READ_DATA;
+			}
+			break;
+		case SIM_READ_DATA:
+			// last byte of the block has gone out
+			if (multi && (sector + 1 < sectors))
+			{
+				sector++;
+				state    = SIM_READ_WAIT;
+				ready_at = t_ns + (timing.read_next_us * 1000ULL);
+			}
+			else
+				state = SIM_IDLE;
+			break;
+		default:
+			break;
+	}
+
+	// what the card does with the host's byte
+	switch (state)
+	{
+		case SIM_WRITE_WAIT_TOKEN:
+			if ((multi == false) && (mosi == TOKEN_START_BLOCK))
+			{
+				state = SIM_WRITE_DATA;
+				block_len = 0;
+			}
+			else if (multi && (mosi == TOKEN_START_BLOCK_MULTI))
+			{
+				state = SIM_WRITE_DATA;
+				block_len = 0;
+			}
+			else if (multi && (mosi == TOKEN_STOP_TRAN))
+			{
+				// N_BR: one byte before busy
+				out.push_back(0xFF);
+				state      = SIM_BUSY;
+				after_busy = SIM_IDLE;
+				busy_until = t_ns + (timing.stop_busy_us * 1000ULL);
+			}
+			break;
+		case SIM_WRITE_DATA:
+			block[block_len++] = mosi;
+			if (block_len == 514)
+			{
+				uint16_t crc = (block[512] << 8) | block[513];
+				if ((crc_on && (crc != crc16(block, 512))) || fail_writes)
+				{
+					if (fail_writes)
+						fail_writes--;
+					stats.crc_errors++;
+					out.push_back(DATA_CRC_ERROR);
+					state      = SIM_BUSY;
+					after_busy = SIM_IDLE;
+					busy_until = t_ns;
+					break;
+				}
+
+				write_sector(sector, block);
+				out.push_back(DATA_ACCEPTED);
+
+				state      = SIM_BUSY;
+				after_busy = SIM_IDLE;
+				busy_until = t_ns + (timing.write_busy_us * 1000ULL);
+
+				if (multi && (sector + 1 < sectors))
+				{
+					sector++;
+					after_busy = SIM_WRITE_WAIT_TOKEN;
+				}
+			}
+			break;
+		case SIM_BUSY:
+			break;
+		default:
+			// a command can start whenever we're not mid-write
+			if (cmd_len || ((mosi & 0xC0) == 0x40))
+			{
+				cmd[cmd_len++] = mosi;
+				if (cmd_len == 6)
+				{
+					cmd_len = 0;
+					out.clear();
+					command(t_ns);
+				}
+			}
+			break;
+	}
+
+	return miso;
+}
+
+void SDCardSim::spi_select(bool selected, uint64_t t_ns)
+{
+	this->selected = selected;
+
+	// a partial command is lost when CS goes high
+	if (selected == false)
+		cmd_len = 0;
+}
@@ -0,0 +1,129 @@
+#ifndef _SDCARDSIM_H
+#define _SDCARDSIM_H
+
+#include <cstdint>
+#include <deque>
+
+#include "sim_spi.h"
+
+/*
+ * SD card in SPI mode, backed by a raw disk image
+ *
+ * implements enough of the SPI-mode command set for our driver:
+ * CMD0/6/8/9/10/12/17/18/24/25/32/33/38/55/58/59 and ACMD23/41
+ *
+ * timing is modelled on simulated bus time so that throughput and latency
+ * measured against it mean something
+ */
+
+struct sd_sim_timing
+{
+	uint32_t init_us;        // ACMD41 reports busy for this long after the first one
+	uint32_t read_access_us; // CMD17/CMD18 to first data token
+	uint32_t read_next_us;   // between blocks of a CMD18
+	uint32_t write_busy_us;  // programming time after each written block
+	uint32_t stop_busy_us;   // busy after CMD12 or a stop-tran token
+	uint32_t erase_busy_us;  // busy after CMD38
+};
+
+struct sd_sim_stats
+{
+	uint32_t cmd[64];        // commands received, by index
+	uint32_t acmd[64];
+
+	uint32_t blocks_read;
+	uint32_t blocks_written;
+	uint32_t blocks_erased;
+	uint32_t pre_erase;      // count from the last ACMD23
+
+	uint32_t crc_errors;     // commands or data blocks that failed CRC
+};
+
+class SDCardSim : public SimSPIDevice
+{
+public:
+	SDCardSim(const char* image, bool sdhc);
+	~SDCardSim();
+
+	uint32_t n_sectors(void) { return sectors; }
+
+	sd_sim_timing timing;
+	sd_sim_stats  stats;
+
+	bool     high_speed_capable; // accepts a CMD6 switch to high speed
+	bool     high_speed;
+
+	// fault injection: answer this many of the next written blocks with a
+	// CRC error, as if they'd been garbled on the way
+	uint32_t fail_writes;
+
+	// and garble this many of the next blocks we send, leaving their CRC
+	// as it was
+	uint32_t fail_reads;
+
+	// send an error token instead of the block this many from now, 1
+	// being the next, as a card does when it can't read one
+	uint32_t error_read;
+
+	// implementation of SimSPIDevice
+	uint8_t spi_exchange(uint8_t mosi, uint64_t t_ns);
+	void    spi_select(bool selected, uint64_t t_ns);
+
+	static uint8_t  crc7(const uint8_t* data, int length);
+	static uint16_t crc16(const uint8_t* data, int length);
+
+protected:
+	enum state_t {
+		SIM_IDLE,
+		SIM_READ_WAIT,
+		SIM_READ_DATA,
+		SIM_WRITE_WAIT_TOKEN,
+		SIM_WRITE_DATA,
+		SIM_BUSY
+	};
+
+	int      fd;
+	uint32_t sectors;
+	bool     sdhc;
+
+	bool     selected;
+	bool     idle;          // R1 in_idle_state
+	bool     app_cmd;       // last command was CMD55
+	bool     crc_on;        // CMD59
+	uint64_t init_start;    // first ACMD41, 0 if not yet
+
+	state_t  state;
+	state_t  after_busy;
+	uint64_t busy_until;
+	uint64_t ready_at;
+
+	bool     multi;
+	uint32_t sector;
+	uint32_t erase_start;   // CMD32
+	uint32_t erase_end;     // CMD33
+
+	uint8_t  cmd[6];
+	int      cmd_len;
+
+	uint8_t  block[514];
+	int      block_len;
+
+	uint8_t  csd[16];
+	uint8_t  cid[16];
+
+	uint8_t  reg[64];       // switch function status, sent after the access time
+	int      reg_len;
+
+	std::deque<uint8_t> out;
+
+	void command(uint64_t t_ns);
+	void r1(uint8_t extra_flags);
+	void data_block(const uint8_t* data, int length);
+
+	void read_sector(uint32_t s, uint8_t* buf);
+	void write_sector(uint32_t s, const uint8_t* buf);
+
+	bool address(uint32_t arg, uint32_t* s);
+};
+
+#endif /* _SDCARDSIM_H */
@@ -0,0 +1,1893 @@
+/*
+ * host test bench for the SD driver
+ *
+ * runs src/SD against a simulated card backed by a disk image, with the HAL
+ * replaced by the stand-ins in HAL/CPU/host. Time is simulated, so the
+ * throughput figures reflect the modelled bus and card, not the host
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "platform_pins.h"
+#include "platform_memory.h"
+
+#include "sim.h"
+#include "SDCardSim.h"
+
+#include "SPI.h"
+#include "SD.h"
+#include "bench.h"
+#include "fat.h"
+#include "FatImage.h"
+
+static int failures = 0;
+
+#define FAIL(...) do { printf("FAIL: " __VA_ARGS__); failures++; } while (0)
+
+/*
+ * every word of the test image says where it lives, so misdirected or
+ * reordered blocks show up immediately
+ */
+static uint32_t pattern(uint32_t sector, int word, uint32_t seed)
+{
+	return (sector * 128 + word) ^ seed;
+}
+
+static void fill(uint8_t* buf, uint32_t sector, uint32_t n, uint32_t seed)
+{
+	uint32_t* w = (uint32_t*) buf;
+	for (uint32_t s = 0; s < n; s++)
+		for (int i = 0; i < 128; i++)
+			*w++ = pattern(sector + s, i, seed);
+}
+
+static int check(const void* buf, uint32_t sector, uint32_t seed)
+{
+	const uint32_t* w = (const uint32_t*) buf;
+	for (int i = 0; i < 128; i++)
+		if (w[i] != pattern(sector, i, seed))
+			return -1;
+	return 0;
+}
+
+class Checker : public SD_async_receiver
+{
+public:
+	uint32_t next;
+	uint32_t remaining;
+	uint32_t seed;
+	int      errors;
+	bool     release;
+	bool     want_error; // an error is the right answer
+
+	void expect(uint32_t sector, uint32_t n, uint32_t seed)
+	{
+		next      = sector;
+		remaining = n;
+		errors    = 0;
+		release   = true;
+		want_error = false;
+		this->seed = seed;
+	}
+
+	void sd_read_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+		if (err)
+		{
+			FAIL("read sector %u: error %d\n", sector, err);
+			errors++;
+			remaining = 0;
+			return;
+		}
+		if (sector != next)
+		{
+			FAIL("read: got sector %u, expected %u\n", sector, next);
+			errors++;
+		}
+		else if (check(buf, sector, seed))
+		{
+			FAIL("read sector %u: bad data\n", sector);
+			errors++;
+		}
+
+		next = sector + 1;
+		if (remaining)
+			remaining--;
+
+		if (release)
+			sd->clean_buffer(buf);
+	}
+
+	void sd_write_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+		if (err)
+		{
+			if (want_error == false)
+				FAIL("write sector %u: error %d\n", sector, err);
+			errors++;
+			remaining = 0;
+			return;
+		}
+		if (sector != next)
+		{
+			FAIL("write: got sector %u, expected %u\n", sector, next);
+			errors++;
+		}
+
+		next = sector + 1;
+		if (remaining)
+			remaining--;
+	}
+};
+
+/*
+ * keeps a copy of each streamed block
+ */
+class Collector : public SD_async_receiver
+{
+public:
+	uint32_t first;
+	uint32_t remaining;
+	uint8_t  data[8][512];
+
+	void sd_read_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+		if (err)
+			FAIL("read sector %u: error %d\n", sector, err);
+		else if (sector - first < 8)
+			memcpy(data[sector - first], buf, 512);
+		if (remaining)
+			remaining--;
+		sd->clean_buffer(buf);
+	}
+
+	void sd_write_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+	}
+};
+
+/*
+ * for requests that may complete in any order
+ */
+class Counter : public SD_async_receiver
+{
+public:
+	uint32_t remaining;
+	uint32_t seed;
+
+	void sd_read_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+		if (err)
+			FAIL("read sector %u: error %d\n", sector, err);
+		else if (check(buf, sector, seed))
+			FAIL("read sector %u: bad data\n", sector);
+		if (remaining)
+			remaining--;
+	}
+
+	void sd_write_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+		if (err)
+			FAIL("write sector %u: error %d\n", sector, err);
+		if (remaining)
+			remaining--;
+	}
+
+	void sd_erase_complete(SD* sd, uint32_t sector, uint32_t n_sectors, int err)
+	{
+		if (err)
+			FAIL("erase %u+%u: error %d\n", sector, n_sectors, err);
+		if (remaining)
+			remaining--;
+	}
+
+	int init_result;
+
+	void sd_init_complete(SD* sd, int result)
+	{
+		init_result = result;
+		if (remaining)
+			remaining--;
+	}
+};
+
+static SD*        sd;
+static Checker    checker;
+
+static void wait_for(volatile uint32_t* remaining)
+{
+	while (*remaining)
+	{
+		SD::on_idle_all();
+		if (sim_wfi() == 0)
+		{
+			FAIL("stalled with %u blocks outstanding\n", *remaining);
+			return;
+		}
+	}
+	// let any trailing busy or stop transaction finish
+	while (sim_wfi())
+		SD::on_idle_all();
+}
+
+static void report(const char* name, uint32_t n, uint64_t t0)
+{
+	uint64_t dt = sim_now_ns() - t0;
+	printf("%-24s %5u blocks %10.3f ms %8.1f KB/s\n", name, n, dt / 1e6, (n * 512.0) / (dt / 1e9) / 1024.0);
+}
+
+static void test_read(const char* name, uint32_t sector, uint32_t n, uint8_t* buf, uint32_t seed)
+{
+	checker.expect(sector, n, seed);
+
+	uint64_t t0 = sim_now_ns();
+	if (sd->begin_read(sector, n, buf, &checker) < 0)
+	{
+		FAIL("%s: begin_read refused\n", name);
+		return;
+	}
+	wait_for(&checker.remaining);
+
+	report(name, n, t0);
+}
+
+static void test_write(const char* name, uint32_t sector, uint32_t n, uint8_t* buf, uint32_t seed)
+{
+	fill(buf, sector, n, seed);
+	checker.expect(sector, n, seed);
+
+	uint64_t t0 = sim_now_ns();
+	if (sd->begin_write(sector, n, buf, &checker) < 0)
+	{
+		FAIL("%s: begin_write refused\n", name);
+		return;
+	}
+	wait_for(&checker.remaining);
+
+	report(name, n, t0);
+}
+
+/*
+ * erase part of a written range, with a read of the whole range queued
+ * behind it. Then check a pre_erase() hint reaches ACMD23
+ */
+static void test_erase(SDCardSim* card)
+{
+	static Counter counter;
+
+	uint8_t* buf = (uint8_t*) AHB0.alloc(512 * 8);
+	if (buf == NULL)
+	{
+		FAIL("erase: out of AHB memory\n");
+		return;
+	}
+
+	test_write("erase: fill", 5000, 8, buf, 0x77777777);
+
+	// the read has to wait for the erase, since they overlap
+	static Collector collector;
+	collector.first     = 5000;
+	collector.remaining = 8;
+	counter.remaining   = 1;
+	counter.seed        = 0;
+	if ((sd->begin_erase(5002, 4, &counter) < 0) || (sd->begin_read(5000, 8, NULL, &collector) < 0))
+		FAIL("erase: couldn't queue requests\n");
+	wait_for(&collector.remaining);
+	wait_for(&counter.remaining);
+
+	if (card->stats.blocks_erased != 4)
+		FAIL("erase: card erased %u blocks\n", card->stats.blocks_erased);
+
+	for (uint32_t i = 0; i < 8; i++)
+	{
+		// the card reads erased blocks back as 0s
+		bool erased = (i >= 2) && (i < 6);
+		bool ok     = true;
+
+		if (erased)
+		{
+			for (int j = 0; j < 512; j++)
+				if (collector.data[i][j])
+					ok = false;
+		}
+		else
+			ok = (check(collector.data[i], 5000 + i, 0x77777777) == 0);
+
+		if (!ok)
+			FAIL("erase: sector %u %s\n", 5000 + i, erased?"not erased":"damaged");
+	}
+
+	// a hint covers more than the write that uses it, once
+	if (sd->pre_erase(6000, 32) < 0)
+		FAIL("pre_erase refused\n");
+	test_write("pre-erased write", 6000, 4, buf, 0x12121212);
+	if (card->stats.pre_erase != 32)
+		FAIL("pre_erase: ACMD23 asked for %u blocks\n", card->stats.pre_erase);
+	test_write("  next write", 6004, 4, buf, 0x12121212);
+	if (card->stats.pre_erase != 4)
+		FAIL("pre_erase: hint used twice, ACMD23 asked for %u blocks\n", card->stats.pre_erase);
+
+	AHB0.dealloc(buf);
+}
+
+/*
+ * keeps every block it's given until the main loop hands the buffer back,
+ * like a receiver that can't finish with one in its callback
+ */
+class Holder : public SD_async_receiver
+{
+public:
+	uint32_t next;
+	uint32_t remaining;
+	void*    held[SD_READ_BUFFERS];
+	int      n_held;
+
+	void sd_read_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+		if (err)
+			FAIL("held read sector %u: error %d\n", sector, err);
+		else if (sector != next)
+			FAIL("held read: got sector %u, expected %u\n", sector, next);
+		else if (check(buf, sector, 0))
+			FAIL("held read sector %u: bad data\n", sector);
+
+		next = sector + 1;
+		if (remaining)
+			remaining--;
+
+		if (n_held < SD_READ_BUFFERS)
+			held[n_held++] = buf;
+		else
+			FAIL("held read: sector %u arrived with every buffer held\n", sector);
+	}
+
+	void sd_write_complete(SD* sd, uint32_t sector, void* buf, int err)
+	{
+	}
+};
+
+/*
+ * a read whose receiver gives its buffers back with clean_buffer() from
+ * the main loop, outside any callback. Streamed or into the caller's
+ * buffer, the read has to wait for that and then carry on
+ */
+static void test_held(const char* name, uint32_t sector, uint32_t n, bool stream)
+{
+	static Holder holder;
+	holder.next      = sector;
+	holder.remaining = n;
+	holder.n_held    = 0;
+
+	uint8_t* buf = stream?NULL:(uint8_t*) AHB0.alloc(512);
+
+	uint64_t t0 = sim_now_ns();
+	if (sd->begin_read(sector, n, buf, &holder) < 0)
+		FAIL("%s: begin_read refused\n", name);
+
+	while (holder.remaining)
+	{
+		while (holder.n_held)
+			sd->clean_buffer(holder.held[--holder.n_held]);
+
+		SD::on_idle_all();
+		if (sim_wfi() == 0)
+		{
+			FAIL("%s: stalled with %u blocks outstanding\n", name, holder.remaining);
+			break;
+		}
+	}
+
+	while (holder.n_held)
+		sd->clean_buffer(holder.held[--holder.n_held]);
+	while (sim_wfi())
+		SD::on_idle_all();
+
+	report(name, n, t0);
+
+	if (buf)
+		AHB0.dealloc(buf);
+}
+
+/*
+ * queue a batch of requests at once and let the scheduler at them
+ */
+static void test_merge(SDCardSim* card)
+{
+	static Counter counter;
+
+	uint8_t* buf = (uint8_t*) AHB0.alloc(512 * 16);
+	if (buf == NULL)
+	{
+		FAIL("merge: out of AHB memory\n");
+		return;
+	}
+
+	uint32_t cmd17 = card->stats.cmd[17], cmd18 = card->stats.cmd[18];
+
+	// eight single-block reads of neighbouring sectors, out of order, plus
+	// a duplicate: one CMD18
+	static const uint8_t order[] = { 3, 1, 0, 7, 2, 6, 4, 5, 3 };
+	counter.seed = 0;
+	counter.remaining = sizeof(order);
+	uint64_t t0 = sim_now_ns();
+	for (uint32_t i = 0; i < sizeof(order); i++)
+		sd->begin_read(200 + order[i], 1, buf + (i << 9), &counter);
+	wait_for(&counter.remaining);
+	report("merged reads", sizeof(order), t0);
+
+	if ((card->stats.cmd[17] != cmd17) || (card->stats.cmd[18] != cmd18 + 1))
+		FAIL("merge: expected one CMD18, got %u CMD17 and %u CMD18\n", card->stats.cmd[17] - cmd17, card->stats.cmd[18] - cmd18);
+
+	// overlapping writes: the newest data must win
+	uint32_t cmd25 = card->stats.cmd[25];
+	fill(buf, 5000, 4, 0x11111111);
+	fill(buf + 2048, 5002, 4, 0x22222222);
+	counter.remaining = 8;
+	sd->begin_write(5000, 4, buf, &counter);
+	sd->begin_write(5002, 4, buf + 2048, &counter);
+	wait_for(&counter.remaining);
+
+	if (card->stats.cmd[25] != cmd25 + 1)
+		FAIL("merge: expected one CMD25, got %u\n", card->stats.cmd[25] - cmd25);
+
+	// a read queued behind a write of the same sector sees the new data
+	fill(buf + 4096, 6000, 1, 0x33333333);
+	counter.remaining = 1;
+	sd->begin_write(6000, 1, buf + 4096, &counter);
+	checker.expect(6000, 1, 0x33333333);
+	sd->begin_read(6000, 1, buf + 4608, &checker);
+	wait_for(&checker.remaining);
+	wait_for(&counter.remaining);
+
+	// the descriptor pool is fixed: one more than it holds is refused, and
+	// everything that was accepted still completes
+	counter.seed = 0;
+	counter.remaining = 0;
+	int refused = 0;
+	for (int i = 0; i <= SD_QUEUE_DEPTH; i++)
+	{
+		if (sd->begin_read(300 + (i & 15), 1, buf + ((i & 15) << 9), &counter) < 0)
+			refused++;
+		else
+			counter.remaining++;
+	}
+	wait_for(&counter.remaining);
+	if (refused != 1)
+		FAIL("queue: %d of %d requests refused, expected 1\n", refused, SD_QUEUE_DEPTH + 1);
+
+	AHB0.dealloc(buf);
+
+	test_read("  read back", 5000, 2, NULL, 0x11111111);
+	test_read("  read back", 5002, 4, NULL, 0x22222222);
+}
+
+/*
+ * file playback: one block at a time, with a pause after each while it's
+ * dealt with. After a couple of them the rest should come from read-ahead
+ */
+static void test_prefetch(SDCardSim* card)
+{
+#if SD_PREFETCH_BLOCKS
+	uint8_t* buf = (uint8_t*) AHB0.alloc(512);
+	if (buf == NULL)
+	{
+		FAIL("prefetch: out of AHB memory\n");
+		return;
+	}
+
+	const sd_stats_t* st = sd->get_stats();
+	uint32_t cmd17 = card->stats.cmd[17], cmd18 = card->stats.cmd[18];
+	uint32_t hits = st->prefetch_hits, cancels = st->prefetch_cancels;
+
+	uint64_t t0 = sim_now_ns();
+	for (uint32_t s = 1200; s < 1264; s++)
+	{
+		checker.expect(s, 1, 0);
+		if (sd->begin_read(s, 1, buf, &checker) < 0)
+			FAIL("prefetch: begin_read refused\n");
+		wait_for(&checker.remaining);
+		sim_advance_ns(200000);
+	}
+	report("sequential reads", 64, t0);
+
+	if ((card->stats.cmd[17] - cmd17 != SD_PREFETCH_TRIGGER) || (card->stats.cmd[18] != cmd18 + 1))
+		FAIL("prefetch: expected %u CMD17 and one CMD18, got %u and %u\n", SD_PREFETCH_TRIGGER,
+			card->stats.cmd[17] - cmd17, card->stats.cmd[18] - cmd18);
+	if (st->prefetch_hits - hits != 64 - SD_PREFETCH_TRIGGER)
+		FAIL("prefetch: %u reads served from the ring\n", st->prefetch_hits - hits);
+
+	// the stream is waiting with a full ring. A write into it has to stop
+	// the stream, and the old data mustn't be handed out afterwards
+	test_write("  write ahead", 1264, 1, buf, 0x66666666);
+	test_read("  read back", 1264, 1, buf, 0x66666666);
+	test_read("  next", 1265, 1, buf, 0);
+
+	if (st->prefetch_cancels != cancels + 1)
+		FAIL("prefetch: %u streams cancelled\n", st->prefetch_cancels - cancels);
+
+	AHB0.dealloc(buf);
+#endif
+}
+
+/*
+ * a few bench runs, checked for the right number of requests and sane
+ * figures rather than any particular speed
+ */
+#define BENCH_FIRST 65536
+#define BENCH_SIZE  4096
+
+static void test_bench(void)
+{
+	SD_bench bench(sd);
+
+	static const sd_bench_config_t configs[] = {
+		{ SD_BENCH_SEQ_READ,   BENCH_FIRST, BENCH_SIZE, 32,  16, 1,   0, 1 },
+		{ SD_BENCH_RAND_READ,  BENCH_FIRST, BENCH_SIZE,  8,  64, 4,   0, 2 },
+		{ SD_BENCH_RAND_READ,  BENCH_FIRST, BENCH_SIZE,  1,  64, 8,   0, 3 },
+		{ SD_BENCH_SEQ_WRITE,  BENCH_FIRST, BENCH_SIZE,  8,  32, 2,   0, 4 },
+		{ SD_BENCH_MIXED,      BENCH_FIRST, BENCH_SIZE,  8,  64, 4,  50, 5 },
+	};
+	static const char* names[] = { "bench seq read", "bench rand read", "bench rand read", "bench seq write", "bench mixed" };
+
+	for (uint32_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+	{
+		const sd_bench_config_t* c = &configs[i];
+		sd_bench_result_t r;
+
+		if (bench.run(c, &r) < 0)
+		{
+			FAIL("%s: wouldn't run\n", names[i]);
+			continue;
+		}
+		bench.report(names[i], c, &r);
+
+		if ((r.requests != c->requests) || (r.sectors != c->requests * c->io_sectors) || r.errors)
+			FAIL("%s: %u requests, %u sectors, %u errors\n", names[i], r.requests, r.sectors, r.errors);
+		if ((r.elapsed_us == 0) || (r.p50_us > r.p99_us) || (r.p99_us > r.max_us))
+			FAIL("%s: %uus, p50 %u p99 %u max %u\n", names[i], r.elapsed_us, r.p50_us, r.p99_us, r.max_us);
+	}
+
+	// too deep, and writes too big for the buffer
+	sd_bench_config_t bad = configs[1];
+	sd_bench_result_t r;
+	bad.queue_depth = SD_BENCH_MAX_DEPTH + 1;
+	if (bench.run(&bad, &r) == 0)
+		FAIL("bench: ran at queue depth %u\n", bad.queue_depth);
+	bad = configs[3];
+	bad.io_sectors = SD_BENCH_MAX_WRITE * 2;
+	if (bench.run(&bad, &r) == 0)
+		FAIL("bench: wrote %u sectors at a time\n", bad.io_sectors);
+
+	// whatever we did, the queue has to be empty again
+	while (sim_wfi())
+		SD::on_idle_all();
+}
+
+// seed the area the tests read with a known pattern
+static int seed_image(const char* image)
+{
+	int fd = open(image, O_RDWR);
+	static uint8_t buf[512];
+	for (uint32_t s = 0; s < 2048; s++)
+	{
+		fill(buf, s, 1, 0);
+		if (pwrite(fd, buf, 512, ((off_t) s) * 512) != 512)
+		{
+			perror(image);
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+#define COPY_CHUNK 8
+
+/*
+ * copies n blocks from one card to another, a chunk at a time. With two
+ * buffers, the next chunk is read while the last one is written
+ */
+class Copier : public SD_async_receiver
+{
+public:
+	SD*      src;
+	SD*      dst;
+	uint32_t from, to, n;
+	int      n_bufs;
+	uint8_t* buf[2];
+
+	uint32_t next;       // next chunk to read
+	uint32_t chunk[2];   // chunk in each buffer
+	uint32_t left[2];    // blocks of it still to arrive, or to be written
+	uint32_t remaining;  // chunks not yet written
+
+	void start()
+	{
+		next      = 0;
+		remaining = n / COPY_CHUNK;
+		for (int b = 0; b < n_bufs; b++)
+			read_chunk(b);
+	}
+
+	void read_chunk(int b)
+	{
+		if (next >= n)
+			return;
+		chunk[b] = next;
+		left[b]  = COPY_CHUNK;
+		next    += COPY_CHUNK;
+		if (src->begin_read(from + chunk[b], COPY_CHUNK, NULL, this) < 0)
+			FAIL("copy: begin_read refused\n");
+	}
+
+	int which(uint32_t offset)
+	{
+		for (int b = 0; b < n_bufs; b++)
+			if (offset - chunk[b] < COPY_CHUNK)
+				return b;
+		return 0;
+	}
+
+	void sd_read_complete(SD* sd, uint32_t sector, void* data, int err)
+	{
+		if (err)
+			FAIL("copy: read sector %u: error %d\n", sector, err);
+
+		int b = which(sector - from);
+		memcpy(buf[b] + ((sector - from - chunk[b]) << 9), data, 512);
+		sd->clean_buffer(data);
+
+		if (--left[b] == 0)
+		{
+			left[b] = COPY_CHUNK;
+			if (dst->begin_write(to + chunk[b], COPY_CHUNK, buf[b], this) < 0)
+				FAIL("copy: begin_write refused\n");
+		}
+	}
+
+	void sd_write_complete(SD* sd, uint32_t sector, void* data, int err)
+	{
+		if (err)
+			FAIL("copy: write sector %u: error %d\n", sector, err);
+
+		int b = which(sector - to);
+		if (--left[b])
+			return;
+
+		if (remaining)
+			remaining--;
+		read_chunk(b);
+	}
+};
+
+/*
+ * a second card on the other SSP port. Transfers on the two should overlap,
+ * rather than taking turns
+ */
+static void test_two_cards(SD* sd_b)
+{
+	static Checker a, b;
+
+	// one stream on each card, then both at once
+	uint64_t t0 = sim_now_ns();
+	a.expect(100, 256, 0);
+	sd->begin_read(100, 256, NULL, &a);
+	wait_for(&a.remaining);
+	uint64_t t_a = sim_now_ns() - t0;
+
+	t0 = sim_now_ns();
+	b.expect(100, 256, 0);
+	sd_b->begin_read(100, 256, NULL, &b);
+	wait_for(&b.remaining);
+	uint64_t t_b = sim_now_ns() - t0;
+
+	t0 = sim_now_ns();
+	a.expect(100, 256, 0);
+	b.expect(100, 256, 0);
+	if ((sd->begin_read(100, 256, NULL, &a) < 0) || (sd_b->begin_read(100, 256, NULL, &b) < 0))
+		FAIL("two cards: begin_read refused\n");
+	wait_for(&a.remaining);
+	wait_for(&b.remaining);
+	report("two card streams", 512, t0);
+
+	if ((sim_now_ns() - t0) * 4 > (t_a + t_b) * 3)
+		FAIL("two cards: streams took %.3f ms together, %.3f ms apart\n", (sim_now_ns() - t0) / 1e6, (t_a + t_b) / 1e6);
+
+	// copy from one to the other, first one chunk at a time, then reading
+	// each chunk while the one before is written
+	static Copier copier;
+	copier.src    = sd;
+	copier.dst    = sd_b;
+	copier.from   = 1536;
+	copier.n      = 256;
+	copier.buf[0] = (uint8_t*) AHB0.alloc(COPY_CHUNK * 512);
+	copier.buf[1] = (uint8_t*) AHB0.alloc(COPY_CHUNK * 512);
+	if ((copier.buf[0] == NULL) || (copier.buf[1] == NULL))
+	{
+		FAIL("two cards: out of AHB memory\n");
+		return;
+	}
+
+	uint64_t t_serial = 0;
+	for (int n_bufs = 1; n_bufs <= 2; n_bufs++)
+	{
+		copier.n_bufs = n_bufs;
+		copier.to     = 3000 + n_bufs * 1000;
+
+		t0 = sim_now_ns();
+		copier.start();
+		wait_for(&copier.remaining);
+		report((n_bufs == 1)?"copy, one buffer":"copy, two buffers", copier.n, t0);
+
+		if (n_bufs == 1)
+			t_serial = sim_now_ns() - t0;
+		else if ((sim_now_ns() - t0) * 10 > t_serial * 9)
+			FAIL("two cards: copy didn't overlap reads and writes\n");
+
+		// the pattern says where a block came from, so check each one
+		// against its source sector
+		static Collector collector;
+		for (uint32_t i = 0; i < copier.n; i += 8)
+		{
+			collector.first     = copier.to + i;
+			collector.remaining = 8;
+			sd_b->begin_read(copier.to + i, 8, NULL, &collector);
+			wait_for(&collector.remaining);
+			for (uint32_t j = 0; j < 8; j++)
+				if (check(collector.data[j], copier.from + i + j, 0))
+					FAIL("two cards: sector %u didn't copy\n", copier.to + i + j);
+		}
+	}
+
+	AHB0.dealloc(copier.buf[1]);
+	AHB0.dealloc(copier.buf[0]);
+}
+
+/*
+ * FAT on a card of its own, formatted by FatImage
+ */
+static int wait_fat(_fat_ioresult* r)
+{
+	while (r->fini == 0)
+	{
+		SD::on_idle_all();
+		if (sim_wfi() == 0)
+		{
+			FAIL("fat: stalled\n");
+			return -1;
+		}
+	}
+	return r->error;
+}
+
+// read the rest of an open file and check it against FatImage::byte()
+static void fat_read_check(Fat* fat, _fat_file_ioresult* f, uint32_t seed, uint32_t chunk, uint32_t off = 0)
+{
+	uint8_t* buf = (uint8_t*) malloc(chunk);
+	uint32_t size = f->file.size;
+
+	for (;;)
+	{
+		fat->f_read_block(f, buf, chunk);
+		if (wait_fat(f))
+		{
+			FAIL("fat: reading %s at %u: error %d\n", f->file.path, off, f->error);
+			break;
+		}
+		if (f->buflen == 0)
+			break;
+		for (uint32_t i = 0; i < f->buflen; i++)
+			if (buf[i] != FatImage::byte(seed, off + i))
+			{
+				FAIL("fat: %s: bad data at %u\n", f->file.path, off + i);
+				i = f->buflen;
+				off = size;
+			}
+		off += f->buflen;
+		if (off >= size)
+			break;
+	}
+	if (off != size)
+		FAIL("fat: read %u bytes of %s, expected %u\n", off, f->file.path, size);
+
+	free(buf);
+}
+
+static int fat_open(Fat* fat, _fat_file_ioresult* f, const char* path, uint32_t size)
+{
+	memset(f, 0, sizeof(*f));
+	if ((fat->f_open(f, path) < 0) || wait_fat(f))
+	{
+		FAIL("fat: couldn't open %s (%d)\n", path, f->error);
+		return -1;
+	}
+	if (f->file.size != size)
+		FAIL("fat: %s is %u bytes, expected %u\n", path, f->file.size, size);
+	return 0;
+}
+
+static void fat_check_file(Fat* fat, const char* path, uint32_t size, uint32_t seed, uint32_t chunk)
+{
+	static _fat_file_ioresult f;
+
+	if (fat_open(fat, &f, path, size) == 0)
+		fat_read_check(fat, &f, seed, chunk);
+	fat->f_close(&f);
+}
+
+// what f_readdir() lists, and in how many batches
+class DirLister : public _fat_dirreceiver
+{
+public:
+	std::vector<std::string> names;
+	uint32_t batches;
+
+	void _fat_dirents(_fat_dir_ioresult*, const fat_dirent_t* e, int n)
+	{
+		batches++;
+		for (int i = 0; i < n; i++)
+			names.push_back(e[i].name);
+	}
+};
+
+static DirLister* fat_list(Fat* fat, const char* path)
+{
+	static _fat_dir_ioresult dir;
+	static DirLister lister;
+
+	lister.names.clear();
+	lister.batches = 0;
+
+	memset(&dir, 0, sizeof(dir));
+	if ((fat->f_opendir(&dir, path) < 0) || wait_fat(&dir))
+	{
+		fat->f_closedir(&dir);
+		return NULL;
+	}
+	if ((fat->f_readdir(&dir, &lister) < 0) || wait_fat(&dir))
+		FAIL("fat: listing %s failed (%d)\n", path, dir.error);
+	fat->f_closedir(&dir);
+
+	return &lister;
+}
+
+static int fat_listed(DirLister* l, const char* name)
+{
+	for (uint32_t i = 0; i < l->names.size(); i++)
+		if (l->names[i] == name)
+			return 1;
+	return 0;
+}
+
+// the FSInfo free count, and whether the two FATs match
+static uint32_t fat_image_check(const char* image, uint32_t partition_lba, uint32_t fat_lba, uint32_t sectors_per_fat)
+{
+	int fd = open(image, O_RDONLY);
+	std::vector<uint8_t> a(sectors_per_fat << 9), b(sectors_per_fat << 9);
+
+	if ((pread(fd, &a[0], a.size(), (off_t) fat_lba << 9) != (ssize_t) a.size()) ||
+		(pread(fd, &b[0], b.size(), (off_t) (fat_lba + sectors_per_fat) << 9) != (ssize_t) b.size()) ||
+		(a != b))
+		FAIL("fat: the two FATs differ\n");
+
+	uint32_t n_free = 0;
+	if (pread(fd, &n_free, 4, ((off_t) (partition_lba + 1) << 9) + 488) != 4)
+		FAIL("fat: couldn't read FSInfo\n");
+
+	close(fd);
+	return n_free;
+}
+
+// one for all the FAT tests, so its buffers only come out of the pools once
+static Fat fat;
+
+// the card on SSP0 the FAT tests use, brought up again for each image
+static SD* fat_card_init(void)
+{
+	static SD* sdf = NULL;
+	if (sdf == NULL)
+		sdf = new SD(new SPI(SSP0_MOSI, SSP0_MISO, SSP0_SCK, SSP0_SS));
+
+	static Counter init_rx;
+	init_rx.remaining   = 1;
+	init_rx.init_result = 0;
+	sdf->begin_init(&init_rx);
+	wait_for(&init_rx.remaining);
+	if (init_rx.init_result < 1)
+	{
+		FAIL("fat: init returned %d\n", init_rx.init_result);
+		return NULL;
+	}
+	return sdf;
+}
+
+static void test_fat(const char* image)
+{
+	uint32_t partition_lba, fat_lba, sectors_per_fat;
+	{
+		FatImage img(image, 32, 131072, 1);
+
+		img.add_file(img.root(), "CONFIG.TXT", 700, 0xC0);
+
+		uint32_t jobs = img.mkdir(img.root(), "JOBS");
+		uint32_t year = img.mkdir(jobs, "2026");
+		for (int i = 0; i < 40; i++)
+		{
+			char name[16];
+			snprintf(name, sizeof(name), "JOB%02d.GCO", i);
+			img.add_file(year, name, 3000 + i * 512, 0x100 + i, (i == 37)?3:0);
+		}
+
+		// four runs across several FAT sectors, and one in more pieces
+		// than an extent map holds
+		img.add_file(img.root(), "BIG.BIN",  600 * 512, 0xB16, 150);
+		img.add_file(img.root(), "FRAG.BIN",  60 * 512, 0xF4A, 2);
+		img.add_file(img.root(), "LOG.TXT",   0,        0);
+		img.add_file(img.root(), "LOG2.TXT",  0,        0);
+
+		// a folder of long names, four entries each, in clusters that
+		// follow on from each other
+		uint32_t queue = img.mkdir(img.root(), "Job Queue");
+		for (int i = 0; i < 200; i++)
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "Queued job number %03d.gcode", i);
+			img.add_file(queue, name, 0, 0);
+		}
+
+		partition_lba   = img.partition_lba;
+		fat_lba         = img.fat_lba;
+		sectors_per_fat = img.sectors_per_fat;
+	}
+	uint32_t n_free = fat_image_check(image, partition_lba, fat_lba, sectors_per_fat);
+
+	SDCardSim card(image, true);
+	sim_spi_attach(0, &card);
+
+	SD* sdf = fat_card_init();
+	if (sdf == NULL)
+	{
+		sim_spi_attach(0, NULL);
+		return;
+	}
+
+	static _fat_mount_ioresult m;
+	fat.f_mount(&m, sdf);
+	if (wait_fat(&m) || (fat.f_mounted() == 0) || strcmp(m.label, "SDSIM      "))
+	{
+		FAIL("fat: mount failed (%d), label '%s'\n", m.error, m.label);
+		sim_spi_attach(0, NULL);
+		return;
+	}
+
+	const fat_cache_stats_t* cs = fat.get_cache_stats();
+
+	// the free map's built in the background. Let it finish, so it isn't
+	// in the timings
+	uint64_t t0 = sim_now_ns();
+	while ((fat.f_freemap_complete() == 0) && sim_wfi())
+		SD::on_idle_all();
+	if (fat.f_freemap_complete() == 0)
+		FAIL("fat: free map never finished\n");
+	printf("fat: free map built in %.3f ms\n", (sim_now_ns() - t0) / 1e6);
+
+	t0 = sim_now_ns();
+	fat_check_file(&fat, "CONFIG.TXT", 700, 0xC0, 1024);
+	fat_check_file(&fat, "/jobs/2026/job37.gco", 3000 + 37 * 512, 0x100 + 37, 512);
+	fat_check_file(&fat, "JOBS/2026/JOB05.GCO", 3000 + 5 * 512, 0x105, 4096);
+	printf("fat: three files checked in %.3f ms, cache %u hits %u misses\n",
+		(sim_now_ns() - t0) / 1e6, cs->hits, cs->misses);
+
+	// it's in the name cache now, in whatever case it's asked for, so
+	// reopening it doesn't look at the directory at all
+	uint32_t lookups = cs->hits + cs->misses, name_hits = cs->name_hits, cmd17 = card.stats.cmd[17];
+	static _fat_file_ioresult f;
+	if (fat_open(&fat, &f, "/JOBS/2026/Job37.gco", 3000 + 37 * 512) == 0)
+	{
+		if ((cs->name_hits != name_hits + 1) || (cs->hits + cs->misses != lookups) || (card.stats.cmd[17] != cmd17))
+			FAIL("fat: reopening took %u name hits, %u cache lookups, %u reads\n",
+				cs->name_hits - name_hits, cs->hits + cs->misses - lookups, card.stats.cmd[17] - cmd17);
+		fat_read_check(&fat, &f, 0x100 + 37, 4096);
+	}
+	fat.f_close(&f);
+
+	// once read through, the chain of a file in four pieces is all in RAM
+	if (fat_open(&fat, &f, "BIG.BIN", 600 * 512) == 0)
+	{
+		fat_read_check(&fat, &f, 0xB16, 2048);
+		if ((f.file.n_extents != 4) || (f.file.extent_clusters != 600) || (f.file.extent_end == 0))
+			FAIL("fat: BIG.BIN mapped as %u extents, %u clusters\n", f.file.n_extents, f.file.extent_clusters);
+
+		uint32_t lookups = cs->hits + cs->misses;
+		f.file.current_cluster = f.file.root_cluster;
+		f.file.cluster_index   = 0;
+		f.file.byte_in_cluster = 0;
+		fat_read_check(&fat, &f, 0xB16, 2048);
+		if (cs->hits + cs->misses != lookups)
+			FAIL("fat: second pass through BIG.BIN looked at the FAT %u times\n", cs->hits + cs->misses - lookups);
+		fat.f_close(&f);
+	}
+	fat_check_file(&fat, "FRAG.BIN", 60 * 512, 0xF4A, 1024);
+
+	// a read as big as the file goes straight into the buffer, one
+	// multi-block read for each run of clusters
+	if (fat_open(&fat, &f, "BIG.BIN", 600 * 512) == 0)
+	{
+		uint32_t cmd17 = card.stats.cmd[17], cmd18 = card.stats.cmd[18], misses = cs->misses;
+		t0 = sim_now_ns();
+		fat_read_check(&fat, &f, 0xB16, 600 * 512);
+		if ((card.stats.cmd[18] - cmd18 > 4 + cs->misses - misses) || (card.stats.cmd[17] - cmd17 != cs->misses - misses))
+			FAIL("fat: reading BIG.BIN in one go took %u CMD18 and %u CMD17, %u FAT sector reads\n",
+				card.stats.cmd[18] - cmd18, card.stats.cmd[17] - cmd17, cs->misses - misses);
+		printf("fat: BIG.BIN in one read: %.3f ms, %u CMD18\n", (sim_now_ns() - t0) / 1e6, card.stats.cmd[18] - cmd18);
+		fat.f_close(&f);
+	}
+
+	// resuming partway through: a fresh open and a seek should read each
+	// FAT sector the chain passes through once at most
+	if (fat_open(&fat, &f, "BIG.BIN", 600 * 512) == 0)
+	{
+		uint32_t misses = cs->misses;
+		fat.f_seek(&f, 500 * 512 + 100);
+		if (wait_fat(&f))
+			FAIL("fat: seek failed (%d)\n", f.error);
+		if ((f.file.cluster_index != 500) || (f.file.byte_in_cluster != 100))
+			FAIL("fat: seek landed at cluster %u byte %u\n", f.file.cluster_index, f.file.byte_in_cluster);
+		if (cs->misses - misses > 6)
+			FAIL("fat: seek read %u FAT sectors\n", cs->misses - misses);
+		printf("fat: seek 250k into BIG.BIN took %u FAT sector reads\n", cs->misses - misses);
+
+		// data starts partway through a sector there, so read from the
+		// sector boundary
+		fat.f_seek(&f, 500 * 512);
+		wait_fat(&f);
+		fat_read_check(&fat, &f, 0xB16, 4096, 500 * 512);
+
+		// back to the start, and past the end
+		uint32_t lookups = cs->hits + cs->misses;
+		fat.f_seek(&f, 1024);
+		wait_fat(&f);
+		fat_read_check(&fat, &f, 0xB16, 2048, 1024);
+		fat.f_seek(&f, 0xFFFFFFFF);
+		wait_fat(&f);
+		if ((f.file.cluster_index != 599) || (f.file.byte_in_cluster != 512))
+			FAIL("fat: seek to the end landed at cluster %u byte %u\n", f.file.cluster_index, f.file.byte_in_cluster);
+		if (cs->hits + cs->misses != lookups)
+			FAIL("fat: seeks inside the map looked at the FAT %u times\n", cs->hits + cs->misses - lookups);
+		fat.f_close(&f);
+	}
+
+	// and through a chain in more pieces than the map holds
+	if (fat_open(&fat, &f, "FRAG.BIN", 60 * 512) == 0)
+	{
+		fat.f_seek(&f, 45 * 512);
+		wait_fat(&f);
+		fat_read_check(&fat, &f, 0xF4A, 1024, 45 * 512);
+		fat.f_seek(&f, 3 * 512);
+		wait_fat(&f);
+		fat_read_check(&fat, &f, 0xF4A, 1024, 3 * 512);
+		fat.f_close(&f);
+	}
+
+	if ((fat.f_open(&f, "/jobs/2026/job99.gco") < 0) || (wait_fat(&f) != FAT_ERR_NOENT))
+		FAIL("fat: found a file that isn't there\n");
+	if ((fat.f_open(&f, "/config.txt/job37.gco") < 0) || (wait_fat(&f) != FAT_ERR_NOENT))
+		FAIL("fat: went into a file as if it were a directory\n");
+	fat.f_close(&f);
+
+	// listing a folder: long names put back together, a sector's entries
+	// at a time, from one multi-block read
+	cmd17 = card.stats.cmd[17];
+	uint32_t cmd18 = card.stats.cmd[18], misses = cs->misses;
+	t0 = sim_now_ns();
+	DirLister* l = fat_list(&fat, "/job queue/");
+	if (l == NULL)
+		FAIL("fat: couldn't open /Job Queue/\n");
+	else
+	{
+		printf("fat: listed %u entries in %.3f ms, %u batches, %u CMD18 %u CMD17\n", (uint32_t) l->names.size(),
+			(sim_now_ns() - t0) / 1e6, l->batches, card.stats.cmd[18] - cmd18, card.stats.cmd[17] - cmd17);
+		if ((l->names.size() != 202) || (l->names[0] != ".") || (l->names[1] != ".."))
+			FAIL("fat: /Job Queue/ listed %u entries\n", (uint32_t) l->names.size());
+		for (uint32_t i = 2; i < l->names.size(); i++)
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "Queued job number %03u.gcode", i - 2);
+			if (l->names[i] != name)
+			{
+				FAIL("fat: /Job Queue/ entry %u is '%s'\n", i, l->names[i].c_str());
+				break;
+			}
+		}
+		if ((l->batches != 51) || (card.stats.cmd[18] - cmd18 > 2) || (card.stats.cmd[17] - cmd17 != cs->misses - misses))
+			FAIL("fat: /Job Queue/ took %u batches, %u CMD18, %u CMD17 for %u misses\n", l->batches,
+				card.stats.cmd[18] - cmd18, card.stats.cmd[17] - cmd17, cs->misses - misses);
+	}
+
+	l = fat_list(&fat, "");
+	if ((l == NULL) || (l->names.size() != 7) || !fat_listed(l, "CONFIG.TXT") || !fat_listed(l, "JOBS") ||
+		!fat_listed(l, "Job Queue") || fat_listed(l, "SDSIM"))
+		FAIL("fat: root directory didn't list right\n");
+	l = fat_list(&fat, "JOBS/2026");
+	if ((l == NULL) || (l->names.size() != 42) || !fat_listed(l, "JOB37.GCO"))
+		FAIL("fat: /JOBS/2026 didn't list right\n");
+	if (fat_list(&fat, "/CONFIG.TXT") || fat_list(&fat, "/JOBS/2027"))
+		FAIL("fat: listed a directory that isn't there\n");
+
+	// long names in any case, found in the same pass over each sector as
+	// the 8.3 ones: the root, the folder's 32 sectors up to the entry,
+	// and where its chain goes
+	misses = cs->misses;
+	if ((fat_open(&fat, &f, "/JOB QUEUE/queued JOB number 123.GCODE", 0) == 0) && (f.file.direntry_index != (2 + 123 * 4 + 3) % 16))
+		FAIL("fat: long name found entry %u\n", f.file.direntry_index);
+	if (cs->misses - misses > 1 + 32 + 1)
+		FAIL("fat: long name lookup read %u sectors\n", cs->misses - misses);
+	printf("fat: long name lookup took %u sector reads\n", cs->misses - misses);
+	fat.f_close(&f);
+	if (fat_open(&fat, &f, "/JOBQUE~1/QUEUED~1.GCO", 0) == 0)
+		fat.f_close(&f);
+
+	static const char* not_there[] = {
+		"/Job Queue/Queued job number 12.gcode",
+		"/Job Queue/Queued job number 1234.gcode",
+		"/Job Queue/Queued job number 123.gcod",
+		"/Job Queue/Queued job number 123.gcode.bak",
+		"/Job Queu/Queued job number 123.gcode",
+	};
+	for (uint32_t i = 0; i < sizeof(not_there) / sizeof(not_there[0]); i++)
+		if ((fat.f_open(&f, not_there[i]) < 0) || (wait_fat(&f) != FAT_ERR_NOENT))
+			FAIL("fat: found %s\n", not_there[i]);
+	fat.f_close(&f);
+
+	// a log written from empty in 4k pieces, with a short one to finish
+	static uint8_t wbuf[4096];
+	uint32_t log_size = 300 * 512 + 100;
+	if (fat_open(&fat, &f, "LOG.TXT", 0) == 0)
+	{
+		uint32_t cmd24 = card.stats.cmd[24], cmd25 = card.stats.cmd[25];
+
+		for (uint32_t off = 0; off < log_size; off += sizeof(wbuf))
+		{
+			uint32_t n = (log_size - off < sizeof(wbuf))?(log_size - off):sizeof(wbuf);
+			for (uint32_t i = 0; i < n; i++)
+				wbuf[i] = FatImage::byte(0x106, off + i);
+			if ((fat.f_write_block(&f, wbuf, n) < 0) || wait_fat(&f) || (f.buflen != n))
+			{
+				FAIL("fat: writing LOG.TXT at %u failed (%d)\n", off, f.error);
+				break;
+			}
+		}
+		if (f.file.size != log_size)
+			FAIL("fat: LOG.TXT grew to %u bytes, expected %u\n", f.file.size, log_size);
+		if (fat.f_write_block(&f, wbuf, 512) != -1)
+			FAIL("fat: wrote from the middle of a sector\n");
+
+		// the FAT and directory are held back until the close
+		uint32_t data = card.stats.cmd[25] - cmd25;
+		if ((data != (log_size + sizeof(wbuf) - 1) / sizeof(wbuf)) || (card.stats.cmd[24] != cmd24))
+			FAIL("fat: LOG.TXT data took %u multi-block and %u single-block writes\n", data, card.stats.cmd[24] - cmd24);
+
+		if ((fat.f_close(&f) != 1) || wait_fat(&f))
+			FAIL("fat: closing LOG.TXT failed (%d)\n", f.error);
+		printf("fat: wrote LOG.TXT in %u multi-block writes, then %u for the FAT and directory\n",
+			data, card.stats.cmd[24] + card.stats.cmd[25] - cmd24 - cmd25 - data);
+	}
+
+	// the name cache has kept up with the new size
+	name_hits = cs->name_hits;
+	if (fat_open(&fat, &f, "LOG.TXT", log_size) == 0)
+		fat.f_close(&f);
+	if (cs->name_hits != name_hits + 1)
+		FAIL("fat: LOG.TXT wasn't in the name cache\n");
+
+	// overwriting in place, across the gap between two runs of BIG.BIN
+	if (fat_open(&fat, &f, "BIG.BIN", 600 * 512) == 0)
+	{
+		for (uint32_t i = 0; i < sizeof(wbuf); i++)
+			wbuf[i] = FatImage::byte(0xABC, i);
+
+		uint32_t cmd25 = card.stats.cmd[25];
+		fat.f_seek(&f, 146 * 512);
+		wait_fat(&f);
+		if ((fat.f_write_block(&f, wbuf, sizeof(wbuf)) < 0) || wait_fat(&f))
+			FAIL("fat: overwriting BIG.BIN failed (%d)\n", f.error);
+		if (card.stats.cmd[25] - cmd25 != 2)
+			FAIL("fat: overwrite took %u multi-block writes\n", card.stats.cmd[25] - cmd25);
+
+		fat.f_seek(&f, 146 * 512);
+		wait_fat(&f);
+		fat.f_read_block(&f, wbuf, sizeof(wbuf));
+		wait_fat(&f);
+		for (uint32_t i = 0; i < sizeof(wbuf); i++)
+			if (wbuf[i] != FatImage::byte(0xABC, i))
+			{
+				FAIL("fat: BIG.BIN: bad data at %u after overwrite\n", 146 * 512 + i);
+				break;
+			}
+		if ((f.file.size != 600 * 512) || (fat.f_close(&f) != 0))
+			FAIL("fat: overwriting changed BIG.BIN's size\n");
+	}
+
+	// what's on the card has to make sense to a fresh mount, and appending
+	// picks up the chain where it ends
+	fat.f_mount(&m, sdf);
+	if (wait_fat(&m))
+		FAIL("fat: remount failed (%d)\n", m.error);
+	if (fat_open(&fat, &f, "LOG.TXT", log_size) == 0)
+	{
+		fat_read_check(&fat, &f, 0x106, 4096);
+
+		fat.f_seek(&f, 300 * 512);
+		wait_fat(&f);
+		for (uint32_t i = 0; i < 1024; i++)
+			wbuf[i] = FatImage::byte(0x106, 300 * 512 + i);
+		if ((fat.f_write_block(&f, wbuf, 1024) < 0) || wait_fat(&f))
+			FAIL("fat: appending to LOG.TXT failed (%d)\n", f.error);
+		log_size = 302 * 512;
+
+		fat.f_sync(&f);
+		if (wait_fat(&f))
+			FAIL("fat: sync failed (%d)\n", f.error);
+		fat.f_close(&f);
+	}
+	fat_check_file(&fat, "LOG.TXT", log_size, 0x106, 2048);
+
+	uint32_t used = n_free - fat_image_check(image, partition_lba, fat_lba, sectors_per_fat);
+	if (used != 302)
+		FAIL("fat: FSInfo says %u clusters were used, expected 302\n", used);
+
+	// without a next free hint, allocation starts at the beginning of the
+	// disk among the gaps the fragmented files left. The map should go
+	// straight past them to room for the whole write
+	{
+		int fd = open(image, O_WRONLY);
+		uint32_t unknown = 0xFFFFFFFF;
+		if (pwrite(fd, &unknown, 4, ((off_t) (partition_lba + 1) << 9) + 492) != 4)
+			FAIL("fat: couldn't patch FSInfo\n");
+		close(fd);
+	}
+	fat.f_mount(&m, sdf);
+	if (wait_fat(&m))
+		FAIL("fat: remount failed (%d)\n", m.error);
+	while ((fat.f_freemap_complete() == 0) && sim_wfi())
+		SD::on_idle_all();
+	if (fat_open(&fat, &f, "LOG2.TXT", 0) == 0)
+	{
+		static uint8_t big[64 * 512];
+		for (uint32_t i = 0; i < sizeof(big); i++)
+			big[i] = FatImage::byte(0x107, i);
+
+		uint32_t misses = cs->misses;
+		if ((fat.f_write_block(&f, big, sizeof(big)) < 0) || wait_fat(&f))
+			FAIL("fat: writing LOG2.TXT failed (%d)\n", f.error);
+		if ((f.file.n_extents != 1) || (cs->misses - misses > 2))
+			FAIL("fat: LOG2.TXT went in %u pieces, reading %u FAT sectors\n", f.file.n_extents, cs->misses - misses);
+		if ((fat.f_close(&f) != 1) || wait_fat(&f))
+			FAIL("fat: closing LOG2.TXT failed (%d)\n", f.error);
+	}
+	fat_check_file(&fat, "LOG2.TXT", 64 * 512, 0x107, 4096);
+	fat_image_check(image, partition_lba, fat_lba, sectors_per_fat);
+
+	// read-ahead may still be running on the card, let it stop first
+	while (sim_wfi())
+		SD::on_idle_all();
+	sim_spi_attach(0, NULL);
+}
+
+// length of a chain, read straight from the image's first FAT
+static uint32_t fat_chain_length(const char* image, uint32_t fat_lba, uint8_t type, uint32_t cluster)
+{
+	int fd = open(image, O_RDONLY);
+	uint32_t n = 0;
+
+	while ((cluster >= 2) && (n < 0x10000))
+	{
+		uint32_t off = (type == 12)?(cluster + (cluster >> 1)):(cluster * (type / 8));
+		uint8_t  e[4] = { 0, 0, 0, 0 };
+		if (pread(fd, e, type / 8 + (type == 12), ((off_t) fat_lba << 9) + off) < 0)
+			break;
+
+		uint32_t next = e[0] | (e[1] << 8) | (e[2] << 16) | (e[3] << 24);
+		if (type == 12)
+			next = (cluster & 1)?((next >> 4) & 0xFFF):(next & 0xFFF);
+		else if (type == 32)
+			next &= 0x0FFFFFFF;
+
+		n++;
+		if (next >= ((type == 12)?0xFF8U:(type == 16)?0xFFF8U:0x0FFFFFF8U))
+			break;
+		cluster = next;
+	}
+
+	close(fd);
+	return n;
+}
+
+/*
+ * FAT16 and FAT12: a fixed root directory, and narrower entries in the
+ * FAT. One FAT12 entry in every few straddles two sectors, and the chains
+ * here run through several
+ */
+static void test_fat_type(const char* image, uint8_t type, uint32_t n_sectors)
+{
+	uint32_t partition_lba, fat_lba, sectors_per_fat;
+	{
+		FatImage img(image, type, n_sectors, 1);
+
+		img.add_file(img.root(), "CONFIG.TXT", 700, 0xC0);
+		uint32_t jobs = img.mkdir(img.root(), "Print Jobs");
+		img.add_file(jobs, "First layer test.gcode", 900 * 512, 0xB16, 100);
+		img.add_file(img.root(), "LOG.TXT", 0, 0);
+
+		partition_lba   = img.partition_lba;
+		fat_lba         = img.fat_lba;
+		sectors_per_fat = img.sectors_per_fat;
+	}
+
+	// the card comes in whole 512k, so it can be a bit bigger than the
+	// partition
+	if (truncate(image, (off_t) ((n_sectors + 1023) & ~1023) << 9))
+		FAIL("fat%u: couldn't size the card\n", type);
+
+	SDCardSim card(image, true);
+	sim_spi_attach(0, &card);
+
+	SD* sdf = fat_card_init();
+	if (sdf == NULL)
+	{
+		sim_spi_attach(0, NULL);
+		return;
+	}
+
+	static _fat_mount_ioresult m;
+	fat.f_mount(&m, sdf);
+	if (wait_fat(&m) || (fat.f_mounted() == 0))
+	{
+		FAIL("fat%u: mount failed (%d)\n", type, m.error);
+		sim_spi_attach(0, NULL);
+		return;
+	}
+	while ((fat.f_freemap_complete() == 0) && sim_wfi())
+		SD::on_idle_all();
+	if (fat.f_freemap_complete() == 0)
+		FAIL("fat%u: free map never finished\n", type);
+
+	uint64_t t0 = sim_now_ns();
+	fat_check_file(&fat, "CONFIG.TXT", 700, 0xC0, 1024);
+	fat_check_file(&fat, "/print jobs/first layer test.gcode", 900 * 512, 0xB16, 4096);
+	fat_check_file(&fat, "/print jobs/first layer test.gcode", 900 * 512, 0xB16, 900 * 512);
+	printf("fat%u: files checked in %.3f ms\n", type, (sim_now_ns() - t0) / 1e6);
+
+	DirLister* l = fat_list(&fat, "/");
+	if ((l == NULL) || (l->names.size() != 3) || !fat_listed(l, "Print Jobs") || !fat_listed(l, "LOG.TXT"))
+		FAIL("fat%u: root directory didn't list right\n", type);
+
+	// a log long enough to go through a few FAT sectors
+	static _fat_file_ioresult f;
+	static uint8_t wbuf[4096];
+	uint32_t log_size = 700 * 512, first = 0;
+	if (fat_open(&fat, &f, "LOG.TXT", 0) == 0)
+	{
+		for (uint32_t pos = 0; pos < log_size; pos += sizeof(wbuf))
+		{
+			for (uint32_t i = 0; i < sizeof(wbuf); i++)
+				wbuf[i] = FatImage::byte(0x106, pos + i);
+			uint32_t n = (log_size - pos < sizeof(wbuf))?(log_size - pos):sizeof(wbuf);
+			if ((fat.f_write_block(&f, wbuf, n) < 0) || wait_fat(&f))
+			{
+				FAIL("fat%u: writing LOG.TXT at %u failed (%d)\n", type, pos, f.error);
+				break;
+			}
+		}
+		first = f.file.root_cluster;
+		if ((fat.f_close(&f) != 1) || wait_fat(&f))
+			FAIL("fat%u: closing LOG.TXT failed (%d)\n", type, f.error);
+	}
+
+	fat.f_mount(&m, sdf);
+	if (wait_fat(&m))
+		FAIL("fat%u: remount failed (%d)\n", type, m.error);
+	fat_check_file(&fat, "LOG.TXT", log_size, 0x106, 4096);
+
+	// FatImage reads the tables its own way
+	fat_image_check(image, partition_lba, fat_lba, sectors_per_fat);
+	if (fat_chain_length(image, fat_lba, type, first) != 700)
+		FAIL("fat%u: LOG.TXT's chain is %u clusters\n", type, fat_chain_length(image, fat_lba, type, first));
+
+	while (sim_wfi())
+		SD::on_idle_all();
+	sim_spi_attach(0, NULL);
+}
+
+// writes a file from empty in 4k pieces, a step at a time, then closes it
+struct FatWriter
+{
+	_fat_file_ioresult f;
+	uint8_t  buf[4096];
+	uint32_t seed;
+	uint32_t size;
+	uint32_t off;
+	uint8_t  closing;
+	uint64_t done_ns;
+
+	void start(Fat* fat, uint32_t s, uint32_t n)
+	{
+		seed    = s;
+		size    = n;
+		off     = 0;
+		closing = 0;
+		done_ns = 0;
+		step(fat);
+	}
+
+	// carries on if the last step's finished. Returns 1 once it's closed
+	int step(Fat* fat)
+	{
+		if (done_ns)
+			return 1;
+		if (off && (f.fini == 0))
+			return 0;
+		if (off && f.error)
+		{
+			FAIL("fat: writing %s failed (%d)\n", f.file.path, f.error);
+			done_ns = sim_now_ns();
+			return 1;
+		}
+		if (closing || (off >= size))
+		{
+			if (closing || (fat->f_close(&f) == 0))
+			{
+				done_ns = sim_now_ns();
+				return 1;
+			}
+			closing = 1;
+			return 0;
+		}
+
+		uint32_t n = (size - off < sizeof(buf))?(size - off):sizeof(buf);
+		for (uint32_t i = 0; i < n; i++)
+			buf[i] = FatImage::byte(seed, off + i);
+		fat->f_write_block(&f, buf, n);
+		off += n;
+		return 0;
+	}
+};
+
+/*
+ * a print job streams in as one big read, while a settings file is looked
+ * up and read, and two status files are written from empty, all at once.
+ * None of the small ones should be left waiting for the job to finish
+ */
+static void test_fat_concurrent(const char* image)
+{
+	uint32_t partition_lba, fat_lba, sectors_per_fat;
+	{
+		FatImage img(image, 32, 131072, 1);
+
+		img.add_file(img.root(), "JOB.GCO", 1200 * 512, 0x10B, 300);
+		uint32_t settings = img.mkdir(img.root(), "Settings");
+		img.add_file(settings, "Printer settings.ini", 3000, 0x5E7);
+		img.add_file(img.root(), "STATUS.TXT", 0, 0);
+		img.add_file(img.root(), "TEMPS.LOG", 0, 0);
+
+		partition_lba   = img.partition_lba;
+		fat_lba         = img.fat_lba;
+		sectors_per_fat = img.sectors_per_fat;
+	}
+
+	SDCardSim card(image, true);
+	sim_spi_attach(0, &card);
+
+	SD* sdf = fat_card_init();
+	if (sdf == NULL)
+	{
+		sim_spi_attach(0, NULL);
+		return;
+	}
+
+	static _fat_mount_ioresult m;
+	fat.f_mount(&m, sdf);
+	if (wait_fat(&m))
+	{
+		FAIL("fat: mount failed (%d)\n", m.error);
+		sim_spi_attach(0, NULL);
+		return;
+	}
+	while ((fat.f_freemap_complete() == 0) && sim_wfi())
+		SD::on_idle_all();
+
+	static _fat_file_ioresult job, ini;
+	static FatWriter status, temps;
+	static uint8_t jobbuf[1200 * 512];
+	static uint8_t inibuf[4096];
+
+	if ((fat_open(&fat, &job, "JOB.GCO", sizeof(jobbuf)) < 0) ||
+		(fat_open(&fat, &status.f, "STATUS.TXT", 0) < 0) ||
+		(fat_open(&fat, &temps.f, "TEMPS.LOG", 0) < 0))
+	{
+		sim_spi_attach(0, NULL);
+		return;
+	}
+
+	uint64_t t0 = sim_now_ns(), job_ns = 0, ini_ns = 0;
+	uint32_t cmd18 = card.stats.cmd[18];
+
+	// the queue only runs from the card's interrupt, never in the caller
+	uint32_t requests = sdf->get_stats()->read.requests;
+	fat.f_read_block(&job, jobbuf, sizeof(jobbuf));
+	if (sdf->get_stats()->read.requests != requests)
+		FAIL("fat: f_read_block() went to the card before returning\n");
+
+	memset(&ini, 0, sizeof(ini));
+	fat.f_open(&ini, "/settings/printer SETTINGS.ini");
+	status.start(&fat, 0x57A, 20 * 1024);
+	temps.start(&fat, 0x7E3, 20 * 1024 + 300);
+
+	int ini_stage = 0;
+	for (;;)
+	{
+		if ((job_ns == 0) && job.fini)
+			job_ns = sim_now_ns();
+
+		if (ini.fini && (ini_stage == 0))
+		{
+			ini_stage = 1;
+			if (ini.error)
+				FAIL("fat: couldn't open the settings (%d)\n", ini.error);
+			else
+				fat.f_read_block(&ini, inibuf, sizeof(inibuf));
+		}
+		else if (ini.fini && (ini_stage == 1))
+		{
+			ini_stage = 2;
+			ini_ns = sim_now_ns();
+		}
+
+		int writing = (status.step(&fat) == 0) | (temps.step(&fat) == 0);
+		if ((job_ns == 0) || (ini_stage < 2) || writing)
+		{
+			SD::on_idle_all();
+			if (sim_wfi() == 0)
+			{
+				FAIL("fat: stalled with the job %s, settings at %d, status at %u, temps at %u\n",
+					job.fini?"read":"reading", ini_stage, status.off, temps.off);
+				sim_spi_attach(0, NULL);
+				return;
+			}
+			continue;
+		}
+		break;
+	}
+
+	printf("fat: job read in %.3f ms (%u CMD18), alongside it settings in %.3f ms, status files written in %.3f and %.3f ms\n",
+		(job_ns - t0) / 1e6, card.stats.cmd[18] - cmd18, (ini_ns - t0) / 1e6,
+		(status.done_ns - t0) / 1e6, (temps.done_ns - t0) / 1e6);
+	if ((ini_ns > job_ns) || (status.done_ns > job_ns) || (temps.done_ns > job_ns))
+		FAIL("fat: small files waited for the job\n");
+
+	if (job.error || (job.buflen != sizeof(jobbuf)))
+		FAIL("fat: job read failed (%d), %u bytes\n", job.error, job.buflen);
+	for (uint32_t i = 0; i < sizeof(jobbuf); i++)
+		if (jobbuf[i] != FatImage::byte(0x10B, i))
+		{
+			FAIL("fat: job: bad data at %u\n", i);
+			break;
+		}
+	if (ini.error || (ini.buflen != 3000))
+		FAIL("fat: settings read failed (%d), %u bytes\n", ini.error, ini.buflen);
+	for (uint32_t i = 0; i < 3000; i++)
+		if (inibuf[i] != FatImage::byte(0x5E7, i))
+		{
+			FAIL("fat: settings: bad data at %u\n", i);
+			break;
+		}
+	fat.f_close(&job);
+	fat.f_close(&ini);
+
+	// the two files took clusters at the same time, and neither has the
+	// other's
+	fat.f_mount(&m, sdf);
+	if (wait_fat(&m))
+		FAIL("fat: remount failed (%d)\n", m.error);
+	fat_check_file(&fat, "STATUS.TXT", 20 * 1024, 0x57A, 4096);
+	fat_check_file(&fat, "TEMPS.LOG", 20 * 1024 + 300, 0x7E3, 4096);
+	fat_check_file(&fat, "JOB.GCO", sizeof(jobbuf), 0x10B, 8192);
+	fat_image_check(image, partition_lba, fat_lba, sectors_per_fat);
+
+	while (sim_wfi())
+		SD::on_idle_all();
+	sim_spi_attach(0, NULL);
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "usage: %s [-i image] [-m size_mb] [-s] [-b]\n", prog);
+	fprintf(stderr, "  -i image    disk image to use (default: a scratch file, deleted afterwards)\n");
+	fprintf(stderr, "  -m size_mb  size of the scratch image (default 64)\n");
+	fprintf(stderr, "  -s          present the card as SDSC rather than SDHC\n");
+	fprintf(stderr, "  -b          run the benchmark suite instead of the tests. Writes to the image\n");
+	exit(2);
+}
+
+int main(int argc, char** argv)
+{
+	const char* image = NULL;
+	uint32_t size_mb = 64;
+	bool sdhc = true;
+	bool bench = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:m:sb")) != -1)
+	{
+		switch (opt)
+		{
+			case 'i': image = optarg; break;
+			case 'm': size_mb = strtoul(optarg, NULL, 0); break;
+			case 's': sdhc = false; break;
+			case 'b': bench = true; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	char scratch[] = "/tmp/sdsim-XXXXXX";
+	if (image == NULL)
+	{
+		int fd = mkstemp(scratch);
+		if ((fd < 0) || ftruncate(fd, ((off_t) size_mb) << 20))
+		{
+			perror(scratch);
+			return 1;
+		}
+		close(fd);
+		image = scratch;
+	}
+
+	if (seed_image(image) < 0)
+		return 1;
+
+	SDCardSim card(image, sdhc);
+	sim_spi_attach(1, &card);
+
+	SPI* spi = new SPI(SSP1_MOSI, SSP1_MISO, SSP1_SCK, SSP1_SS);
+
+	sd = new SD(spi);
+
+	// init runs in the background, and a request made straight after
+	// waits for it
+	{
+		static Counter init_rx;
+		init_rx.remaining   = 2;
+		init_rx.seed        = 0;
+		init_rx.init_result = 0;
+
+		uint64_t t0 = sim_now_ns();
+		uint8_t* buf = (uint8_t*) AHB0.alloc(512);
+
+		if ((sd->begin_init(&init_rx) < 0) || (sd->begin_read(5, 1, buf, &init_rx) < 0))
+			FAIL("init: couldn't queue requests\n");
+		if (sim_now_ns() != t0)
+			FAIL("init: begin_init held the caller up for %.3f ms\n", (sim_now_ns() - t0) / 1e6);
+
+		sim_isr_longest_ns();
+		wait_for(&init_rx.remaining);
+		AHB0.dealloc(buf);
+
+		// a step is a command or two on the 25kHz identification clock,
+		// never a whole stage of bringing the card up
+		uint64_t longest = sim_isr_longest_ns();
+		if (longest > 10000000)
+			FAIL("init: an interrupt ran for %.3f ms\n", longest / 1e6);
+
+		if (init_rx.init_result < 1)
+		{
+			FAIL("init returned %d\n", init_rx.init_result);
+			goto out;
+		}
+	}
+
+	if (sd->n_sectors() != card.n_sectors())
+		FAIL("card reports %u sectors, image has %u\n", sd->n_sectors(), card.n_sectors());
+
+	sd->dump_info();
+	printf("init done at %.3f ms\n\n", sim_now_ns() / 1e6);
+
+	if (bench)
+	{
+		SD_bench b(sd);
+		b.suite(sd->n_sectors() / 2, sd->n_sectors() / 4, 1);
+		goto out;
+	}
+
+	{
+		uint8_t* buf = (uint8_t*) AHB0.alloc(512 * 16);
+
+		for (uint32_t s = 0; s < 4; s++)
+			test_read("single read", s * 7, 1, buf, 0);
+
+		test_read("legacy multi read", 500, 8, buf, 0);
+		test_read("streamed read", 100, 256, NULL, 0);
+		test_read("streamed read", 1024, 1024, NULL, 0);
+
+		test_write("single write", 3000, 1, buf, 0x5A5A5A5A);
+		test_read("  read back", 3000, 1, buf, 0x5A5A5A5A);
+
+		test_write("multi write", 4000, 16, buf, 0xA5A5A5A5);
+		test_read("  read back", 4000, 16, NULL, 0xA5A5A5A5);
+
+		// the neighbours must not have been touched
+		test_read("  neighbours", 1999, 1, buf, 0);
+
+		AHB0.dealloc(buf);
+	}
+
+	test_merge(&card);
+	test_prefetch(&card);
+	test_erase(&card);
+	test_held("held streamed read", 1100, 64, true);
+	test_held("held multi read", 1300, 8, false);
+	test_bench();
+
+	// the blocking init() is begin_init() and a sleep, and can bring the
+	// card back up from wherever it's got to
+	if (sd->init() < 1)
+		FAIL("init() couldn't bring the card up again\n");
+	else
+	{
+		uint8_t* buf = (uint8_t*) AHB0.alloc(512);
+		test_read("read after init()", 7, 1, buf, 0);
+		AHB0.dealloc(buf);
+	}
+
+	// a second card on SSP0, on a scratch image of its own
+	{
+		char scratch_b[] = "/tmp/sdsim-XXXXXX";
+		int fd = mkstemp(scratch_b);
+		if ((fd < 0) || ftruncate(fd, 16 << 20))
+		{
+			perror(scratch_b);
+			goto out;
+		}
+		close(fd);
+
+		if (seed_image(scratch_b) == 0)
+		{
+			SDCardSim card_b(scratch_b, true);
+			sim_spi_attach(0, &card_b);
+
+			SD* sd_b = new SD(new SPI(SSP0_MOSI, SSP0_MISO, SSP0_SCK, SSP0_SS));
+
+			static Counter init_rx;
+			init_rx.remaining   = 1;
+			init_rx.init_result = 0;
+			sd_b->begin_init(&init_rx);
+			wait_for(&init_rx.remaining);
+
+			if (init_rx.init_result < 1)
+				FAIL("second card: init returned %d\n", init_rx.init_result);
+			else
+				test_two_cards(sd_b);
+
+			sim_spi_attach(0, NULL);
+		}
+
+		unlink(scratch_b);
+	}
+
+	// a FAT filesystem on another card
+	{
+		char scratch_f[] = "/tmp/sdsim-XXXXXX";
+		int fd = mkstemp(scratch_f);
+		if (fd < 0)
+		{
+			perror(scratch_f);
+			goto out;
+		}
+		close(fd);
+
+		test_fat(scratch_f);
+		test_fat_concurrent(scratch_f);
+		test_fat_type(scratch_f, 16, 2048 + 40960);
+		test_fat_type(scratch_f, 12, 2048 + 3072);
+
+		// either side of the FAT12/FAT16 boundary: 4084 clusters of data
+		// and 4085, on partitions well over 4085 sectors
+		test_fat_type(scratch_f, 12, 2048 + 4141);
+		test_fat_type(scratch_f, 16, 2048 + 4150);
+
+		unlink(scratch_f);
+	}
+
+	// a garbled block should cost us some clock and a retry, not the data
+	{
+		uint32_t hz = sd->get_frequency();
+
+		uint8_t* buf = (uint8_t*) AHB0.alloc(512 * 4);
+		fill(buf, 7000, 4, 0x44444444);
+
+		uint32_t cmd25 = card.stats.cmd[25];
+		card.fail_writes = 1;
+		test_write("garbled write", 7000, 4, buf, 0x44444444);
+		if (card.stats.cmd[25] != cmd25 + 2)
+			FAIL("garbled write: %u CMD25 for one retry\n", card.stats.cmd[25] - cmd25);
+
+		if (sd->get_frequency() >= hz)
+			FAIL("clock: still at %uHz after a CRC error\n", sd->get_frequency());
+		printf("clock stepped down from %uHz to %uHz\n", hz, sd->get_frequency());
+
+		uint32_t cmd18 = card.stats.cmd[18];
+		card.fail_reads = 1;
+		test_read("garbled stream", 7000, 4, NULL, 0x44444444);
+		if (card.stats.cmd[18] != cmd18 + 2)
+			FAIL("garbled stream: %u CMD18 for one retry\n", card.stats.cmd[18] - cmd18);
+
+		card.fail_reads = 1;
+		test_read("garbled read", 7002, 1, buf, 0x44444444);
+
+		// a garbled block whose CRC is still to be checked when the next
+		// one fails outright is gone back for, not lost
+		cmd18 = card.stats.cmd[18];
+		card.fail_reads = 1;
+		card.error_read = 2;
+		test_read("garbled, then error", 7000, 4, NULL, 0x44444444);
+		if (card.stats.cmd[18] != cmd18 + 2)
+			FAIL("garbled, then error: %u CMD18 for one retry\n", card.stats.cmd[18] - cmd18);
+
+		// a block that never gets through has to be reported
+		card.fail_writes = SD_CRC_RETRIES + 1;
+		checker.expect(7100, 1, 0x44444444);
+		checker.want_error = true;
+		sd->begin_write(7100, 1, buf, &checker);
+		wait_for(&checker.remaining);
+		if (checker.errors == 0)
+			FAIL("clock: hopeless write wasn't reported\n");
+
+		test_write("write after step-down", 7000, 1, buf, 0x55555555);
+		test_read("  read back", 7000, 1, buf, 0x55555555);
+
+		printf("%u CRC errors caught\n", card.stats.crc_errors);
+
+		AHB0.dealloc(buf);
+	}
+
+	printf("\ncommands: CMD17 %u, CMD18 %u, CMD24 %u, CMD25 %u, CMD12 %u, ACMD23 %u\n",
+		card.stats.cmd[17], card.stats.cmd[18], card.stats.cmd[24], card.stats.cmd[25], card.stats.cmd[12], card.stats.acmd[23]);
+
+	sd->dump_stats();
+
+	// the driver's own counters should agree with what the card saw
+	{
+		const sd_stats_t* st = sd->get_stats();
+
+		if (st->read.retries < 2 || st->write.retries < SD_CRC_RETRIES + 1)
+			FAIL("stats: %u read and %u write retries\n", st->read.retries, st->write.retries);
+		if (st->refused == 0)
+			FAIL("stats: queue-full refusals weren't counted\n");
+		if (st->read.latency[SD_STAT_DMA].n + st->write.latency[SD_STAT_DMA].n != card.stats.blocks_read + card.stats.blocks_written + card.stats.crc_errors)
+			FAIL("stats: %u blocks over DMA, card saw %u\n",
+				st->read.latency[SD_STAT_DMA].n + st->write.latency[SD_STAT_DMA].n,
+				card.stats.blocks_read + card.stats.blocks_written + card.stats.crc_errors);
+	}
+
+out:
+	if (image == scratch)
+		unlink(scratch);
+
+	if (failures)
+	{
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("all tests passed\n");
+	return 0;
+}
@@ -1,21 +1,37 @@
 #include "SD.h"
 
+#include "crc.h"
+
 #include <cstddef>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
 #include "platform_utils.h"
+#include "platform_memory.h"
 
 #include "mri.h"
 
 #define TRACE(...) printf(__VA_ARGS__)
 
 #define CMD_TIMEOUT 32
-#define READ_TIMEOUT 512
-#define WRITE_TIMEOUT 512
+
+// access timeouts, in microseconds. SDHC cards always use these, SDSC cards
+// use them as a ceiling for the values worked out from their CSD
+#define SD_READ_TIMEOUT_US   100000
+#define SD_WRITE_TIMEOUT_US  250000
+
+// an erase may take 250ms per allocation unit. We don't read the SSR, so
+// assume AUs of 4MB
+#define SD_ERASE_AU_SECTORS 8192
+
+// ACMD41 may take up to a second to bring the card out of idle
+#define SD_INIT_TIMEOUT_US  1000000
+#define SD_INIT_POLL_US        1000
 
 typedef enum {
     SD_CMD_GO_IDLE_STATE =  0,
+    SD_CMD_SWITCH_FUNC   =  6,
     SD_CMD_SEND_IF_COND  =  8,
     SD_CMD_SEND_CSD      =  9,
     SD_CMD_SEND_CID      = 10,
@@ -24,8 +40,12 @@ typedef enum {
     SD_CMD_READ_BLOCKS   = 18,
     SD_CMD_WRITE_BLOCK   = 24,
     SD_CMD_WRITE_BLOCKS  = 25,
+    SD_CMD_ERASE_START   = 32,
+    SD_CMD_ERASE_END     = 33,
+    SD_CMD_ERASE         = 38,
     SD_CMD_APP_CMD       = 55,
-    SD_CMD_READ_OCR      = 58
+    SD_CMD_READ_OCR      = 58,
+    SD_CMD_CRC_ON_OFF    = 59
 } SD_CMD_NUM;
 
 typedef enum {
@@ -33,34 +53,75 @@ typedef enum {
     SD_ACMD_SEND_OP_COND        = 41
 } SD_ACMD_NUM;
 
+typedef enum {
+	SD_INIT_STATUS_START,
+	SD_INIT_STATUS_GO_IDLE,
+	SD_INIT_STATUS_IF_COND,
+	SD_INIT_STATUS_OP_COND,
+	SD_INIT_STATUS_OCR,
+	SD_INIT_STATUS_CRC,
+	SD_INIT_STATUS_CSD,
+	SD_INIT_STATUS_SWITCH,
+	SD_INIT_STATUS_SWITCH_STATUS,
+	SD_INIT_STATUS_CID
+} SD_INIT_STATUS;
+
+typedef enum {
+	SD_ERASE_STATUS_START,
+	SD_ERASE_STATUS_WAIT_BSY
+} SD_ERASE_STATUS;
+
 typedef enum {
 	SD_READ_STATUS_START,
 	SD_READ_STATUS_WAIT_TRAN,
     SD_READ_STATUS_CONTINUE_MULTI,
     SD_READ_STATUS_DMA,
 	SD_READ_STATUS_CHECKSUM,
-    SD_READ_STATUS_BUFFER_DIRTY
+    SD_READ_STATUS_BUFFER_DIRTY,
+    SD_READ_STATUS_RESTART,     // command again from w->sector, after a CRC failure
+    SD_READ_STATUS_PREFETCH     // read-ahead between blocks, or waiting for room in the ring
 } SD_READ_STATUS;
 
 typedef enum {
 	SD_WRITE_STATUS_START,
     SD_WRITE_STATUS_WAIT_BSY,
+    SD_WRITE_STATUS_WAIT_BSY_LAST,
     SD_WRITE_STATUS_DMA,
     SD_WRITE_STATUS_CHECKSUM,
-    SD_WRITE_STATUS_WAIT_RESPONSE,
-    SD_WRITE_STATUS_BUFFER_DIRTY
+    SD_WRITE_STATUS_STOP_TRAN,
+    SD_WRITE_STATUS_RESTART     // command again from w->sector, after a CRC failure
 } SD_WRITE_STATUS;
 
+// data tokens
+#define SD_TOKEN_START_BLOCK        0xFE
+#define SD_TOKEN_START_BLOCK_MULTI  0xFC
+#define SD_TOKEN_STOP_TRAN          0xFD
+
+// data response, xxx0sss1
+#define SD_DATA_RESPONSE_MASK       0x1F
+#define SD_DATA_RESPONSE_ACCEPTED   0x05
+#define SD_DATA_RESPONSE_CRC_ERROR  0x0B
+
+// R1 bit for a command that arrived with a bad checksum
+#define SD_R1_COM_CRC_ERROR         0x08
+
 typedef enum {
 	SD_FLAG_IDLE     = 0,
 	SD_FLAG_RUNNING  = 1,
 	SD_FLAG_ERROR    = 2,
 	SD_FLAG_WAIT_BSY = 4,
-	SD_FLAG_REQ_WORK = 8
+	SD_FLAG_DMA      = 8
 } SD_WORK_FLAGS;
 
 #define SD_HIGH_CAPACITY (1<<30)
 
+// CMD6 argument: function 1 (high speed) in group 1, leave the rest alone
+#define SD_SWITCH_CHECK      0x00FFFFF1
+#define SD_SWITCH_SET        0x80FFFFF1
+
+// TAAC and TRAN_SPEED mantissa x10
+static const uint8_t csd_time_value[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+
 #include "platform_utils.h"
 
 // #undef printf
@@ -97,10 +158,7 @@ static int sd_cmdx(SPI* spi, int cmd, uint32_t arg)
 	
 	spi_cmd.cmd = 0x40 | cmd;
 	spi_cmd.arg = htonl(arg);
-	if (cmd == 8)
-		spi_cmd.checksum = 0x87;
-	else
-		spi_cmd.checksum = 0x95;
+	spi_cmd.checksum = sd_crc7(&spi_cmd.cmd, 5);
 
 // 	printf("spi_cmdx Send: ");
 // 	for (uint32_t q = 0; q < sizeof(spi_cmd); q++)
@@ -256,22 +314,13 @@ static inline int sd_cmd_read_ocr(SPI* spi, uint32_t* ocr)
 static inline int sd_acmd_send_op_cond(SPI* spi)
 {
 	int r;
-	
-	int i = READ_TIMEOUT;
-	
-	do
-	{
-		if ((r = sd_cmd(spi, SD_CMD_APP_CMD, 0)) & 0x7E)
-			return -1;
-		
-		if ((r = sd_cmd(spi, SD_ACMD_SEND_OP_COND, SD_HIGH_CAPACITY)) & 0x7E)
-			return -1;
-		
-		if (--i <= 0)
-			return -1;
-	}
-	while (r == 1);
-	
+
+	if ((r = sd_cmd(spi, SD_CMD_APP_CMD, 0)) & 0x7E)
+		return -1;
+
+	if ((r = sd_cmd(spi, SD_ACMD_SEND_OP_COND, SD_HIGH_CAPACITY)) & 0x7E)
+		return -1;
+
 	return r;
 }
 
@@ -332,14 +381,26 @@ static int sd_cmd_send_cid(SPI* spi, void* CID)
 	return r;
 }
 
+SD* SD::instances = NULL;
+
 SD::SD(SPI* spi)
 {
 	this->spi = spi;
+
+	next_instance = instances;
+	instances     = this;
 	
 	card_type = SD_TYPE_NONE;
 	sector_count = 0;
+	high_speed = 0;
+
+	use_crc = 0;
+	crc_pending.buf = NULL;
+	crc_tx = 0xFFFF;
+	crc_tx_next = 0xFFFF;
 
 	txm = 0xFFFFFFFF;
+	rxm = 0;
 	dma_txmem.setup(&txm, 4);
 	dma_txmem.auto_increment = DMA_NO_INCREMENT;
 
@@ -349,93 +410,109 @@ SD::SD(SPI* spi)
 	dma_rx.set_source(this);
 	dma_rx.set_destination(&dma_rxmem);
 
+	// DMA can't reach local SRAM, so streaming buffers come from AHB
+	for (int i = 0; i < SD_READ_BUFFERS; i++)
+		read_buf[i] = (uint8_t*) AHB0.alloc(512);
+	read_buf_dirty    = 0;
+	read_buf_next     = 0;
+	read_buf_returned = NULL;
+
+	// read-ahead goes in the other bank, out of the way of everyone else's
+	// buffers. Without it we just do without
+	prefetch_ring  = SD_PREFETCH_BLOCKS?((uint8_t*) AHB1.alloc(SD_PREFETCH_BLOCKS * 512)):NULL;
+	prefetch_first = 0;
+	prefetch_head  = 0;
+	prefetch_count = 0;
+
+	seq_receiver = NULL;
+	seq_next     = 0;
+	seq_run      = 0;
+
+	timer.set_receiver(this);
+
+	read_timeout_us  = SD_READ_TIMEOUT_US;
+	write_timeout_us = SD_WRITE_TIMEOUT_US;
+	read_poll_us     = 100;
+	write_poll_us    = 100;
+	wait_deadline    = 0;
+
+	work_free = (SD_QUEUE_DEPTH == 32)?0xFFFFFFFF:((1UL << SD_QUEUE_DEPTH) - 1);
+	for (int i = 0; i < SD_QUEUE_DEPTH; i++)
+		work_ring[i].seq = 0;
+	work_ring_in  = 0;
+	work_ring_out = 0;
+
 	work_stack = NULL;
-	gc_stack   = NULL;
+
+	wake_receiver = NULL;
+
+	last_sector = 0;
+
+	pre_erase_sector = 0;
+	pre_erase_count  = 0;
 
 	work_flags = SD_FLAG_IDLE;
+
+	cycle_counter_init();
+	stat_cycles_per_us = cycle_counter_hz() / 1000000;
+	stat_wait_start    = 0;
+	stat_dma_start     = 0;
+	stat_action        = SD_WORK_ACTION_NONE;
+	reset_stats();
 }
 
-int SD::init()
+// begin_init()'s receiver while init() waits
+class SD_init_waiter : public SD_async_receiver
 {
-	int i, r;
-	
-	card_type = SD_TYPE_NONE;
-	
-	spi->set_frequency(25000);
-	
-	for (i = 0; i < CMD_TIMEOUT; i++)
+public:
+	volatile int result;
+
+	void sd_read_complete(SD*, uint32_t, void*, int) {}
+	void sd_write_complete(SD*, uint32_t, void*, int) {}
+
+	void sd_init_complete(SD*, int r)
 	{
-		r = sd_cmd_go_idle_state(spi);
-		if (r == 1)
-			break;
+		result = r;
 	}
-	
-	if (i >= CMD_TIMEOUT)
+};
+
+/*
+ * blocking init: begin_init(), then sleep until it's done. Returns 1 when
+ * the card is ready, negative on failure
+ */
+int SD::init()
+{
+	SD_init_waiter waiter;
+	waiter.result = 0;
+
+	if (begin_init(&waiter) < 0)
 		return -1;
-	
-	r = sd_cmd_send_if_cond(spi);
-	
-	if (r & 4)
-		card_type = SD_TYPE_MMC;
-	
-	// TODO: support MMC
-	if (r != 1)
-		return -2;
-	
-	r = sd_acmd_send_op_cond(spi);
-	if (r != 0)
-		return -3;
-	
-	uint32_t ocr = 0;
-	
-	do
-	{
-		r = sd_cmd_read_ocr(spi, &ocr);
 
-		if (r & 0x7E)
-			return -4;
-		
-		if ((ocr & (1<<20)) == 0)
-			// error: card does not support 3.2-3.3v!
-			return -5;
-		
-		if (ocr & SD_HIGH_CAPACITY)
-			card_type = SD_TYPE_SDHC;
-		else
-			card_type = SD_TYPE_SD;
-	}
-	while ((ocr & (1<<31)) == 0);
-	
-	// card is fully started, now boost frequency	
-	spi->set_frequency(10000000);
+	while (waiter.result == 0)
+		__WFI();
 
-	uint8_t csd[16];
-	
-	r = sd_cmd_send_csd(spi, csd);
-	if (r & 0x7E)
-		return -6;
+	return waiter.result;
+}
 
-	if (ext_bits(csd, 127, 126) == 0)
-	{
-		sector_count = (ext_bits(csd, 75, 62) + 1)
-		       * (1 << (ext_bits(csd, 49, 47) + 2))
-		       * (1 << (ext_bits(csd, 83, 80) - 9));
-	}
-	else if (ext_bits(csd, 127, 126) == 1)
-	{
-		sector_count = (ext_bits(csd, 69, 48) + 1) * 1024;
-	}
-	else
-		return -7;
-	
-	printf("\nTotal Sectors: %lu\n", sector_count);
-	printf("Card Size: %lu.%lu%c\n", (sector_count >= 2097152)?(sector_count / 2097152):(sector_count / 2048), (sector_count >= 2097152)?((sector_count / 209715) % 10):((sector_count / 205) % 10), (sector_count >= 2097152)?('G'):('M') );
+// fastest the card will go in its current mode, from TRAN_SPEED
+uint32_t SD::csd_tran_speed()
+{
+	// mantissa, then unit in bit/s as a power of 10 from 100k
+	uint32_t tran_speed = ext_bits(csd, 103, 96);
+	uint32_t hz = csd_time_value[(tran_speed >> 3) & 15] * 10000;
+	for (uint32_t u = tran_speed & 7; u; u--)
+		hz *= 10;
 
-	uint8_t cid[16];
+	return hz;
+}
 
-	r = sd_cmd_send_cid(spi, cid);
-	if (r & 0x7E)
-		return -8;
+/*
+ * what init() found, for a human. It prints, so not from interrupt context
+ */
+void SD::dump_info()
+{
+	printf("\nTotal Sectors: %lu\n", sector_count);
+	printf("Card Size: %lu.%lu%c\n", (sector_count >= 2097152)?(sector_count / 2097152):(sector_count / 2048), (sector_count >= 2097152)?((sector_count / 209715) % 10):((sector_count / 205) % 10), (sector_count >= 2097152)?('G'):('M') );
 
 	printf("MID %lu (%c%c) %c%c%c%c%c s/n:%lu date:%lu/%lu\n",
 		ext_bits(cid, 127, 120),
@@ -444,21 +521,166 @@ int SD::init()
 		ext_bits(cid,  55,  24),
 		ext_bits(cid,  11,   8), ext_bits(cid,  19,  12) + 2000
 	);
-	
-	return 1;
+
+	printf("Clock: %luHz (card %luHz%s)\n", spi->get_frequency(), csd_tran_speed(), high_speed?", high speed":"");
+	printf("Access: read %luus/%luus write %luus/%luus (poll/timeout)\n", read_poll_us, read_timeout_us, write_poll_us, write_timeout_us);
 }
 
-void SD::on_idle()
+/*
+ * a transfer failed in a way that points at the bus rather than the card,
+ * so drop the clock a notch for everything after it
+ */
+void SD::link_error()
 {
-	if ((work_flags & (SD_FLAG_RUNNING | SD_FLAG_REQ_WORK)) == (SD_FLAG_RUNNING | SD_FLAG_REQ_WORK))
-		work_stack_work();
+	uint32_t hz = spi->get_frequency();
+	if (hz <= SD_SPI_MIN_HZ)
+		return;
+
+	stats.link_errors++;
+
+	hz = (hz * 3) / 4;
+	if (hz < SD_SPI_MIN_HZ)
+		hz = SD_SPI_MIN_HZ;
+
+	hz = spi->set_frequency(hz);
+
+	// NSAC is counted in clocks, so timeouts move with the clock
+	csd_timing(csd, hz);
+}
+
+uint32_t SD::get_frequency()
+{
+	return spi->get_frequency();
+}
+
+/*
+ * work out how long the card may take to respond from TAAC, NSAC and
+ * R2W_FACTOR in its CSD, so token and busy waits know how often to poll
+ * and when to give up
+ */
+void SD::csd_timing(uint8_t* csd, uint32_t spi_hz)
+{
+	// TAAC mantissa, then unit in ns as a power of 10
+	uint32_t taac = ext_bits(csd, 119, 112);
+	uint32_t taac_ns = csd_time_value[(taac >> 3) & 15];
+	for (uint32_t u = taac & 7; u; u--)
+		taac_ns *= 10;
+	taac_ns /= 10;
+
+	uint32_t nsac_us = (uint32_t) ((ext_bits(csd, 111, 104) * 100ULL * 1000000ULL) / spi_hz);
+
+	uint32_t typ_read_us  = (taac_ns / 1000) + nsac_us + 1;
+	uint32_t typ_write_us = typ_read_us << ext_bits(csd, 28, 26);
+
+	if (ext_bits(csd, 127, 126) == 0)
+	{
+		// SDSC: 100x typical, but no longer than the SDHC limits
+		read_timeout_us  = typ_read_us  * 100;
+		write_timeout_us = typ_write_us * 100;
+		if (read_timeout_us > SD_READ_TIMEOUT_US)
+			read_timeout_us = SD_READ_TIMEOUT_US;
+		if (write_timeout_us > SD_WRITE_TIMEOUT_US)
+			write_timeout_us = SD_WRITE_TIMEOUT_US;
+	}
+	else
+	{
+		read_timeout_us  = SD_READ_TIMEOUT_US;
+		write_timeout_us = SD_WRITE_TIMEOUT_US;
+	}
+
+	// poll often enough that we don't add much latency to a typical access
+	read_poll_us  = typ_read_us  / 16;
+	write_poll_us = typ_write_us / 16;
+
+	if (read_poll_us < 8)
+		read_poll_us = 8;
+	if (read_poll_us > 500)
+		read_poll_us = 500;
+	if (write_poll_us < 16)
+		write_poll_us = 16;
+	if (write_poll_us > 2000)
+		write_poll_us = 2000;
+}
+
+void SD::wait_begin(uint32_t timeout_us)
+{
+	stat_wait_start = cycle_counter();
+	wait_deadline = timer.now_us() + timeout_us;
+}
+
+int SD::wait_expired()
+{
+	return ((int32_t) (timer.now_us() - wait_deadline)) >= 0;
+}
+
+/*
+ * check again in poll_us, unless we've already run out of time
+ */
+int SD::wait_poll(uint32_t poll_us)
+{
+	if (wait_expired())
+		return -1;
+
+	timer.start_us(poll_us);
+
+	return 0;
+}
+
+/*
+ * the card is holding DO low after a stop or a failed write.
+ * nothing else can talk to it until it lets go
+ */
+void SD::busy_begin()
+{
+	work_flags |= SD_FLAG_WAIT_BSY;
+	wait_begin(write_timeout_us);
+	timer.start_us(write_poll_us);
+}
+
+void SD::timer_expired(Timer*)
+{
+	SD_async_receiver* r = (SD_async_receiver*) __sync_lock_test_and_set(&wake_receiver, NULL);
+	if (r)
+		r->sd_wake(this);
 
-	while (gc_stack)
+	if (work_flags & SD_FLAG_WAIT_BSY)
 	{
-		sd_work_stack_t* w = gc_stack;
-		gc_stack = w->next;
-		free(w);
+		if (spi->transfer(0xFF) == 0x00)
+		{
+			if (wait_poll(write_poll_us) == 0)
+				return;
+
+			// card never came back. Carry on, the next command will find out
+			work_flags |= SD_FLAG_ERROR;
+		}
+
+		else
+			stat_sample(stat_action, SD_STAT_BUSY, stat_wait_start);
+
+		spi->end_transaction();
+		work_flags &= ~SD_FLAG_WAIT_BSY;
 	}
+
+	// a block is in flight, dma_complete will pick it up from here
+	if (work_flags & SD_FLAG_DMA)
+		return;
+
+	work_stack_fetch();
+
+	if (work_stack)
+		work_stack_work();
+}
+
+void SD::on_idle()
+{
+	// request descriptors go straight back to the pool as they complete, so
+	// there's nothing left to tidy up here
+}
+
+void SD::on_idle_all()
+{
+	for (SD* sd = instances; sd; sd = sd->next_instance)
+		sd->on_idle();
 }
 
 SD_CARD_TYPE SD::get_type()
@@ -471,17 +693,106 @@ uint32_t SD::n_sectors()
 	return sector_count;
 }
 
+int SD::begin_init(SD_async_receiver* receiver)
+{
+	sd_work_stack_t* w = work_stack_new();
+	if (w == NULL)
+	{
+		__sync_fetch_and_add(&stats.refused, 1);
+		return -1;
+	}
+
+	w->action     = SD_WORK_ACTION_INIT;
+	w->buf        = NULL;
+	w->sector     = 0;
+	w->end_sector = 0;
+	w->receiver   = receiver;
+	w->status     = SD_INIT_STATUS_START;
+	w->flags      = SD_WORK_FLAG_NONE;
+	w->bypassed   = 0;
+	w->retries    = 0;
+	w->queued     = cycle_counter();
+	w->riders     = NULL;
+	w->next       = NULL;
+
+	work_stack_push(w);
+
+	return 0;
+}
+
+int SD::begin_erase(uint32_t sector, uint32_t n_sectors, SD_async_receiver* receiver)
+{
+	if (n_sectors == 0)
+		return -1;
+
+	sd_work_stack_t* w = work_stack_new();
+	if (w == NULL)
+	{
+		__sync_fetch_and_add(&stats.refused, 1);
+		return -1;
+	}
+
+	__sync_fetch_and_add(&stats.erase.requests, 1);
+
+	w->action     = SD_WORK_ACTION_ERASE;
+	w->buf        = NULL;
+	w->sector     = sector;
+	w->end_sector = sector + n_sectors - 1;
+	w->receiver   = receiver;
+	w->status     = SD_ERASE_STATUS_START;
+	w->flags      = SD_WORK_FLAG_NONE;
+	w->bypassed   = 0;
+	w->retries    = 0;
+	w->queued     = cycle_counter();
+	w->riders     = NULL;
+	w->next       = NULL;
+
+	work_stack_push(w);
+
+	return 0;
+}
+
+int SD::pre_erase(uint32_t sector, uint32_t n_sectors)
+{
+	if (n_sectors == 0)
+		return -1;
+
+	// goes through the queue so it only applies to writes made after it
+	sd_work_stack_t* w = work_stack_new();
+	if (w == NULL)
+	{
+		__sync_fetch_and_add(&stats.refused, 1);
+		return -1;
+	}
+
+	w->action     = SD_WORK_ACTION_PRE_ERASE;
+	w->buf        = NULL;
+	w->sector     = sector;
+	w->end_sector = sector + n_sectors - 1;
+	w->receiver   = NULL;
+	w->status     = 0;
+	w->flags      = SD_WORK_FLAG_NONE;
+	w->bypassed   = 0;
+	w->retries    = 0;
+	w->queued     = cycle_counter();
+	w->riders     = NULL;
+	w->next       = NULL;
+
+	work_stack_push(w);
+
+	return 0;
+}
+
 int SD::begin_read(uint32_t sector, uint32_t n_sectors, void* buf, SD_async_receiver* receiver)
 {
-	sd_work_stack_t* w;
-	if (gc_stack)
+	sd_work_stack_t* w = work_stack_new();
+	if (w == NULL)
 	{
-		// reuse existing item from gc stack to reduce calls to malloc/free
-		w = gc_stack;
-		gc_stack = w->next;
+		__sync_fetch_and_add(&stats.refused, 1);
+		return -1;
 	}
-	else
-		w = (sd_work_stack_t*) malloc(sizeof(sd_work_stack_t));
+
+	__sync_fetch_and_add(&stats.read.requests, 1);
 
 	w->action     = SD_WORK_ACTION_READ;
 	w->buf        = buf;
@@ -492,161 +803,1268 @@ int SD::begin_read(uint32_t sector, uint32_t n_sectors, void* buf, SD_async_rece
         w->end_sector = 0;
 	w->receiver   = receiver;
 	w->status     = SD_READ_STATUS_START;
+	w->flags      = SD_WORK_FLAG_NONE;
+	w->bypassed   = 0;
+	w->retries    = 0;
+	w->queued     = cycle_counter();
+	w->riders     = NULL;
 	w->next       = NULL;
 
-    __disable_irq();
+	if (buf == NULL && w->end_sector)
+		w->flags |= SD_WORK_FLAG_STREAM;
 
-	if (work_stack)
+	work_stack_push(w);
+
+	return 0;
+}
+
+int SD::begin_write(uint32_t sector, uint32_t n_sectors, void* buf, SD_async_receiver* receiver)
+{
+	if (buf == NULL)
+		return -1;
+
+	sd_work_stack_t* w = work_stack_new();
+	if (w == NULL)
 	{
-        sd_work_stack_t* x = work_stack;
+		__sync_fetch_and_add(&stats.refused, 1);
+		return -1;
+	}
 
-        while (x->next)
-			x = x->next;
-		x->next = w;
-		__enable_irq();
+	__sync_fetch_and_add(&stats.write.requests, 1);
+
+	w->action     = SD_WORK_ACTION_WRITE;
+	w->buf        = buf;
+	w->sector     = sector;
+	if (n_sectors > 1)
+	{
+		w->end_sector = sector + n_sectors - 1;
 	}
 	else
 	{
-		work_stack = w;
-		__enable_irq();
-		work_stack_work();
+		w->end_sector = 0;
 	}
+	w->receiver   = receiver;
+	w->status     = SD_WRITE_STATUS_START;
+	w->flags      = SD_WORK_FLAG_NONE;
+	w->bypassed   = 0;
+	w->retries    = 0;
+	w->queued     = cycle_counter();
+	w->riders     = NULL;
+	w->next       = NULL;
+
+	work_stack_push(w);
 
 	return 0;
 }
 
-void SD::work_stack_work(void)
+sd_work_stack_t* SD::work_stack_new()
 {
-	switch(work_stack->action)
+	uint32_t f, bit;
+
+	// claim the lowest free descriptor
+	do {
+		f = work_free;
+		if (f == 0)
+			return NULL;
+		bit = f & -f;
+	} while (__sync_bool_compare_and_swap(&work_free, f, f & ~bit) == 0);
+
+	return &work_items[__builtin_ctz(bit)];
+}
+
+void SD::work_stack_free(sd_work_stack_t* w)
+{
+	__sync_fetch_and_or(&work_free, 1UL << (w - work_items));
+}
+
+void SD::work_stack_push(sd_work_stack_t* w)
+{
+	uint32_t pos;
+
+	// reserve a ring slot. There are as many slots as descriptors, so the
+	// one we get is always free by the time we hold a descriptor
+	do {
+		pos = work_ring_in;
+	} while (__sync_bool_compare_and_swap(&work_ring_in, pos, pos + 1) == 0);
+
+	work_ring[pos & (SD_QUEUE_DEPTH - 1)].item = w - work_items;
+	__sync_synchronize();
+	work_ring[pos & (SD_QUEUE_DEPTH - 1)].seq = pos + 1;
+
+	// if the queue has run dry, start it from interrupt context where the
+	// rest of the work happens. work_stack_pop() looks at the ring again
+	// after it clears SD_FLAG_RUNNING, so we can't both miss this one
+	if ((work_flags & SD_FLAG_RUNNING) == 0)
+		timer.trigger();
+}
+
+// move newly submitted requests from the ring onto the end of work_stack.
+// interrupt context only
+void SD::work_stack_fetch()
+{
+	sd_work_stack_t** tail = &work_stack;
+	while (*tail)
+		tail = &(*tail)->next;
+
+	for (;;)
 	{
-		case SD_WORK_ACTION_READ:
-            work_stack_read();
-            break;
-        case SD_WORK_ACTION_WRITE:
-            work_stack_write();
-            break;
-		default:
+		uint32_t i = work_ring_out & (SD_QUEUE_DEPTH - 1);
+
+		// stops at a slot that's been reserved but not yet filled, even if
+		// later ones are ready. Its producer will trigger us when it's done
+		if (work_ring[i].seq != work_ring_out + 1)
 			break;
+		__sync_synchronize();
+
+		sd_work_stack_t* w = &work_items[work_ring[i].item];
+		w->next = NULL;
+
+		*tail = w;
+		tail = &w->next;
+
+		work_ring_out++;
 	}
 }
 
-void SD::work_stack_read()
+/*
+ * I/O scheduling
+ *
+ * Every command costs a full command/response round trip, plus the card's
+ * access time before the first block. So before the head of the queue is
+ * started, pick the pending request nearest above where the card last was
+ * (C-LOOK), then fold any queued requests for touching or overlapping sectors
+ * into the same CMD18/CMD25. The merged requests ride along on a carrier
+ * item and each still gets its own completion callbacks.
+ *
+ * A request may only be moved ahead of older ones it doesn't conflict with,
+ * ie anything that overlaps it where either side is a write.
+ */
+
+static uint32_t work_last(sd_work_stack_t* w)
 {
-    sd_work_stack_t* w = work_stack;
+	return w->end_sector?w->end_sector:w->sector;
+}
 
-//     printf("SD:{R %d/%p LBA 0x%02lX}\n", w->status, w, w->sector);
+// anything that changes what's on the card
+static int work_writes(sd_work_stack_t* w)
+{
+	return (w->action == SD_WORK_ACTION_WRITE) ||
+		(w->action == SD_WORK_ACTION_ERASE) ||
+		(w->action == SD_WORK_ACTION_PRE_ERASE);
+}
 
-    switch(w->status)
-    {
-        case SD_READ_STATUS_START:
-        {
-            work_flags |= SD_FLAG_RUNNING;
+static int work_conflicts(sd_work_stack_t* a, sd_work_stack_t* b)
+{
+	// nothing passes an init, or gets passed by one
+	if ((a->action == SD_WORK_ACTION_INIT) || (b->action == SD_WORK_ACTION_INIT))
+		return 1;
 
-            uint32_t addr;
-            if (card_type == SD_TYPE_SDHC)
-                addr = w->sector;
-            else if (card_type == SD_TYPE_SD)
-                addr = w->sector << 9;
-            else
+	if ((work_writes(a) == 0) && (work_writes(b) == 0))
+		return 0;
+
+	return (a->sector <= work_last(b)) && (b->sector <= work_last(a));
+}
+
+// can x move ahead of everything between first and x?
+static int work_can_bypass(sd_work_stack_t* first, sd_work_stack_t* x)
+{
+	for (; first != x; first = first->next)
+		if (work_conflicts(first, x))
+			return 0;
+	return 1;
+}
+
+// only requests where each block has its own place in the caller's buffer
+// can share a transaction. Streamed reads and the clean_buffer handshake
+// run alone
+static int work_mergeable(sd_work_stack_t* w)
+{
+	if (w->flags & SD_WORK_FLAG_MERGED)
+		return 1;
+	if (w->action == SD_WORK_ACTION_WRITE)
+		return 1;
+	return (w->action == SD_WORK_ACTION_READ) && w->buf && (w->end_sector == 0);
+}
+
+// a plain single-block read into the caller's buffer, the only kind the
+// read-ahead ring serves
+static int work_single_read(sd_work_stack_t* w)
+{
+	if (w->flags & (SD_WORK_FLAG_STREAM | SD_WORK_FLAG_MERGED | SD_WORK_FLAG_PREFETCH))
+		return 0;
+	return (w->action == SD_WORK_ACTION_READ) && w->buf && (w->end_sector == 0);
+}
+
+void SD::work_stack_schedule()
+{
+	sd_work_stack_t* head = work_stack;
+
+	// C-LOOK: nearest at or above the last sector, wrapping to the lowest.
+	// the oldest request goes first once it's been passed over enough
+	if (head->bypassed < SD_SCHED_MAX_BYPASS)
+	{
+		sd_work_stack_t* best = head;
+		sd_work_stack_t* prev = NULL;
+
+		for (sd_work_stack_t* p = head, *x = head->next; x; p = x, x = x->next)
+		{
+			if ((x->sector - last_sector) >= (best->sector - last_sector))
+				continue;
+			if (work_can_bypass(head, x) == 0)
+				continue;
+			best = x;
+			prev = p;
+		}
+
+		if (best != head)
+		{
+			for (sd_work_stack_t* x = head; x != best; x = x->next)
+				x->bypassed++;
+
+			prev->next = best->next;
+			best->next = head;
+			work_stack = head = best;
+		}
+	}
+
+	// fold in neighbours. Growing the range can make a request we've
+	// already looked at adjacent, so go round until nothing changes
+	int merged = work_mergeable(head);
+	while (merged)
+	{
+		merged = 0;
+
+		uint32_t first = head->sector;
+		uint32_t last  = work_last(head);
+
+		for (sd_work_stack_t* p = head, *x = head->next; x; p = x, x = x->next)
+		{
+			if ((x->action != head->action) || (work_mergeable(x) == 0))
+				continue;
+
+			uint32_t x_last = work_last(x);
+
+			// touching or overlapping?
+			if ((x->sector > last + 1) || (x_last + 1 < first))
+				continue;
+
+			uint32_t lo = (x->sector < first)?x->sector:first;
+			uint32_t hi = (x_last > last)?x_last:last;
+			if (hi - lo >= SD_MERGE_MAX_BLOCKS)
+				continue;
+
+			if (work_can_bypass(head->next, x) == 0)
+				continue;
+
+			// first merge turns the head into a carrier, with the original
+			// request as its first rider
+			if ((head->flags & SD_WORK_FLAG_MERGED) == 0)
+			{
+				sd_work_stack_t* c = work_stack_new();
+				if (c == NULL)
+					break;
+
+				c->action   = head->action;
+				c->buf      = NULL;
+				c->status   = head->status;
+				c->flags    = SD_WORK_FLAG_MERGED;
+				c->bypassed = head->bypassed;
+				c->retries  = 0;
+				c->queued   = cycle_counter();
+				c->receiver = NULL;
+				c->riders   = head;
+				c->next     = head->next;
+
+				if (p == head)
+					p = c;
+
+				head->next = NULL;
+				work_stack = head = c;
+			}
+
+			p->next = x->next;
+			x->next = NULL;
+
+			sd_work_stack_t** r = &head->riders;
+			while (*r)
+				r = &(*r)->next;
+			*r = x;
+
+			first = lo;
+			last  = hi;
+
+			head->sector     = first;
+			head->end_sector = (last > first)?last:0;
+
+			merged = 1;
+			break;
+		}
+	}
+
+	last_sector = work_last(head);
+}
+
+// where block 'sector' of a merged transaction goes to or comes from.
+// reads land in the first request that wants the block and are copied to
+// the others, writes take the newest data for it
+void* SD::work_merged_buf(sd_work_stack_t* w, uint32_t sector)
+{
+	void* buf = NULL;
+
+	for (sd_work_stack_t* r = w->riders; r; r = r->next)
+	{
+		if ((sector < r->sector) || (sector > work_last(r)))
+			continue;
+
+		buf = ((uint8_t*) r->buf) + ((sector - r->sector) << 9);
+
+		if (w->action == SD_WORK_ACTION_READ)
+			break;
+	}
+
+	return buf;
+}
+
+// hand a finished block, or an error, back to whoever asked for it.
+// w may already be back in the pool, so nothing in it is used once a callback
+// has had the chance to reuse it
+void SD::work_report(sd_work_stack_t* w, uint32_t sector, void* buf, int err)
+{
+	SD_WORK_ACTION action = w->action;
+
+	if (action == SD_WORK_ACTION_INIT)
+	{
+		if (w->receiver)
+			w->receiver->sd_init_complete(this, err);
+		return;
+	}
+
+	if (action == SD_WORK_ACTION_ERASE)
+	{
+		if (err)
+			stats.erase.errors++;
+		if (w->receiver)
+			w->receiver->sd_erase_complete(this, sector, work_last(w) - sector + 1, err);
+		return;
+	}
+
+	if (err)
+		stat_op(action)->errors++;
+
+	if ((w->flags & SD_WORK_FLAG_MERGED) == 0)
+	{
+		SD_async_receiver* receiver = w->receiver;
+
+		if (receiver == NULL)
+			return;
+
+		if (action == SD_WORK_ACTION_READ)
+			receiver->sd_read_complete(this, sector, buf, err);
+		else
+			receiver->sd_write_complete(this, sector, buf, err);
+		return;
+	}
+
+	// the transaction is over, so every remaining rider finishes now
+	sd_work_stack_t*  done_list = NULL;
+	sd_work_stack_t** p = &w->riders;
+	if (err || (sector >= work_last(w)))
+	{
+		done_list = w->riders;
+		w->riders = NULL;
+		p = &done_list;
+	}
+
+	while (*p)
+	{
+		sd_work_stack_t* r = *p;
+		uint32_t r_last = work_last(r);
+
+		if ((err == 0) && ((sector < r->sector) || (sector > r_last)))
+		{
+			p = &r->next;
+			continue;
+		}
+
+		uint32_t s = (sector > r->sector)?sector:r->sector;
+		void* r_buf = ((uint8_t*) r->buf) + ((s - r->sector) << 9);
+		SD_async_receiver* receiver = r->receiver;
+
+		if ((err == 0) && (action == SD_WORK_ACTION_READ) && (r_buf != buf))
+			memcpy(r_buf, buf, 512);
+
+		if (err || (sector >= r_last))
+		{
+			*p = r->next;
+
+			work_stack_free(r);
+		}
+		else
+			p = &r->next;
+
+		if (receiver == NULL)
+			continue;
+
+		if (action == SD_WORK_ACTION_READ)
+			receiver->sd_read_complete(this, s, r_buf, err);
+		else
+			receiver->sd_write_complete(this, s, r_buf, err);
+	}
+}
+
+void SD::work_stack_work(void)
+{
+	// nothing has been sent for the head yet, so it's not too late to serve
+	// something else first, or to fold its neighbours into it
+	int fresh = ((work_stack->action == SD_WORK_ACTION_READ) && (work_stack->status == SD_READ_STATUS_START)) ||
+		((work_stack->action == SD_WORK_ACTION_WRITE) && (work_stack->status == SD_WRITE_STATUS_START));
+
+	if (fresh)
+		work_stack_schedule();
+
+	// anything that changes the card makes what we read ahead of it stale
+	if (prefetch_count && (work_stack->status == 0) && work_writes(work_stack) &&
+		(work_stack->sector < prefetch_first + prefetch_count) && (work_last(work_stack) >= prefetch_first))
+		prefetch_count = 0;
+
+	if (prefetch_ring && (work_stack->status == SD_READ_STATUS_START) && work_single_read(work_stack))
+	{
+		sd_work_stack_t* w = work_stack;
+
+		prefetch_track(w);
+
+		if (prefetch_take(w))
+		{
+			stat_queued(w);
+			work_stack_pop();
+			work_report(w, w->sector, w->buf, 0);
+			return;
+		}
+
+		if (seq_run > SD_PREFETCH_TRIGGER)
+			prefetch_start(w);
+	}
+
+	// a request that's been put behind read-ahead is counted when that
+	// hands it its block
+	if (fresh && ((work_stack->flags & SD_WORK_FLAG_PREFETCH) == 0))
+		stat_queued(work_stack);
+
+	stat_action = work_stack->action;
+
+	switch(work_stack->action)
+	{
+		case SD_WORK_ACTION_INIT:
+			work_stack_init();
+			break;
+		case SD_WORK_ACTION_READ:
+            work_stack_read();
+            break;
+        case SD_WORK_ACTION_WRITE:
+            work_stack_write();
+            break;
+		case SD_WORK_ACTION_ERASE:
+			work_stack_erase();
+			break;
+		case SD_WORK_ACTION_PRE_ERASE:
+		{
+			// nothing to send yet, the next CMD25 in range picks it up
+			sd_work_stack_t* w = work_stack;
+			pre_erase_sector = w->sector;
+			pre_erase_count  = w->end_sector - w->sector + 1;
+			work_stack_pop();
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/*
+ * begin_init(): one command per timer interrupt, so nothing else waits long
+ * behind us while the card is on its slow identification clock. Waits for
+ * the card are polled from the timer too
+ */
+void SD::work_stack_init()
+{
+	sd_work_stack_t* w = work_stack;
+	int r;
+
+	switch(w->status)
+	{
+		case SD_INIT_STATUS_START:
+		{
+			work_flags |= SD_FLAG_RUNNING;
+
+			card_type  = SD_TYPE_NONE;
+			high_speed = 0;
+
+			// whatever we read ahead came off the old card
+			prefetch_count = 0;
+			seq_run        = 0;
+
+			spi->set_frequency(25000);
+
+			w->retries = 0;
+			w->status  = SD_INIT_STATUS_GO_IDLE;
+			// deliberate fall-through
+		}
+		case SD_INIT_STATUS_GO_IDLE:
+		{
+			// reset the card into SPI mode
+			if (sd_cmd_go_idle_state(spi) != 1)
+			{
+				if (++w->retries < CMD_TIMEOUT)
+				{
+					timer.trigger();
+					return;
+				}
+				r = -1;
+				break;
+			}
+
+			w->status = SD_INIT_STATUS_IF_COND;
+			timer.trigger();
+			return;
+		}
+		case SD_INIT_STATUS_IF_COND:
+		{
+			r = sd_cmd_send_if_cond(spi);
+
+			if (r & 4)
+				card_type = SD_TYPE_MMC;
+
+			// MMC cards don't know CMD8, and we only drive SD cards. Reads and
+			// writes to anything else fail with SD_ERROR_CARD_TYPE
+			if (r != 1)
+			{
+				r = -2;
+				break;
+			}
+
+			wait_begin(SD_INIT_TIMEOUT_US);
+			w->status = SD_INIT_STATUS_OP_COND;
+			timer.trigger();
+			return;
+		}
+		case SD_INIT_STATUS_OP_COND:
+		{
+			r = sd_acmd_send_op_cond(spi);
+			if (r == 1)
+			{
+				// card is still powering up, ask again shortly
+				if (wait_poll(SD_INIT_POLL_US) == 0)
+					return;
+			}
+			if (r != 0)
+			{
+				r = -3;
+				break;
+			}
+
+			wait_begin(SD_INIT_TIMEOUT_US);
+			w->status = SD_INIT_STATUS_OCR;
+			timer.trigger();
+			return;
+		}
+		case SD_INIT_STATUS_OCR:
+		{
+			uint32_t ocr = 0;
+
+			// the card has left the idle state. Find out what it is
+			if (sd_cmd_read_ocr(spi, &ocr) & 0x7E)
+			{
+				r = -4;
+				break;
+			}
+
+			if ((ocr & (1<<20)) == 0)
+			{
+				// card does not support 3.2-3.3v!
+				r = -5;
+				break;
+			}
+
+			if (ocr & SD_HIGH_CAPACITY)
+				card_type = SD_TYPE_SDHC;
+			else
+				card_type = SD_TYPE_SD;
+
+			// not powered up yet, so the capacity bit isn't to be trusted
+			if ((ocr & (1UL<<31)) == 0)
+			{
+				if (wait_poll(SD_INIT_POLL_US) == 0)
+					return;
+				r = -4;
+				break;
+			}
+
+			w->status = SD_INIT_STATUS_CRC;
+			timer.trigger();
+			return;
+		}
+		case SD_INIT_STATUS_CRC:
+		{
+			// cards only check CRCs in SPI mode if we ask
+			use_crc = 0;
+			if (SD_CRC && ((sd_cmd(spi, SD_CMD_CRC_ON_OFF, 1) & 0x7E) == 0))
+				use_crc = 1;
+
+			// card is fully started, boost frequency to something every card and
+			// board manages while we find out what this one can really do
+			spi->set_frequency(10000000);
+
+			w->status = SD_INIT_STATUS_CSD;
+			timer.trigger();
+			return;
+		}
+		case SD_INIT_STATUS_CSD:
+		{
+			if (sd_cmd_send_csd(spi, csd) & 0x7E)
+			{
+				r = -6;
+				break;
+			}
+
+			// command class 10 is switch function, so try for high speed. The
+			// card's TRAN_SPEED changes to suit if it works, and we're back
+			// here for it
+			w->status = SD_INIT_STATUS_CID;
+			if ((high_speed == 0) && (ext_bits(csd, 95, 84) & (1 << 10)))
+			{
+				w->sector = SD_SWITCH_CHECK;
+				w->status = SD_INIT_STATUS_SWITCH;
+			}
+
+			timer.trigger();
+			return;
+		}
+		case SD_INIT_STATUS_SWITCH:
+		{
+			// CMD6: check first, so we only ask for the switch if the card
+			// says it can
+			r = sd_cmdx(spi, SD_CMD_SWITCH_FUNC, w->sector);
+			if (r & 0x7E)
+			{
+				// cards before spec 1.10 don't know CMD6
+				spi->end_transaction();
+				w->status = SD_INIT_STATUS_CID;
+				timer.trigger();
+				return;
+			}
+
+			// status arrives like any other read, after the access time
+			wait_begin(read_timeout_us);
+			w->status = SD_INIT_STATUS_SWITCH_STATUS;
+			// deliberate fall-through
+		}
+		case SD_INIT_STATUS_SWITCH_STATUS:
+		{
+			uint8_t status[64 + 2];
+
+			r = spi->transfer(0xFF);
+			if ((r == 0xFF) && (wait_poll(read_poll_us) == 0))
+				return;
+
+			w->status = SD_INIT_STATUS_CID;
+
+			if (r == SD_TOKEN_START_BLOCK)
+				spi->recv_block(status, sizeof(status), 0xFF);
+			spi->end_transaction();
+
+			// bits 379:376: the function group 1 will use, 0xF if it can't
+			if ((r == SD_TOKEN_START_BLOCK) && ((status[16] & 0x0F) == 1))
+			{
+				if (w->sector == SD_SWITCH_CHECK)
+				{
+					w->sector = SD_SWITCH_SET;
+					w->status = SD_INIT_STATUS_SWITCH;
+				}
+				else
+				{
+					// new timing applies 8 clocks after the status block
+					spi->transfer(0xFF);
+					high_speed = 1;
+					w->status  = SD_INIT_STATUS_CSD;
+				}
+			}
+
+			timer.trigger();
+			return;
+		}
+		case SD_INIT_STATUS_CID:
+		{
+			uint32_t spi_hz = csd_tran_speed();
+			if (spi_hz > SD_SPI_MAX_HZ)
+				spi_hz = SD_SPI_MAX_HZ;
+			spi_hz = spi->set_frequency(spi_hz);
+
+			if (ext_bits(csd, 127, 126) == 0)
+			{
+				sector_count = (ext_bits(csd, 75, 62) + 1)
+				       * (1 << (ext_bits(csd, 49, 47) + 2))
+				       * (1 << (ext_bits(csd, 83, 80) - 9));
+			}
+			else if (ext_bits(csd, 127, 126) == 1)
+			{
+				sector_count = (ext_bits(csd, 69, 48) + 1) * 1024;
+			}
+			else
+			{
+				r = -7;
+				break;
+			}
+
+			csd_timing(csd, spi_hz);
+
+			if (sd_cmd_send_cid(spi, cid) & 0x7E)
+			{
+				r = -8;
+				break;
+			}
+
+			r = 1;
+			break;
+		}
+		default:
+			r = -1;
+			break;
+	}
+
+	if (r < 0)
+		work_flags |= SD_FLAG_ERROR;
+
+	work_stack_pop();
+	work_report(w, 0, NULL, r);
+}
+
+void SD::work_stack_read()
+{
+    sd_work_stack_t* w = work_stack;
+
+//     printf("SD:{R %d/%p LBA 0x%02lX}\n", w->status, w, w->sector);
+
+    switch(w->status)
+    {
+        case SD_READ_STATUS_START:
+        case SD_READ_STATUS_RESTART:
+        {
+            work_flags |= SD_FLAG_RUNNING;
+
+            uint32_t addr;
+            if (card_type == SD_TYPE_SDHC)
+                addr = w->sector;
+            else if (card_type == SD_TYPE_SD)
+                addr = w->sector << 9;
+            else
             {
                 work_flags |= SD_FLAG_ERROR;
-                if (w->receiver)
-                    w->receiver->sd_read_complete(this, w->sector, w->buf, w->status + 1);
-                // TODO: support MMC
+                work_stack_pop();
+                work_report(w, w->sector, w->buf, SD_ERROR_CARD_TYPE);
                 return;
             }
 
-            int r = sd_cmdx(spi, w->end_sector?SD_CMD_READ_BLOCKS:SD_CMD_READ_BLOCK, addr);
+            int r = work_cmd(w->end_sector?SD_CMD_READ_BLOCKS:SD_CMD_READ_BLOCK, addr);
             if (r & 0x7E)
             {
+                spi->end_transaction();
                 work_flags |= SD_FLAG_ERROR;
-                if (w->receiver)
-                    w->receiver->sd_read_complete(this, w->sector, w->buf, w->status + 1);
+                if ((r < 0) || (r & SD_R1_COM_CRC_ERROR))
+                    link_error();
+                work_stack_pop();
+                work_report(w, w->sector, w->buf, w->status + 1);
                 // TODO: handle error
                 return;
             }
 
             w->status = SD_READ_STATUS_WAIT_TRAN;
+            wait_begin(read_timeout_us);
             //                  printf("WAIT TRAN: ");
             // deliberate fall-through
         }
         case SD_READ_STATUS_WAIT_TRAN:
         case SD_READ_STATUS_CONTINUE_MULTI:
         {
+            // every read buffer is still held by the receiver, so leave the
+            // card waiting until clean_buffer() hands one back
+            if ((w->flags & SD_WORK_FLAG_STREAM) && (read_buf_dirty & (1 << read_buf_next)))
+            {
+                // there's nothing in flight to hide a CRC check behind now,
+                // and the receiver may be waiting on that block
+                if (read_crc_pending(w) < 0)
+                {
+                    read_retry(w, crc_pending.sector, crc_pending.index);
+                    return;
+                }
+
+                if (read_buf_dirty & (1 << read_buf_next))
+                {
+                    w->status = SD_READ_STATUS_BUFFER_DIRTY;
+                    return;
+                }
+            }
+
             uint8_t r;
             r = spi->transfer(0xFF);
 
-            // I have no idea why, but removing this printf causes us to hard-lock
-//             printf("0x%X", r);
-
             if (r != 0xFE)
             {
-                if (r == 0xFF)
+                // card is still fetching the block, look again shortly
+                if ((r == 0xFF) && (wait_poll(read_poll_us) == 0))
+                    return;
+
+                // the block before may still be waiting for its CRC check.
+                // If that's bad too, go back for it, so it's either read
+                // again or reported before this one
+                if (read_crc_pending(w) < 0)
                 {
-                    work_flags |= SD_FLAG_REQ_WORK;
+                    read_retry(w, crc_pending.sector, crc_pending.index);
+                    return;
                 }
-                else
+
+                // error token, or timed out. Anything else is noise
+                work_flags |= SD_FLAG_ERROR;
+                if ((r != 0xFF) && (r & 0xF0))
+                    link_error();
+
+                if (w->end_sector)
                 {
-                    work_flags &= ~SD_FLAG_REQ_WORK;
-                    work_flags |= SD_FLAG_ERROR;
-                    // error!
-                    if (w->receiver)
-                        w->receiver->sd_read_complete(this, w->sector, w->buf, w->status + 1);
+                    work_cmd(SD_CMD_STOP_TRAN, 0);
+                    busy_begin();
                 }
+                else
+                    spi->end_transaction();
+                work_stack_pop();
+                work_report(w, w->sector, w->buf, w->status + 1);
                 return;
             }
-            work_flags &= ~SD_FLAG_REQ_WORK;
+            stat_sample(w->action, SD_STAT_TOKEN, stat_wait_start);
+
             w->status = SD_READ_STATUS_DMA;
             // deliberate fall-through
         }
         case SD_READ_STATUS_DMA:
         {
-            work_flags |= SD_FLAG_RUNNING;
+            work_flags |= SD_FLAG_RUNNING | SD_FLAG_DMA;
 
             dma_txmem.setup(&txm, 4);
             dma_txmem.auto_increment = DMA_NO_INCREMENT;
 
-            dma_rxmem.setup(w->buf, 512);
+            if (w->flags & SD_WORK_FLAG_STREAM)
+                dma_rxmem.setup(read_buf[read_buf_next], 512);
+            else if (w->flags & SD_WORK_FLAG_PREFETCH)
+                dma_rxmem.setup(prefetch_slot(prefetch_count), 512);
+            else if (w->flags & SD_WORK_FLAG_MERGED)
+                dma_rxmem.setup(work_merged_buf(w, w->sector), 512);
+            else
+                dma_rxmem.setup(w->buf, 512);
 
-//             TRACE("DMA:setup\n");
             dma_tx.setup(512);
             dma_rx.setup(512);
-            TRACE("DMA:setup complete\n");
 
             w->status = SD_READ_STATUS_CHECKSUM;
 
-            for (volatile uint32_t r = 1UL<<24; r; r--);
-
+            stat_dma_start = cycle_counter();
             dma_rx.begin();
             dma_tx.begin();
 
+            // check the previous block while this one moves
+            read_crc_pending(w);
+
             break;
         }
         case SD_READ_STATUS_CHECKSUM:
-            spi->transfer(0xFF);
-            spi->transfer(0xFF);
+        {
+            uint16_t crc = spi->transfer(0xFF) << 8;
+            crc |= spi->transfer(0xFF);
+
+            // the block before this one failed its CRC while this one was
+            // on its way. Go back for both
+            if (w->flags & SD_WORK_FLAG_RETRY)
+            {
+                read_retry(w, crc_pending.sector, crc_pending.index);
+                break;
+            }
+
+            // nobody is waiting on a read-ahead block, so there's no need to
+            // put its check off until the next one is moving
+            if (w->flags & SD_WORK_FLAG_PREFETCH)
+            {
+                if (use_crc && (sd_crc16(prefetch_slot(prefetch_count), 512) != crc))
+                {
+                    read_retry(w, w->sector, -1);
+                    break;
+                }
+
+                w->retries = 0;
+                prefetch_count++;
+                stats.prefetch_blocks++;
 
-            sd_work_stack_t* w = work_stack;
+                w->sector++;
+                w->status = SD_READ_STATUS_PREFETCH;
+                work_stack_read();
+                break;
+            }
 
-            TRACE("DMA:CSUM\n");
-            for (volatile uint32_t r = 1UL<<19; r; r--);
+            uint32_t sector = w->sector;
+            void*    buf    = w->buf;
+            int      index  = -1;
+
+            if (w->flags & SD_WORK_FLAG_MERGED)
+                buf = work_merged_buf(w, sector);
+            else if (w->flags & SD_WORK_FLAG_STREAM)
+            {
+                index = read_buf_next;
+                buf = read_buf[index];
+                __sync_fetch_and_or(&read_buf_dirty, 1 << index);
+                if (++read_buf_next >= SD_READ_BUFFERS)
+                    read_buf_next = 0;
+            }
+
+            if (use_crc)
+            {
+                if ((w->sector < w->end_sector) && (w->flags & (SD_WORK_FLAG_STREAM | SD_WORK_FLAG_MERGED)))
+                {
+                    // check it once the next block is on its way, and only
+                    // hand it over then
+                    crc_pending.buf    = buf;
+                    crc_pending.sector = sector;
+                    crc_pending.crc    = crc;
+                    crc_pending.index  = index;
+
+                    w->sector++;
+                    w->status = SD_READ_STATUS_CONTINUE_MULTI;
+                    wait_begin(read_timeout_us);
+                    timer.trigger();
+                    break;
+                }
+
+                if (sd_crc16(buf, 512) != crc)
+                {
+                    read_retry(w, sector, index);
+                    break;
+                }
+
+                w->retries = 0;
+            }
 
             // we must pop first, in case the read_complete event requests another read.
-            // in that case, it's advantageous to have the work item in the GC queue already so it can be reused
+            // in that case, it's advantageous to have the work item back in the pool already so it can be reused
             if (w->sector >= w->end_sector)
             {
-                work_stack_pop();
                 if (w->end_sector)
-                    sd_cmd(spi, 12, 0);
+                {
+                    work_cmd(SD_CMD_STOP_TRAN, 0);
+                    busy_begin();
+                }
+                else
+                    spi->end_transaction();
+                work_stack_pop();
+            }
+            else if (w->flags & (SD_WORK_FLAG_STREAM | SD_WORK_FLAG_MERGED))
+            {
+                // go straight on to the next block while the receiver works on this one
+                w->sector++;
+                w->status = SD_READ_STATUS_CONTINUE_MULTI;
+                wait_begin(read_timeout_us);
+                timer.trigger();
             }
             else
+            {
+                // wait for the caller to hand it back with clean_buffer()
+                read_buf_returned = NULL;
                 w->status = SD_READ_STATUS_BUFFER_DIRTY;
+            }
 
-            if (w->receiver)
-                w->receiver->sd_read_complete(this, w->sector, w->buf, 0);
+            work_report(w, sector, buf, 0);
 
             break;
+        }
+        case SD_READ_STATUS_BUFFER_DIRTY:
+        {
+            // clean_buffer() has handed something back, or this is a stray
+            // trigger and we keep waiting
+            if (w->flags & SD_WORK_FLAG_STREAM)
+            {
+                if (read_buf_dirty & (1 << read_buf_next))
+                    break;
+            }
+            else
+            {
+                void* buf = (void*) __sync_lock_test_and_set(&read_buf_returned, NULL);
+                if (buf == NULL)
+                    break;
+                w->buf = buf;
+                w->sector++;
+            }
+
+            w->status = SD_READ_STATUS_CONTINUE_MULTI;
+            wait_begin(read_timeout_us);
+            timer.trigger();
+            break;
+        }
+        case SD_READ_STATUS_PREFETCH:
+        {
+            work_flags |= SD_FLAG_RUNNING;
+
+            // hand out whatever has been asked for since the last block
+            prefetch_serve();
+
+            if (w->sector > w->end_sector)
+            {
+                prefetch_stop(w);
+                break;
+            }
+
+            if (prefetch_blocked(w))
+            {
+                stats.prefetch_cancels++;
+                prefetch_stop(w);
+                break;
+            }
+
+            if (prefetch_count < SD_PREFETCH_BLOCKS)
+            {
+                w->status = SD_READ_STATUS_CONTINUE_MULTI;
+                wait_begin(read_timeout_us);
+                timer.trigger();
+                break;
+            }
+
+            // ring is full. Leave the card waiting, and come back when a new
+            // request turns up to take a block or to need the bus
+            work_flags &= ~SD_FLAG_RUNNING;
+
+            if (work_ring[work_ring_out & (SD_QUEUE_DEPTH - 1)].seq == work_ring_out + 1)
+                timer.trigger();
+            break;
+        }
+    }
+}
+
+/*
+ * read-ahead
+ *
+ * single-block reads following on from each other, with gaps between them
+ * while the receiver works on each block, cost a command and the card's
+ * access time apiece. Once a receiver has made a few, the next one opens a
+ * CMD18 into the ring in its place. Reads that turn up for blocks in the
+ * ring are answered from it as soon as their block lands, and the card only
+ * stalls when the ring is full. Anything else queued stops the stream with
+ * CMD12 so it gets the bus.
+ */
+
+#define PREFETCH_SLOTS (SD_PREFETCH_BLOCKS?SD_PREFETCH_BLOCKS:1)
+
+// n blocks on from prefetch_first
+uint8_t* SD::prefetch_slot(uint32_t n)
+{
+    return prefetch_ring + (((prefetch_head + n) % PREFETCH_SLOTS) << 9);
+}
+
+/*
+ * answer w from the ring if it's there. The reader has no more use for
+ * that block or any before it, so they make room for the stream
+ */
+int SD::prefetch_take(sd_work_stack_t* w)
+{
+    uint32_t n = w->sector - prefetch_first;
+    if (n >= prefetch_count)
+        return 0;
+
+    memcpy(w->buf, prefetch_slot(n), 512);
+
+    n++;
+    prefetch_first += n;
+    prefetch_head   = (prefetch_head + n) % PREFETCH_SLOTS;
+    prefetch_count -= n;
+
+    stats.prefetch_hits++;
+
+    return 1;
+}
+
+void SD::prefetch_track(sd_work_stack_t* w)
+{
+    if ((w->receiver == seq_receiver) && (w->sector == seq_next))
+    {
+        if (seq_run < 255)
+            seq_run++;
     }
+    else
+    {
+        seq_receiver = w->receiver;
+        seq_run      = 1;
+    }
+
+    seq_next = w->sector + 1;
+}
+
+/*
+ * w missed the ring but follows on from a run. Put a stream in front of it
+ * that starts at its block, and w is answered when that lands
+ */
+void SD::prefetch_start(sd_work_stack_t* w)
+{
+    uint32_t last = w->sector + SD_PREFETCH_WINDOW - 1;
+    if (last >= sector_count)
+        last = sector_count - 1;
+    if (last <= w->sector)
+        return;
+
+    // no descriptor to spare. w just goes on its own
+    sd_work_stack_t* p = work_stack_new();
+    if (p == NULL)
+        return;
+
+    p->action     = SD_WORK_ACTION_READ;
+    p->buf        = NULL;
+    p->sector     = w->sector;
+    p->end_sector = last;
+    p->receiver   = NULL;
+    p->status     = SD_READ_STATUS_START;
+    p->flags      = SD_WORK_FLAG_PREFETCH;
+    p->bypassed   = 0;
+    p->retries    = 0;
+    p->queued     = cycle_counter();
+    p->riders     = NULL;
+    p->next       = w;
+
+    prefetch_first = w->sector;
+    prefetch_head  = 0;
+    prefetch_count = 0;
+
+    // no point if it'd be stopped again straight away
+    work_stack_fetch();
+    if (prefetch_blocked(p))
+    {
+        work_stack_free(p);
+        return;
+    }
+
+    work_stack = p;
+}
+
+// answer every queued read the ring holds, unless it has to wait for an
+// older request
+void SD::prefetch_serve()
+{
+    work_stack_fetch();
+
+    sd_work_stack_t* p = work_stack;
+    while (p->next)
+    {
+        sd_work_stack_t* x = p->next;
+
+        if ((work_single_read(x) == 0) || (work_can_bypass(work_stack, x) == 0) || (prefetch_take(x) == 0))
+        {
+            p = x;
+            continue;
+        }
+
+        p->next = x->next;
+
+        prefetch_track(x);
+        stat_queued(x);
+        work_stack_free(x);
+        work_report(x, x->sector, x->buf, 0);
+    }
+}
+
+/*
+ * is anything queued behind stream s that it won't get to? It can only
+ * answer single-block reads for blocks it's yet to fetch, and only those
+ * that fit in the ring without anyone taking a block first
+ */
+int SD::prefetch_blocked(sd_work_stack_t* s)
+{
+    for (sd_work_stack_t* x = s->next; x; x = x->next)
+    {
+        if (work_single_read(x) == 0)
+            return 1;
+        if ((x->sector - prefetch_first) >= SD_PREFETCH_BLOCKS)
+            return 1;
+        if (x->sector > s->end_sector)
+            return 1;
+    }
+
+    return 0;
+}
+
+// end stream w. Whatever it has read stays in the ring
+void SD::prefetch_stop(sd_work_stack_t* w)
+{
+    work_cmd(SD_CMD_STOP_TRAN, 0);
+    busy_begin();
+
+    last_sector = w->sector - 1;
+
+    work_stack_pop();
+}
+
+/*
+ * check the CRC of a block whose check was put off while the next one was
+ * fetched. A good block goes to the receiver, a bad one is marked for retry
+ */
+int SD::read_crc_pending(sd_work_stack_t* w)
+{
+    if (crc_pending.buf == NULL)
+        return 0;
+
+    void* buf = crc_pending.buf;
+    crc_pending.buf = NULL;
+
+    if (sd_crc16(buf, 512) != crc_pending.crc)
+    {
+        w->flags |= SD_WORK_FLAG_RETRY;
+        return -1;
+    }
+
+    w->retries = 0;
+    work_report(w, crc_pending.sector, buf, 0);
+
+    return 0;
+}
+
+/*
+ * a block failed its CRC: stop the card and go back for it. index is the
+ * read buffer it landed in, or -1
+ */
+void SD::read_retry(sd_work_stack_t* w, uint32_t sector, int index)
+{
+    w->flags &= ~SD_WORK_FLAG_RETRY;
+
+    if (w->end_sector)
+    {
+        work_cmd(SD_CMD_STOP_TRAN, 0);
+        busy_begin();
+    }
+    else
+    {
+        spi->end_transaction();
+        timer.trigger();
+    }
+
+    link_error();
+
+    // it can have the same buffer again
+    if (index >= 0)
+    {
+        __sync_fetch_and_and(&read_buf_dirty, ~(1 << index));
+        read_buf_next = index;
+    }
+
+    if (++w->retries > SD_CRC_RETRIES)
+    {
+        work_flags |= SD_FLAG_ERROR;
+        work_stack_pop();
+        work_report(w, sector, w->buf, SD_ERROR_CRC);
+        return;
+    }
+
+    stats.read.retries++;
+    w->sector = sector;
+    w->status = SD_READ_STATUS_RESTART;
 }
 
 void SD::work_stack_write()
@@ -655,159 +2073,355 @@ void SD::work_stack_write()
 
     switch(w->status)
     {
-        // TODO
         case SD_WRITE_STATUS_START:
-            if (w->end_sector)
+        case SD_WRITE_STATUS_RESTART:
+        {
+            work_flags |= SD_FLAG_RUNNING;
+
+            uint32_t addr;
+            if (card_type == SD_TYPE_SDHC)
+                addr = w->sector;
+            else if (card_type == SD_TYPE_SD)
+                addr = w->sector << 9;
+            else
             {
-                sd_cmd(spi, SD_CMD_APP_CMD, 0);
-                sd_cmd(spi, SD_ACMD_SET_WR_ERASE_BLOCKS, w->end_sector - w->sector + 1);
+                work_flags |= SD_FLAG_ERROR;
+                work_stack_pop();
+                work_report(w, w->sector, w->buf, SD_ERROR_CARD_TYPE);
+                return;
+            }
 
-                uint32_t addr;
+            // tell the card how much is coming so it can pre-erase.
+            // this is only a hint, so we don't care if it fails
+            if (w->end_sector)
+            {
+                uint32_t n = w->end_sector - w->sector + 1;
 
-                if (card_type == SD_TYPE_SDHC)
-                    addr = w->sector;
-                else if (card_type == SD_TYPE_SD)
-                    addr = w->sector << 9;
-                else
+                // the caller has promised the rest of a pre_erase() range
+                if (pre_erase_count && (w->sector - pre_erase_sector < pre_erase_count))
                 {
-                    work_flags |= SD_FLAG_ERROR;
-                    if (w->receiver)
-                        w->receiver->sd_write_complete(this, w->sector, w->buf, w->status + 1);
-                    // TODO: support MMC
-                    return;
+                    if (pre_erase_sector + pre_erase_count - w->sector > n)
+                        n = pre_erase_sector + pre_erase_count - w->sector;
+                    pre_erase_count = 0;
                 }
 
-                int r = sd_cmd(spi, w->end_sector?SD_CMD_WRITE_BLOCKS:SD_CMD_WRITE_BLOCK, addr);
-                if (r & 0x7E)
-                {
-                    work_flags |= SD_FLAG_ERROR;
-                    if (w->receiver)
-                        w->receiver->sd_write_complete(this, w->sector, w->buf, w->status + 1);
-                    return;
-                }
+                // the count is 23 bits wide
+                if (n > 0x7FFFFF)
+                    n = 0x7FFFFF;
 
-                w->status = SD_WRITE_STATUS_DMA;
-                // deliberate fall-through
+                sd_acmd_set_wr_erase_blocks(spi, n);
             }
+
+            int r = work_cmd(w->end_sector?SD_CMD_WRITE_BLOCKS:SD_CMD_WRITE_BLOCK, addr);
+            if (r & 0x7E)
+            {
+                spi->end_transaction();
+                work_flags |= SD_FLAG_ERROR;
+                if ((r < 0) || (r & SD_R1_COM_CRC_ERROR))
+                    link_error();
+                work_stack_pop();
+                work_report(w, w->sector, w->buf, w->status + 1);
+                return;
+            }
+
+            // later blocks get theirs worked out while the one before goes out
+            crc_tx = 0xFFFF;
+            if (use_crc)
+                crc_tx = sd_crc16((w->flags & SD_WORK_FLAG_MERGED)?work_merged_buf(w, w->sector):w->buf, 512);
+
+            w->status = SD_WRITE_STATUS_DMA;
+            // deliberate fall-through
+        }
         case SD_WRITE_STATUS_DMA:
         {
-            work_flags |= SD_FLAG_RUNNING;
+            work_flags |= SD_FLAG_RUNNING | SD_FLAG_DMA;
 
-            dma_txmem.setup(w->buf, 512);
+            // at least one byte gap, then the start token
+            spi->transfer(0xFF);
+            spi->transfer(w->end_sector?SD_TOKEN_START_BLOCK_MULTI:SD_TOKEN_START_BLOCK);
+
+            if (w->flags & SD_WORK_FLAG_MERGED)
+                dma_txmem.setup(work_merged_buf(w, w->sector), 512);
+            else
+                dma_txmem.setup(w->buf, 512);
             dma_txmem.auto_increment = DMA_AUTO_INCREMENT;
 
-            dma_rxmem.setup(&txm, 4);
+            dma_rxmem.setup(&rxm, 4);
             dma_rxmem.auto_increment = DMA_NO_INCREMENT;
 
             dma_tx.setup(512);
             dma_rx.setup(512);
 
+            w->status = SD_WRITE_STATUS_CHECKSUM;
+
+            stat_dma_start = cycle_counter();
             dma_rx.begin();
             dma_tx.begin();
 
-            w->status = SD_WRITE_STATUS_CHECKSUM;
+            if (use_crc && (w->sector < w->end_sector))
+            {
+                if (w->flags & SD_WORK_FLAG_MERGED)
+                    crc_tx_next = sd_crc16(work_merged_buf(w, w->sector + 1), 512);
+                else
+                    crc_tx_next = sd_crc16(((uint8_t*) w->buf) + 512, 512);
+            }
 
             break;
-        };
-            break;
+        }
         case SD_WRITE_STATUS_CHECKSUM:
-            spi->transfer(0xFF);
-            spi->transfer(0xFF);
+        {
+            spi->transfer(crc_tx >> 8);
+            spi->transfer(crc_tx & 0xFF);
 
-            w->status = SD_WRITE_STATUS_WAIT_RESPONSE;
+            // data response follows the checksum immediately
+            uint8_t r;
+            int i;
+            for (i = 0; i < CMD_TIMEOUT; i++)
+                if ((r = spi->transfer(0xFF)) != 0xFF)
+                    break;
 
-            // deliberate fall-through
-        case SD_WRITE_STATUS_WAIT_RESPONSE:
-        {
-            uint8_t r = spi->transfer(0xFF);
-            if (r != 0xFF)
+            if ((i >= CMD_TIMEOUT) || ((r & SD_DATA_RESPONSE_MASK) != SD_DATA_RESPONSE_ACCEPTED))
             {
-                work_flags &= ~SD_FLAG_REQ_WORK;
-
-                if ((r & 31) == 0x5)
+                // block rejected. the card may be busy with earlier blocks,
+                // so wait that out before we issue anything else
+                if (w->end_sector)
                 {
-                    // data accepted
-                    w->status = SD_WRITE_STATUS_BUFFER_DIRTY;
+                    spi->transfer(SD_TOKEN_STOP_TRAN);
+                    // busy only starts one byte after the stop token
+                    spi->transfer(0xFF);
+                }
 
-                    if (w->receiver)
-                        w->receiver->sd_write_complete(this, w->sector, w->buf, 0);
+                if ((i >= CMD_TIMEOUT) || ((r & 0x11) != 0x01) || ((r & SD_DATA_RESPONSE_MASK) == SD_DATA_RESPONSE_CRC_ERROR))
+                    link_error();
+                busy_begin();
 
-                    if (w->status != SD_WRITE_STATUS_WAIT_BSY)
-                        break;
-                }
-                else
+                // garbled on the way. Try that block again
+                if ((i < CMD_TIMEOUT) && ((r & SD_DATA_RESPONSE_MASK) == SD_DATA_RESPONSE_CRC_ERROR) && (w->retries++ < SD_CRC_RETRIES))
                 {
-                    sd_cmd(spi, SD_CMD_STOP_TRAN, 0);
-                    if (w->receiver)
-                        w->receiver->sd_write_complete(this, w->sector, w->buf, r);
+                    stats.write.retries++;
+                    w->status = SD_WRITE_STATUS_RESTART;
+                    return;
                 }
+
+                work_flags |= SD_FLAG_ERROR;
+                work_stack_pop();
+                work_report(w, w->sector, w->buf, (i >= CMD_TIMEOUT)?-1:r);
+                return;
+            }
+
+            wait_begin(write_timeout_us);
+            timer.start_us(write_poll_us);
+
+            // the caller can have this buffer back now, unless it's the last
+            // one- that waits until the card has finished programming
+            if (w->sector < w->end_sector)
+            {
+                uint32_t sector = w->sector;
+                void*    buf    = w->buf;
+
+                w->status = SD_WRITE_STATUS_WAIT_BSY;
+                w->retries = 0;
+                crc_tx = crc_tx_next;
+                w->sector++;
+                if ((w->flags & SD_WORK_FLAG_MERGED) == 0)
+                    w->buf = ((uint8_t*) w->buf) + 512;
+
+                work_report(w, sector, buf, 0);
             }
             else
+                w->status = SD_WRITE_STATUS_WAIT_BSY_LAST;
+
+            break;
+        }
+        case SD_WRITE_STATUS_WAIT_BSY:
+        case SD_WRITE_STATUS_WAIT_BSY_LAST:
+        case SD_WRITE_STATUS_STOP_TRAN:
+        {
+            // card holds DO low while it's programming
+            if (spi->transfer(0xFF) == 0x00)
             {
-                work_flags |= SD_FLAG_REQ_WORK;
+                if (wait_poll(write_poll_us) == 0)
+                    break;
+
+                // card never finished
+                spi->end_transaction();
+                work_flags |= SD_FLAG_ERROR;
+                work_stack_pop();
+                work_report(w, w->sector, w->buf, -1);
                 break;
             }
-        };
 
-            // deliberate fall-through
+            stat_sample(w->action, SD_STAT_BUSY, stat_wait_start);
 
-        case SD_WRITE_STATUS_WAIT_BSY:
-        {
-            uint8_t r = spi->transfer(0xFF);
-            if (r != 0x00)
+            if (w->status == SD_WRITE_STATUS_WAIT_BSY)
             {
+                w->status = SD_WRITE_STATUS_DMA;
+                work_stack_write();
+                break;
+            }
 
+            if ((w->status == SD_WRITE_STATUS_WAIT_BSY_LAST) && w->end_sector)
+            {
+                spi->transfer(SD_TOKEN_STOP_TRAN);
+                spi->transfer(0xFF);
+                w->status = SD_WRITE_STATUS_STOP_TRAN;
+                wait_begin(write_timeout_us);
+                timer.start_us(write_poll_us);
+                break;
             }
-            else
-                work_flags |= SD_FLAG_REQ_WORK;
-        };
-        case SD_WRITE_STATUS_BUFFER_DIRTY:
+
+            spi->end_transaction();
+
+            work_stack_pop();
+            work_report(w, w->sector, w->buf, 0);
+
             break;
+        }
         default:
             break;
     }
 }
 
-void SD::clean_buffer(void* buf)
+void SD::work_stack_erase()
 {
-    switch(work_stack->action)
+    sd_work_stack_t* w = work_stack;
+
+    switch(w->status)
     {
-        case SD_WORK_ACTION_READ:
-            if (work_stack->status == SD_READ_STATUS_BUFFER_DIRTY)
+        case SD_ERASE_STATUS_START:
+        {
+            work_flags |= SD_FLAG_RUNNING;
+
+            // command class 5 is erase. SDSC cards may only erase whole
+            // erase units unless ERASE_BLK_EN is set
+            uint32_t unit = 1;
+            if (card_type == SD_TYPE_SD && ext_bits(csd, 46, 46) == 0)
+                unit = ext_bits(csd, 45, 39) + 1;
+
+            if (((card_type != SD_TYPE_SDHC) && (card_type != SD_TYPE_SD)) ||
+                ((ext_bits(csd, 95, 84) & (1 << 5)) == 0) ||
+                (w->sector % unit) || ((w->end_sector + 1) % unit))
             {
-                work_stack->status = SD_READ_STATUS_CONTINUE_MULTI;
-                work_stack->buf = buf;
-                work_stack->sector++;
-//                 printf("WAIT TRAN: ");
-                work_stack_work();
+                work_flags |= SD_FLAG_ERROR;
+                work_stack_pop();
+                work_report(w, w->sector, NULL, -1);
+                return;
             }
+
+            uint32_t first = w->sector;
+            uint32_t last  = w->end_sector;
+            if (card_type == SD_TYPE_SD)
+            {
+                first <<= 9;
+                last  <<= 9;
+            }
+
+            int r = work_cmd(SD_CMD_ERASE_START, first);
+            spi->end_transaction();
+            if ((r & 0x7E) == 0)
+            {
+                r = work_cmd(SD_CMD_ERASE_END, last);
+                spi->end_transaction();
+            }
+            if ((r & 0x7E) == 0)
+                r = work_cmd(SD_CMD_ERASE, 0);
+
+            if (r & 0x7E)
+            {
+                spi->end_transaction();
+                work_flags |= SD_FLAG_ERROR;
+                if ((r < 0) || (r & SD_R1_COM_CRC_ERROR))
+                    link_error();
+                work_stack_pop();
+                work_report(w, w->sector, NULL, r);
+                return;
+            }
+
+            // R1b: the card holds DO low until it's done
+            w->status = SD_ERASE_STATUS_WAIT_BSY;
+            wait_begin(write_timeout_us * (1 + (w->end_sector - w->sector) / SD_ERASE_AU_SECTORS));
+            timer.start_us(write_poll_us);
             break;
-        default:
+        }
+        case SD_ERASE_STATUS_WAIT_BSY:
+        {
+            if (spi->transfer(0xFF) == 0x00)
+            {
+                if (wait_poll(write_poll_us) == 0)
+                    break;
+
+                spi->end_transaction();
+                work_flags |= SD_FLAG_ERROR;
+                work_stack_pop();
+                work_report(w, w->sector, NULL, -1);
+                break;
+            }
+
+            stat_sample(w->action, SD_STAT_BUSY, stat_wait_start);
+
+            spi->end_transaction();
+            work_stack_pop();
+            work_report(w, w->sector, NULL, 0);
             break;
+        }
     }
 }
 
+void SD::clean_buffer(void* buf)
+{
+    // this can be called from anywhere, so it only hands the buffer back.
+    // work_stack_read() picks that up from interrupt context
+    for (int i = 0; i < SD_READ_BUFFERS; i++)
+    {
+        if (buf == read_buf[i])
+        {
+            if (__sync_fetch_and_and(&read_buf_dirty, ~(1 << i)) & (1 << i))
+                timer.trigger();
+            return;
+        }
+    }
+
+    // the caller's own buffer, for the next block of a multi read
+    read_buf_returned = buf;
+    timer.trigger();
+}
+
+int SD::wake(SD_async_receiver* receiver)
+{
+	SD_async_receiver* waiting = (SD_async_receiver*) __sync_val_compare_and_swap(&wake_receiver, NULL, receiver);
+	if (waiting && (waiting != receiver))
+		return -1;
+
+	timer.trigger();
+
+	return 0;
+}
+
 void SD::work_stack_pop()
 {
-	if (work_stack == NULL)
+	if (work_stack)
 	{
-		work_flags &= ~(SD_FLAG_RUNNING | SD_FLAG_REQ_WORK);
-		return;
-	}
+		sd_work_stack_t* w = work_stack;
+		work_stack = w->next;
 
-	// remove item from stack
-	sd_work_stack_t* w = work_stack;
-	work_stack = w->next;
+		work_stack_free(w);
+	}
 
-	// move work stack item to garbage collector stack
-	w->next = gc_stack;
-	gc_stack = w;
+	work_stack_fetch();
 
 	// next item
 	if (work_stack)
-		work_flags |= SD_FLAG_REQ_WORK;
-	else
-		work_flags &= ~(SD_FLAG_RUNNING | SD_FLAG_REQ_WORK);
+	{
+		timer.trigger();
+		return;
+	}
+
+	work_flags &= ~SD_FLAG_RUNNING;
+
+	// something may have been submitted after we looked, but before its
+	// producer could see that we'd stopped
+	if (work_ring[work_ring_out & (SD_QUEUE_DEPTH - 1)].seq == work_ring_out + 1)
+		timer.trigger();
 
 // 	work_stack_debug();
 }
@@ -826,6 +2440,121 @@ void SD::work_stack_debug()
 	printf("End Stack\n");
 }
 
+/*
+ * send a command for the current transaction, timing its response
+ */
+int SD::work_cmd(int cmd, uint32_t arg)
+{
+	uint32_t start = cycle_counter();
+
+	int r = sd_cmdx(spi, cmd, arg);
+
+	if (r >= 0)
+		stat_sample(stat_action, SD_STAT_CMD, start);
+
+	return r;
+}
+
+const sd_stats_t* SD::get_stats()
+{
+	return &stats;
+}
+
+void SD::reset_stats()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+sd_op_stats_t* SD::stat_op(uint8_t action)
+{
+	if (action == SD_WORK_ACTION_WRITE)
+		return &stats.write;
+	if (action == SD_WORK_ACTION_ERASE)
+		return &stats.erase;
+	return &stats.read;
+}
+
+void SD::stat_sample(uint8_t action, SD_STAT_KIND kind, uint32_t since)
+{
+#if SD_STATS
+	uint32_t us = (cycle_counter() - since) / stat_cycles_per_us;
+
+	sd_latency_t* l = &stat_op(action)->latency[kind];
+
+	l->n++;
+	l->total_us += us;
+	if (us > l->max_us)
+		l->max_us = us;
+
+	int bucket = us?(32 - __builtin_clz(us)):0;
+	if (bucket >= SD_STATS_BUCKETS)
+		bucket = SD_STATS_BUCKETS - 1;
+	l->hist[bucket]++;
+#endif
+}
+
+/*
+ * w's command is about to go out. A carrier was never queued itself, so
+ * count the requests riding on it instead
+ */
+void SD::stat_queued(sd_work_stack_t* w)
+{
+#if SD_STATS
+	if ((w->flags & SD_WORK_FLAG_MERGED) == 0)
+	{
+		stat_sample(w->action, SD_STAT_QUEUE, w->queued);
+		return;
+	}
+
+	for (sd_work_stack_t* r = w->riders; r; r = r->next)
+		stat_sample(r->action, SD_STAT_QUEUE, r->queued);
+#endif
+}
+
+void SD::dump_stats()
+{
+	static const char* kind_name[SD_STAT_N] = { "queue", "cmd", "token", "dma", "busy" };
+
+	printf("SD: %luHz, %lu clock step-downs, %lu requests refused\n",
+		spi->get_frequency(), stats.link_errors, stats.refused);
+
+	if (stats.prefetch_blocks)
+		printf("read-ahead: %lu blocks, %lu hits, %lu streams cancelled\n",
+			stats.prefetch_blocks, stats.prefetch_hits, stats.prefetch_cancels);
+
+	static const char* op_name[3] = { "read", "write", "erase" };
+	sd_op_stats_t* ops[3] = { &stats.read, &stats.write, &stats.erase };
+
+	for (int op = 0; op < 3; op++)
+	{
+		sd_op_stats_t* o = ops[op];
+
+		if ((op == 2) && (o->requests == 0))
+			continue;
+
+		printf("%s: %lu requests, %lu retries, %lu errors\n",
+			op_name[op], o->requests, o->retries, o->errors);
+
+		for (int k = 0; k < SD_STAT_N; k++)
+		{
+			sd_latency_t* l = &o->latency[k];
+			if (l->n == 0)
+				continue;
+
+			printf("\t%-6s n %-8lu avg %6luus max %6luus |", kind_name[k],
+				l->n, (uint32_t) (l->total_us / l->n), l->max_us);
+
+			// bucket i holds samples under 2^i us, the last one the rest
+			for (int i = 0; i < SD_STATS_BUCKETS - 1; i++)
+				if (l->hist[i])
+					printf(" <%lu:%lu", 1UL << i, l->hist[i]);
+			if (l->hist[SD_STATS_BUCKETS - 1])
+				printf(" >=%lu:%lu", 1UL << (SD_STATS_BUCKETS - 2), l->hist[SD_STATS_BUCKETS - 1]);
+			printf("\n");
+		}
+	}
+}
+
 void SD::dma_begin(DMA* dma, dma_direction_t direction)
 {
 	spi->dma_begin(dma, direction);
@@ -833,14 +2562,14 @@ void SD::dma_begin(DMA* dma, dma_direction_t direction)
 
 void SD::dma_complete(DMA* dma, dma_direction_t direction)
 {
-    TRACE("SD: dma complete %p\n", dma);
-
 	spi->dma_complete(dma, direction);
 
-	if (direction == DMA_RECEIVER)
+	// the transmit channel finishes while the last bytes are still in the
+	// receive FIFO, so only carry on once the block has fully landed
+	if (dma == &dma_rx)
 	{
-
-		// TODO: do something interesting with transferred block
+		stat_sample(stat_action, SD_STAT_DMA, stat_dma_start);
+		work_flags &= ~SD_FLAG_DMA;
 		work_stack_work();
 	}
 }
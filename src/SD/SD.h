@@ -2,6 +2,106 @@
 #define _SD_H
 
 #include "SPI.h"
+#include "Timer.h"
+
+/*
+ * number of driver-owned buffers used by streaming multi-block reads
+ *
+ * while the receiver is busy with one, the card keeps filling the others
+ */
+#ifndef SD_READ_BUFFERS
+#define SD_READ_BUFFERS 2
+#endif
+
+#if SD_READ_BUFFERS < 1 || SD_READ_BUFFERS > 8
+#error SD_READ_BUFFERS must be between 1 and 8
+#endif
+
+/*
+ * fastest we'll clock the card, whatever it claims it can do. The SSP
+ * can't go past PCLK/2 anyway
+ */
+#ifndef SD_SPI_MAX_HZ
+#define SD_SPI_MAX_HZ 50000000
+#endif
+
+/*
+ * bus errors step the clock down, but never below this
+ */
+#ifndef SD_SPI_MIN_HZ
+#define SD_SPI_MIN_HZ 1000000
+#endif
+
+/*
+ * checksum every command and data block, and ask the card to do the same.
+ * A block that fails is read or written again, up to SD_CRC_RETRIES times
+ */
+#ifndef SD_CRC
+#define SD_CRC 1
+#endif
+
+#ifndef SD_CRC_RETRIES
+#define SD_CRC_RETRIES 3
+#endif
+
+/*
+ * request descriptors per SD. Requests are refused when they're all in use.
+ * must be a power of two, no more than 32
+ */
+#ifndef SD_QUEUE_DEPTH
+#define SD_QUEUE_DEPTH 16
+#endif
+
+#if SD_QUEUE_DEPTH < 2 || SD_QUEUE_DEPTH > 32 || (SD_QUEUE_DEPTH & (SD_QUEUE_DEPTH - 1))
+#error SD_QUEUE_DEPTH must be a power of two between 2 and 32
+#endif
+
+/*
+ * queued requests for neighbouring sectors are merged into a single
+ * CMD18/CMD25 transaction of up to this many blocks
+ */
+#ifndef SD_MERGE_MAX_BLOCKS
+#define SD_MERGE_MAX_BLOCKS 64
+#endif
+
+/*
+ * the scheduler serves requests in ascending LBA order, but a request it has
+ * passed over this many times goes next regardless
+ */
+#ifndef SD_SCHED_MAX_BYPASS
+#define SD_SCHED_MAX_BYPASS 8
+#endif
+
+/*
+ * read-ahead: once a receiver has made SD_PREFETCH_TRIGGER single-block
+ * reads in a row, each following on from the last, the next one opens a
+ * CMD18 that runs ahead into a ring of SD_PREFETCH_BLOCKS buffers. Reads
+ * the ring already holds complete without touching the card. The stream is
+ * stopped after SD_PREFETCH_WINDOW blocks, or as soon as something it can't
+ * serve is queued. SD_PREFETCH_BLOCKS 0 turns it off
+ */
+#ifndef SD_PREFETCH_BLOCKS
+#define SD_PREFETCH_BLOCKS 8
+#endif
+
+#ifndef SD_PREFETCH_TRIGGER
+#define SD_PREFETCH_TRIGGER 2
+#endif
+
+#ifndef SD_PREFETCH_WINDOW
+#define SD_PREFETCH_WINDOW 128
+#endif
+
+#if SD_PREFETCH_BLOCKS > 255
+#error SD_PREFETCH_BLOCKS must be less than 256
+#endif
+
+/*
+ * keep latency histograms and error counts, see get_stats()
+ */
+#ifndef SD_STATS
+#define SD_STATS 1
+#endif
 
 typedef enum {
 	SD_TYPE_NONE,
@@ -16,17 +116,90 @@ typedef enum {
 	SD_WORK_ACTION_INIT,
 
 	SD_WORK_ACTION_READ,
-	SD_WORK_ACTION_WRITE
+	SD_WORK_ACTION_WRITE,
+
+	SD_WORK_ACTION_ERASE,
+	SD_WORK_ACTION_PRE_ERASE
 } SD_WORK_ACTION;
 
 class SD;
 
+// err passed to SD_async_receiver when a block still fails its CRC after
+// SD_CRC_RETRIES retries
+#define SD_ERROR_CRC -2
+
+// err for a read or write that reaches a card we don't drive. Only SD cards
+// get through init(), which turns MMC cards away
+#define SD_ERROR_CARD_TYPE -3
+
+/*
+ * statistics
+ *
+ * times are taken from the core cycle counter. Each histogram bucket covers
+ * a power of two microseconds: hist[0] counts samples under 1us, hist[i]
+ * those from 2^(i-1) up to 2^i us, and the last bucket everything longer
+ */
+#define SD_STATS_BUCKETS 20
+
+typedef enum {
+	SD_STAT_QUEUE, // request made, to its command going out
+	SD_STAT_CMD,   // command, to its R1
+	SD_STAT_TOKEN, // R1 or the end of the previous block, to the read start token
+	SD_STAT_DMA,   // one block across the bus
+	SD_STAT_BUSY,  // card programming after a block or a stop
+	SD_STAT_N
+} SD_STAT_KIND;
+
+typedef struct {
+	uint32_t n;
+	uint32_t max_us;
+	uint64_t total_us;
+	uint32_t hist[SD_STATS_BUCKETS];
+} sd_latency_t;
+
+typedef struct {
+	uint32_t requests;
+	uint32_t retries; // blocks sent or fetched again after a CRC error
+	uint32_t errors;  // completions reported with err != 0
+
+	sd_latency_t latency[SD_STAT_N];
+} sd_op_stats_t;
+
+typedef struct {
+	sd_op_stats_t read;
+	sd_op_stats_t write;
+	sd_op_stats_t erase;
+
+	uint32_t refused;     // requests turned away with every descriptor in use
+	uint32_t link_errors; // times the clock was stepped down
+
+	uint32_t prefetch_blocks;  // blocks read ahead
+	uint32_t prefetch_hits;    // reads served from them
+	uint32_t prefetch_cancels; // read-ahead streams stopped early for other requests
+} sd_stats_t;
+
 class SD_async_receiver {
 public:
 	virtual void sd_read_complete(SD*, uint32_t sector, void* buf, int err) = 0;
 	virtual void sd_write_complete(SD*, uint32_t sector, void* buf, int err) = 0;
+
+	// result is what init() would have returned
+	virtual void sd_init_complete(SD*, int result) {}
+
+	virtual void sd_erase_complete(SD*, uint32_t sector, uint32_t n_sectors, int err) {}
+
+	// asked for with SD::wake()
+	virtual void sd_wake(SD*) {}
 };
 
+typedef enum {
+	SD_WORK_FLAG_NONE     = 0,
+	SD_WORK_FLAG_STREAM   = 1, // multi-block read into our own read buffers
+	SD_WORK_FLAG_MERGED   = 2, // one transaction carrying the requests in riders
+	SD_WORK_FLAG_RETRY    = 4, // the block before the one in flight failed its CRC
+	SD_WORK_FLAG_PREFETCH = 8  // read-ahead into prefetch_ring, nobody's waiting on it
+} SD_WORK_ITEM_FLAGS;
+
 struct _sd_work_stack;
 typedef struct _sd_work_stack sd_work_stack_t;
 
@@ -37,35 +210,116 @@ struct _sd_work_stack {
     uint32_t end_sector;
 	void*    buf;
 	uint8_t  status;
+	uint8_t  flags;
+	uint8_t  bypassed; // times the scheduler has served something else first
+	uint8_t  retries;  // CRC failures on the current block
+	uint32_t queued;   // cycle count when the request was made
 
 	SD_async_receiver* receiver;
 
+	sd_work_stack_t*   riders; // original requests, oldest first, if SD_WORK_FLAG_MERGED
 	sd_work_stack_t*   next;
 };
 
-class SD : public DMA_receiver
+/*
+ * one card on its own SSP port. Each SD has its own request queue, timer and
+ * pair of DMA channels, so cards on SSP0 and SSP1 run side by side, each
+ * from its own interrupts
+ */
+class SD : public DMA_receiver, public Timer_receiver
 {
 public:
 	SD(SPI*);
 
 	void on_idle(void);
+
+	// on_idle() for every SD there is, for main loops looking after several
+	static void on_idle_all(void);
 	
 	int init();
+
+	/*
+	 * init() without the wait: the card is brought up from interrupt
+	 * context, a command per timer interrupt, and the receiver's
+	 * sd_init_complete() gets the result. Requests made after this wait
+	 * until it's done. Returns -1 if no request descriptor is free
+	 */
+	int begin_init(SD_async_receiver*);
 	
 	uint32_t n_sectors(void);
+
+	// current SPI clock. May drop below what init() picked if the bus
+	// turns out not to be up to it
+	uint32_t get_frequency(void);
+
+	/*
+	 * counters are updated from interrupt context, so a snapshot taken while
+	 * requests are running may be slightly inconsistent
+	 */
+	const sd_stats_t* get_stats(void);
+	void reset_stats(void);
+	void dump_stats(void);
+
+	// what init() found out about the card. Not from interrupt context
+	void dump_info(void);
 	
 // 	int read(uint32_t sector, void* buf);
 // 	int write(uint32_t sector, void* buf);
 //
 // 	int read_multi(uint32_t sector, void* buf, int sectors);
 // 	int write_multi(uint32_t sector, void* buf, int sectors);
-// 	int pre_erase(uint32_t sector, uint32_t n_sectors);
+
+	/*
+	 * discard: erase n_sectors from sector (CMD32/CMD33/CMD38), then call
+	 * the receiver's sd_erase_complete(). Erased blocks read back as all 0s
+	 * or all 1s, depending on the card. Fails with -1 if the card has no
+	 * erase commands, or for an SDSC card whose erase unit the range
+	 * doesn't line up with.
+	 *
+	 * queued like a write, so it keeps its place against anything that
+	 * overlaps it
+	 */
+	int begin_erase(uint32_t sector, uint32_t n_sectors, SD_async_receiver*);
+
+	/*
+	 * hint that n_sectors from sector are about to be written, so the card
+	 * can erase them ahead of time (ACMD23). The next multi-block write
+	 * that starts in the range asks for the rest of it to be pre-erased,
+	 * and anything there it doesn't write is left with undefined contents
+	 */
+	int pre_erase(uint32_t sector, uint32_t n_sectors);
 	
+	/*
+	 * multi-block reads with a NULL buf stream through our own read buffers.
+	 * each sd_read_complete hands the receiver one of them, which it must
+	 * give back with clean_buffer() when it's done. The card only stalls
+	 * when all SD_READ_BUFFERS are still held by the receiver.
+	 *
+	 * with a caller buf, every block lands in that buf and the next one is
+	 * only requested once the receiver calls clean_buffer()
+	 *
+	 * queued requests are served in LBA order rather than the order they
+	 * were made, except that nothing overtakes an older request for the same
+	 * sectors when either is a write. Single-block reads and writes for
+	 * neighbouring sectors may share a transaction, but each still gets its
+	 * own completions
+	 *
+	 * both return -1 if all SD_QUEUE_DEPTH request descriptors are in use
+	 */
 	int begin_read(uint32_t sector, uint32_t n_sectors, void* buf, SD_async_receiver*);
 	int begin_write(uint32_t sector, uint32_t n_sectors, void* buf, SD_async_receiver*);
 
     void clean_buffer(void* buf);
 
+	/*
+	 * call the receiver's sd_wake() from the interrupt its completions come
+	 * from, as soon as that's free. For a receiver whose state those
+	 * completions work on, to get at it from anywhere else without masking
+	 * interrupts. Calls made before it runs share one sd_wake(). One
+	 * receiver can wait at a time: -1 if another already is
+	 */
+	int wake(SD_async_receiver*);
+
 	SD_CARD_TYPE get_type(void);
 
 	/*
@@ -75,35 +329,172 @@ public:
 	void dma_complete(DMA*, dma_direction_t);
 	void dma_configure(dma_config*);
 
+	/*
+	 * implementation of Timer_receiver
+	 *
+	 * token and busy waits poll the card from here, rather than spinning
+	 */
+	void timer_expired(Timer*);
+
 	void work_stack_work(void);
 
+    void work_stack_init(void);
     void work_stack_read(void);
     void work_stack_write(void);
+    void work_stack_erase(void);
     
 	void work_stack_debug(void);
 protected:
 	SPI* spi;
+
+	static SD* instances; // every SD constructed, newest first
+	SD*        next_instance;
 	
 	SD_CARD_TYPE card_type;
 	uint32_t sector_count;
 
+	uint8_t csd[16];
+	uint8_t cid[16];
+	uint8_t high_speed; // switched to high speed mode with CMD6
+
+	uint32_t csd_tran_speed(void);
+	void     link_error(void);
+
 	DMA_mem dma_rxmem;
 	DMA_mem dma_txmem;
 
 	DMA dma_tx;
 	DMA dma_rx;
 
+	Timer timer;
+
+	/*
+	 * access timing, worked out from the CSD
+	 */
+	uint32_t read_timeout_us;
+	uint32_t write_timeout_us;
+	uint32_t read_poll_us;
+	uint32_t write_poll_us;
+
+	uint32_t wait_deadline;
+
+	void csd_timing(uint8_t* csd, uint32_t spi_hz);
+
+	void wait_begin(uint32_t timeout_us);
+	int  wait_expired(void);
+	int  wait_poll(uint32_t poll_us);
+	void busy_begin(void);
+
 	uint32_t txm;
+	uint32_t rxm; // sink for bytes clocked back during writes
+
+	/*
+	 * CRC
+	 *
+	 * a streamed block's CRC is checked while the next block is in flight,
+	 * and it only goes to the receiver once it passes. Likewise a write
+	 * works out the next block's CRC while the current one goes out
+	 */
+	uint8_t  use_crc;
 
-	sd_work_stack_t* work_stack;
+	struct {
+		void*    buf;    // NULL if there's nothing waiting to be checked
+		uint32_t sector;
+		uint16_t crc;
+		int8_t   index;  // read_buf it's in, -1 if it's not one of ours
+	} crc_pending;
 
-	// garbage collector stack
-	// we marshall completed items here so they can be freed outside of interrupt context
-	sd_work_stack_t* gc_stack;
+	uint16_t crc_tx;
+	uint16_t crc_tx_next;
 
+	int  read_crc_pending(sd_work_stack_t*);
+	void read_retry(sd_work_stack_t*, uint32_t sector, int index);
+
+	uint8_t* read_buf[SD_READ_BUFFERS];
+	volatile uint8_t read_buf_dirty; // one bit per read_buf, set while the receiver holds it
+	uint8_t  read_buf_next;          // read_buf that the next streamed block lands in
+	void* volatile read_buf_returned; // clean_buffer(): the caller's buffer, back for the next block
+
+	/*
+	 * request queue
+	 *
+	 * descriptors come from a fixed pool and are handed to interrupt
+	 * context through a multi-producer ring, so requests can be made from
+	 * anywhere (including our own callbacks) without a lock or masking
+	 * interrupts. Everything past the ring is only touched from interrupt
+	 * context
+	 */
+	sd_work_stack_t   work_items[SD_QUEUE_DEPTH];
+	volatile uint32_t work_free; // one bit per work_items entry not in use
+
+	struct {
+		volatile uint32_t seq;   // position + 1 once item is valid
+		uint8_t           item;  // index into work_items
+	} work_ring[SD_QUEUE_DEPTH];
+	volatile uint32_t work_ring_in;
+	uint32_t          work_ring_out;
+
+	sd_work_stack_t* work_stack; // pending requests, oldest first. head is the current one
+
+	SD_async_receiver* volatile wake_receiver;
+
+	sd_work_stack_t* work_stack_new();
+	void work_stack_free(sd_work_stack_t*);
+	void work_stack_push(sd_work_stack_t*);
+	void work_stack_fetch();
 	void work_stack_pop();
 
+	/*
+	 * I/O scheduler: picks the next request by LBA and folds its queued
+	 * neighbours into the same transaction
+	 */
+	uint32_t last_sector; // where the previous transaction left the card
+
+	uint32_t pre_erase_sector; // range from the last pre_erase(), until a
+	uint32_t pre_erase_count;  // multi-block write uses it
+
+	/*
+	 * read-ahead ring, SD_PREFETCH_BLOCKS blocks in AHB SRAM. prefetch_count
+	 * blocks from prefetch_first have been checked and can be handed out, and
+	 * a running stream lands its next block after them
+	 */
+	uint8_t* prefetch_ring;  // NULL if read-ahead is off
+	uint32_t prefetch_first;
+	uint8_t  prefetch_head;  // slot holding prefetch_first
+	uint8_t  prefetch_count;
+
+	// the sequential run we're watching for
+	SD_async_receiver* seq_receiver;
+	uint32_t           seq_next;
+	uint8_t            seq_run;
+
+	uint8_t* prefetch_slot(uint32_t n);
+	int      prefetch_take(sd_work_stack_t*);
+	void     prefetch_track(sd_work_stack_t*);
+	void     prefetch_start(sd_work_stack_t*);
+	void     prefetch_serve(void);
+	int      prefetch_blocked(sd_work_stack_t*);
+	void     prefetch_stop(sd_work_stack_t*);
+
+	void  work_stack_schedule(void);
+	void* work_merged_buf(sd_work_stack_t*, uint32_t sector);
+	void  work_report(sd_work_stack_t*, uint32_t sector, void* buf, int err);
+
 	volatile uint8_t work_flags;
+
+	/*
+	 * statistics
+	 */
+	sd_stats_t stats;
+	uint32_t   stat_cycles_per_us;
+	uint32_t   stat_wait_start; // cycle count at the last wait_begin()
+	uint32_t   stat_dma_start;
+	uint8_t    stat_action;     // what the card is busy with, for busy time after a pop
+
+	sd_op_stats_t* stat_op(uint8_t action);
+	void stat_sample(uint8_t action, SD_STAT_KIND, uint32_t since);
+	void stat_queued(sd_work_stack_t*);
+	int  work_cmd(int cmd, uint32_t arg);
 };
 
 #endif /* _SD_H */
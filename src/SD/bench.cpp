@@ -0,0 +1,347 @@
+#include "bench.h"
+
+#include "platform_memory.h"
+#include "platform_utils.h"
+
+#include <cstdio>
+#include <cstring>
+
+#define SLOT_FREE 0xFFFFFFFF
+
+SD_bench::SD_bench(SD* sd)
+{
+	this->sd = sd;
+
+	config    = NULL;
+	result    = NULL;
+	read_buf  = NULL;
+	write_buf = NULL;
+
+	outstanding = 0;
+}
+
+// xorshift32, so a run can be repeated exactly
+uint32_t SD_bench::next_random()
+{
+	uint32_t x = random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	random = x;
+	return x;
+}
+
+// bucket b < 8 holds b us. Above that, each power of two is split in eight
+static uint32_t bucket_of(uint32_t us)
+{
+	if (us < 8)
+		return us;
+
+	uint32_t e = 31 - __builtin_clz(us);
+	uint32_t b = ((e - 2) << 3) + ((us >> (e - 3)) & 7);
+
+	return (b < SD_BENCH_BUCKETS)?b:(SD_BENCH_BUCKETS - 1);
+}
+
+static uint32_t bucket_floor(uint32_t b)
+{
+	if (b < 8)
+		return b;
+
+	return (8 + (b & 7)) << ((b >> 3) - 1);
+}
+
+// smallest latency that percent of the samples don't exceed, to within 1/8
+uint32_t SD_bench::percentile(uint32_t n, int percent)
+{
+	uint32_t want = (n * percent + 99) / 100;
+	uint32_t seen = 0;
+
+	for (uint32_t b = 0; b < SD_BENCH_BUCKETS; b++)
+	{
+		seen += hist[b];
+		if (seen >= want)
+			return bucket_floor(b);
+	}
+	return result->max_us;
+}
+
+/*
+ * start a request in slot i. Sequential patterns carry on where the last
+ * one left off, random ones pick a free io_sectors-aligned chunk
+ */
+void SD_bench::issue(int i)
+{
+	const sd_bench_config_t* c = config;
+
+	int write = 0;
+	switch (c->pattern)
+	{
+		case SD_BENCH_SEQ_WRITE:
+		case SD_BENCH_RAND_WRITE:
+			write = 1;
+			break;
+		case SD_BENCH_MIXED:
+			write = ((next_random() % 100) >= c->read_percent);
+			break;
+		default:
+			break;
+	}
+
+	uint32_t sector;
+	if ((c->pattern == SD_BENCH_SEQ_READ) || (c->pattern == SD_BENCH_SEQ_WRITE))
+	{
+		if (next_sector + c->io_sectors > c->first + c->n_sectors)
+			next_sector = c->first;
+		sector = next_sector;
+		next_sector += c->io_sectors;
+	}
+	else
+	{
+		uint32_t chunks = c->n_sectors / c->io_sectors;
+
+		// keep clear of what's already in flight, so the scheduler is
+		// free to reorder everything
+		for (int tries = 0; ; tries++)
+		{
+			sector = c->first + (next_random() % chunks) * c->io_sectors;
+
+			int clash = 0;
+			for (int j = 0; j < c->queue_depth; j++)
+				if (slot[j].sector == sector)
+					clash = 1;
+			if ((clash == 0) || (tries >= 8))
+				break;
+		}
+	}
+
+	slot[i].last    = sector + c->io_sectors - 1;
+	slot[i].failed  = 0;
+	slot[i].started = cycle_counter();
+	slot[i].sector  = sector;
+
+	__sync_fetch_and_add(&outstanding, 1);
+
+	int r;
+	if (write)
+		r = sd->begin_write(sector, c->io_sectors, write_buf, this);
+	else
+		r = sd->begin_read(sector, c->io_sectors, (c->io_sectors > 1)?NULL:read_buf, this);
+
+	if (r < 0)
+	{
+		// queue's full of someone else's work, try again next time round
+		slot[i].sector = SLOT_FREE;
+		__sync_fetch_and_sub(&outstanding, 1);
+		return;
+	}
+
+	issued++;
+}
+
+// called from interrupt context as each block finishes
+void SD_bench::complete(uint32_t sector, int err)
+{
+	for (int i = 0; i < config->queue_depth; i++)
+	{
+		if ((slot[i].sector == SLOT_FREE) || (sector < slot[i].sector) || (sector > slot[i].last))
+			continue;
+
+		if (err)
+			slot[i].failed = 1;
+
+		// an error ends the request early
+		if ((sector < slot[i].last) && (err == 0))
+			return;
+
+		uint32_t now = cycle_counter();
+		uint32_t us  = (now - slot[i].started) / cycles_per_us;
+
+		elapsed_cyc += now - last_cycle;
+		last_cycle   = now;
+
+		hist[bucket_of(us)]++;
+		if (us > result->max_us)
+			result->max_us = us;
+
+		result->requests++;
+		result->sectors += slot[i].last - slot[i].sector + 1;
+		if (slot[i].failed)
+			result->errors++;
+
+		slot[i].sector = SLOT_FREE;
+		__sync_fetch_and_sub(&outstanding, 1);
+		retired++;
+		return;
+	}
+}
+
+void SD_bench::sd_read_complete(SD* sd, uint32_t sector, void* buf, int err)
+{
+	// streamed blocks come in our read buffers, which want handing back
+	if (buf != read_buf)
+		sd->clean_buffer(buf);
+
+	complete(sector, err);
+}
+
+void SD_bench::sd_write_complete(SD* sd, uint32_t sector, void* buf, int err)
+{
+	complete(sector, err);
+}
+
+int SD_bench::run(const sd_bench_config_t* c, sd_bench_result_t* r)
+{
+	if ((c->queue_depth < 1) || (c->queue_depth > SD_BENCH_MAX_DEPTH) ||
+		(c->io_sectors < 1) || (c->n_sectors < c->io_sectors) ||
+		(c->first + c->n_sectors > sd->n_sectors()))
+		return -1;
+
+	int writes = (c->pattern == SD_BENCH_SEQ_WRITE) || (c->pattern == SD_BENCH_RAND_WRITE) ||
+		((c->pattern == SD_BENCH_MIXED) && (c->read_percent < 100));
+
+	if (writes && (c->io_sectors > SD_BENCH_MAX_WRITE))
+		return -1;
+
+	read_buf = (uint8_t*) AHB0.alloc(512);
+	if (read_buf == NULL)
+		return -1;
+
+	if (writes)
+	{
+		write_buf = (uint8_t*) AHB0.alloc(c->io_sectors << 9);
+		if (write_buf == NULL)
+		{
+			AHB0.dealloc(read_buf);
+			return -1;
+		}
+		for (uint32_t i = 0; i < (c->io_sectors << 9); i++)
+			write_buf[i] = i ^ (i >> 8);
+	}
+
+	config = c;
+	result = r;
+	memset(r, 0, sizeof(*r));
+	memset(hist, 0, sizeof(hist));
+
+	for (int i = 0; i < SD_BENCH_MAX_DEPTH; i++)
+		slot[i].sector = SLOT_FREE;
+
+	random        = c->seed?c->seed:1;
+	next_sector   = c->first;
+	issued        = 0;
+	outstanding   = 0;
+	retired       = 0;
+	elapsed_cyc   = 0;
+	cycles_per_us = cycle_counter_hz() / 1000000;
+	last_cycle    = cycle_counter();
+
+	// requests are only ever made from here, the interrupts just retire them
+	for (;;)
+	{
+		uint32_t before = retired;
+
+		for (int i = 0; (i < c->queue_depth) && (issued < c->requests); i++)
+			if (slot[i].sector == SLOT_FREE)
+				issue(i);
+
+		if ((outstanding == 0) && (issued >= c->requests))
+			break;
+
+		SD::on_idle_all();
+
+		// anything that finished while we were issuing gets another look
+		// before we sleep
+		if (retired == before)
+			__WFI();
+	}
+
+	r->elapsed_us = elapsed_cyc / cycles_per_us;
+	r->p50_us     = percentile(r->requests, 50);
+	r->p99_us     = percentile(r->requests, 99);
+
+	if (write_buf)
+		AHB0.dealloc(write_buf);
+	AHB0.dealloc(read_buf);
+	write_buf = NULL;
+	read_buf  = NULL;
+	config    = NULL;
+
+	return 0;
+}
+
+void SD_bench::report(const char* name, const sd_bench_config_t* c, const sd_bench_result_t* r)
+{
+	uint32_t us = r->elapsed_us?r->elapsed_us:1;
+
+	uint32_t iops  = ((uint64_t) r->requests * 1000000) / us;
+	// MB/s in hundredths
+	uint32_t mbps  = ((uint64_t) r->sectors * 512 * 100 * 1000000 / 1048576) / us;
+
+	char size[8];
+	if (c->io_sectors == 1)
+		strcpy(size, "512");
+	else
+		snprintf(size, sizeof(size), "%luk", c->io_sectors / 2);
+
+	printf("%-16s %4s qd%u %5lu req %4lu.%02lu MB/s %6lu IOPS  p50 %6luus p99 %6luus max %6luus",
+		name, size, c->queue_depth, r->requests, mbps / 100, mbps % 100, iops,
+		r->p50_us, r->p99_us, r->max_us);
+	if (r->errors)
+		printf("  %lu errors", r->errors);
+	printf("\n");
+}
+
+void SD_bench::suite(uint32_t first, uint32_t n_sectors, int allow_writes)
+{
+	static const struct {
+		const char*      name;
+		SD_BENCH_PATTERN pattern;
+		uint16_t         io_sectors;
+		uint16_t         requests;
+		uint8_t          queue_depth;
+		uint8_t          read_percent;
+	} tests[] = {
+		{ "seq read",   SD_BENCH_SEQ_READ,   64,  64, 1,   0 },
+		{ "seq read",   SD_BENCH_SEQ_READ,    1, 512, 1,   0 },
+		{ "rand read",  SD_BENCH_RAND_READ,   8, 256, 1,   0 },
+		{ "rand read",  SD_BENCH_RAND_READ,   8, 256, 2,   0 },
+		{ "rand read",  SD_BENCH_RAND_READ,   8, 256, 4,   0 },
+		{ "rand read",  SD_BENCH_RAND_READ,   8, 256, 8,   0 },
+		{ "rand read",  SD_BENCH_RAND_READ,   1, 512, 1,   0 },
+		{ "rand read",  SD_BENCH_RAND_READ,   1, 512, 8,   0 },
+		{ "seq write",  SD_BENCH_SEQ_WRITE,   8, 256, 1,   0 },
+		{ "seq write",  SD_BENCH_SEQ_WRITE,   8, 256, 4,   0 },
+		{ "rand write", SD_BENCH_RAND_WRITE,  8, 128, 1,   0 },
+		{ "rand write", SD_BENCH_RAND_WRITE,  8, 128, 4,   0 },
+		{ "mixed 70/30", SD_BENCH_MIXED,      8, 256, 4,  70 },
+	};
+
+	printf("SD bench: %lu sectors from %lu, %luHz%s\n", n_sectors, first,
+		sd->get_frequency(), allow_writes?"":", reads only");
+
+	for (uint32_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++)
+	{
+		sd_bench_config_t c;
+		sd_bench_result_t r;
+
+		c.pattern      = tests[t].pattern;
+		c.first        = first;
+		c.n_sectors    = n_sectors;
+		c.io_sectors   = tests[t].io_sectors;
+		c.requests     = tests[t].requests;
+		c.queue_depth  = tests[t].queue_depth;
+		c.read_percent = tests[t].read_percent;
+		c.seed         = 0x5EED0000 + t;
+
+		if ((c.pattern != SD_BENCH_SEQ_READ) && (c.pattern != SD_BENCH_RAND_READ) && (allow_writes == 0))
+			continue;
+
+		if (run(&c, &r) < 0)
+		{
+			printf("%-16s couldn't run\n", tests[t].name);
+			continue;
+		}
+		report(tests[t].name, &c, &r);
+	}
+}
@@ -0,0 +1,117 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "SD.h"
+
+/*
+ * SD benchmark
+ *
+ * drives begin_read()/begin_write() with a chosen access pattern, keeping
+ * queue_depth requests outstanding, and reports throughput, IOPS and
+ * request latency. It goes through the same queue, scheduler and DMA as
+ * everything else, so the figures are what our own driver gets out of a card
+ *
+ * run() waits for the whole run, sleeping between interrupts. Write patterns
+ * destroy whatever is in their region
+ */
+
+// most requests outstanding at once, and largest write in sectors
+#define SD_BENCH_MAX_DEPTH  8
+#define SD_BENCH_MAX_WRITE  8
+
+// latency histogram: eight buckets per power of two microseconds, up to 16s
+#define SD_BENCH_BUCKETS    176
+
+typedef enum {
+	SD_BENCH_SEQ_READ,
+	SD_BENCH_SEQ_WRITE,
+	SD_BENCH_RAND_READ,
+	SD_BENCH_RAND_WRITE,
+	SD_BENCH_MIXED      // random, read_percent of them reads
+} SD_BENCH_PATTERN;
+
+typedef struct {
+	SD_BENCH_PATTERN pattern;
+
+	uint32_t first;       // region to work in
+	uint32_t n_sectors;
+
+	uint32_t io_sectors;  // per request. Writes are limited to SD_BENCH_MAX_WRITE
+	uint32_t requests;    // how many to make
+	uint8_t  queue_depth; // 1..SD_BENCH_MAX_DEPTH
+	uint8_t  read_percent;
+
+	uint32_t seed;        // random offsets repeat for the same seed
+} sd_bench_config_t;
+
+typedef struct {
+	uint32_t requests;
+	uint32_t errors;
+	uint32_t sectors;
+	uint32_t elapsed_us;
+
+	// request latency, made to the last block reported
+	uint32_t p50_us;
+	uint32_t p99_us;
+	uint32_t max_us;
+} sd_bench_result_t;
+
+class SD_bench : public SD_async_receiver
+{
+public:
+	SD_bench(SD*);
+
+	// returns -1 if the config makes no sense or there's no write buffer
+	int run(const sd_bench_config_t*, sd_bench_result_t*);
+
+	void report(const char* name, const sd_bench_config_t*, const sd_bench_result_t*);
+
+	/*
+	 * the standard set: sequential, random 4k at queue depths 1 to 8, and
+	 * mixed. Works in n_sectors from first, and leaves out anything that
+	 * writes unless allow_writes is set
+	 */
+	void suite(uint32_t first, uint32_t n_sectors, int allow_writes);
+
+	/*
+	 * implementation of SD_async_receiver
+	 */
+	void sd_read_complete(SD*, uint32_t sector, void* buf, int err);
+	void sd_write_complete(SD*, uint32_t sector, void* buf, int err);
+
+protected:
+	SD* sd;
+
+	const sd_bench_config_t* config;
+
+	struct {
+		uint32_t sector;   // 0xFFFFFFFF when free
+		uint32_t last;
+		uint32_t started;  // cycle count
+		uint8_t  failed;
+	} slot[SD_BENCH_MAX_DEPTH];
+
+	uint8_t*          read_buf;  // for single-block reads, contents thrown away
+	uint8_t*          write_buf;
+
+	uint32_t          next_sector; // sequential patterns
+	uint32_t          random;
+	uint32_t          issued;
+	volatile uint32_t outstanding;
+	volatile uint32_t retired;
+
+	uint32_t          last_cycle;  // time is summed a completion at a time, so
+	uint64_t          elapsed_cyc; // the cycle counter can't wrap on us
+
+	uint32_t          cycles_per_us;
+
+	sd_bench_result_t* result;
+	uint32_t           hist[SD_BENCH_BUCKETS];
+
+	void     issue(int i);
+	void     complete(uint32_t sector, int err);
+	uint32_t next_random(void);
+	uint32_t percentile(uint32_t n, int percent);
+};
+
+#endif /* _BENCH_H */
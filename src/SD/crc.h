@@ -0,0 +1,17 @@
+#ifndef _CRC_H
+#define _CRC_H
+
+#include <cstdint>
+
+/*
+ * checksums used on the SD bus
+ */
+
+// commands: CRC7, returned in the top 7 bits with the end bit set, ready to
+// send as the last byte of the command
+uint8_t  sd_crc7(const void* data, int length);
+
+// data blocks: CRC16-CCITT, polynomial 0x1021, initial value 0
+uint16_t sd_crc16(const void* data, int length);
+
+#endif /* _CRC_H */
@@ -7,6 +7,7 @@
 #include <cstdio>
 #include <cstddef>
 #include <cstring>
+#include <cctype>
 
 #include <unistd.h>
 
@@ -41,6 +42,18 @@ const char* action_name(_fat_ioaction i)
 			return str(IOACTION_OPEN);
 		case IOACTION_READ_ONE:
 			return str(IOACTION_READ_ONE);
+		case IOACTION_WRITE_ONE:
+			return str(IOACTION_WRITE_ONE);
+		case IOACTION_SEEK:
+			return str(IOACTION_SEEK);
+		case IOACTION_SYNC:
+			return str(IOACTION_SYNC);
+		case IOACTION_CLOSE:
+			return str(IOACTION_CLOSE);
+		case IOACTION_OPENDIR:
+			return str(IOACTION_OPENDIR);
+		case IOACTION_READDIR:
+			return str(IOACTION_READDIR);
 		default:
 			return "?";
 	}
@@ -52,53 +65,110 @@ Fat::Fat()
 	fat_buf = dentry_buf = NULL;
 	work_queue = NULL;
 
-	fat_lba = dentry_lba = 0xFFFFFFFF;
+	passing       = 0;
+	rerun         = 0;
+	refused       = 0;
+	cache_failed  = 0;
+	alloc_owner   = NULL;
+	alloc_waiting = 0;
+
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+	{
+		cache[i].buf   = NULL;
+		cache[i].lba   = 0xFFFFFFFF;
+		cache[i].used  = 0;
+		cache[i].flags = 0;
+	}
+	cache_clock = 0;
+	cache_error = 0;
+	memset(&cache_stats, 0, sizeof(cache_stats));
+
+#if FAT_NAME_CACHE
+	memset(names, 0, sizeof(names));
+	name_clock = 0;
+#endif
 
 	fat_begin_lba       = 0;
 	cluster_begin_lba   = 0;
 	sectors_per_cluster = 0;
 	root_dir_sector     = 0;
+	root_dir_cluster    = 0;
+	root_dir_end        = 0;
 	fat_type            = 0;
+	fat_sectors         = 0;
+	max_cluster         = 0;
+	table               = NULL;
+
+	fsinfo_lba          = 0;
+	next_free           = 2;
+	free_count          = 0xFFFFFFFF;
+	alloc_left          = 0;
+	fsinfo_dirty        = 0;
+
+#if FAT_FREEMAP_BYTES
+	freemap             = NULL;
+	freemap_shift       = 0;
+	freemap_stale       = 0;
+	freemap_scanned     = 0;
+	freemap_lba         = 0;
+	freemap_end         = 0;
+#endif
 }
 
 void Fat::f_mount(_fat_mount_ioresult* w, SD* sd)
 {
-	if (fat_buf)
-		free(fat_buf);
-	if (dentry_buf && dentry_buf != fat_buf)
-		free(dentry_buf);
+	if (work_queue)
+	{
+		printf("Error! Already mounted and I/O in progress! umount first!\n");
+// 		f_umount();
+		exit(1);
+	}
 
 	this->sd = sd;
 
-// 	fat_buf = (uint8_t*) malloc(512);
-	fat_buf = (uint8_t*) AHB0.alloc(512);
-	fat_lba = -1;
+	// the buffers stay allocated across mounts, their contents don't
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+	{
+		if (cache[i].buf == NULL)
+			cache[i].buf = (uint8_t*) AHB0.alloc(512);
+		if (cache[i].buf == NULL)
+			cache[i].buf = (uint8_t*) AHB1.alloc(512);
+		cache[i].lba   = 0xFFFFFFFF;
+		cache[i].flags = 0;
+	}
 
-// 	dentry_buf = (uint8_t*) malloc(512);
-// 	dentry_buf = fat_buf;
-	dentry_buf = (uint8_t*) AHB0.alloc(512);
-	dentry_lba = -1;
+	fat_begin_lba     = 0;
+	cluster_begin_lba = 0;
+	root_dir_sector   = 0;
+	fat_type          = 0;
+
+	fsinfo_lba        = 0;
+	next_free         = 2;
+	free_count        = 0xFFFFFFFF;
+	alloc_left        = 0;
+	fsinfo_dirty      = 0;
+	cache_error       = 0;
+
+#if FAT_NAME_CACHE
+	memset(names, 0, sizeof(names));
+#endif
+
+#if FAT_FREEMAP_BYTES
+	// a scan can't be called back, so whatever's left of it is thrown away
+	freemap_stale     = (freemap_end != 0);
+	freemap_scanned   = 0;
+	freemap_lba       = 0;
+#endif
 
 	w->action   = IOACTION_MOUNT;
 	w->lba      = 0;
-	w->buffer   = dentry_buf;
-	w->buflen   = 512;
+	w->buffer   = NULL;
+	w->buflen   = 0;
 	w->owner    = NULL;
 	w->ready    = 1;
-	w->fini     = 0;
-	w->next     = NULL;
 	w->stage    = FAT_MOUNT_STAGE_SUPERBLOCK;
 
-	if (work_queue)
-	{
-		printf("Error! Already mounted and I/O in progress! umount first!\n");
-// 		f_umount();
-		exit(1);
-	}
-
-	work_queue = w;
-
-	this->sd->begin_read(w->lba, 1, w->buffer, this);
+	enqueue(w);
 }
 
 int Fat::f_mounted()
@@ -116,6 +186,15 @@ int Fat::f_mounted()
 	return 1;
 }
 
+int Fat::f_freemap_complete()
+{
+#if FAT_FREEMAP_BYTES
+	return f_mounted() && freemap && (freemap_scanned >= max_cluster);
+#else
+	return 0;
+#endif
+}
+
 uint32_t Fat::cluster_to_lba(uint32_t cluster)
 {
 	return cluster_begin_lba + (cluster - 2) * sectors_per_cluster;
@@ -126,41 +205,50 @@ uint32_t Fat::lba_to_cluster(uint32_t lba)
 	return (lba - cluster_begin_lba) / sectors_per_cluster + 2;
 }
 
+/*
+ * the queue and everything process_buffer() works from belong to the card's
+ * interrupt, which calls us back. Anyone else only gets to add to the end
+ * of the queue, and has the interrupt start it
+ */
 void Fat::enqueue(_fat_ioresult* ior)
 {
-	queue_walk();
+	uint32_t irq = irq_save();
 
-	// TODO: atomic
 	_fat_ioresult* w = work_queue;
-	ior->next = NULL;
-	ior->fini = 0;
-	if (w)
+	while (w)
 	{
-		while (w->next)
-		{
-			if (w == ior)
-				return;
-			w = w->next;
-		}
 		if (w == ior)
+		{
+			irq_restore(irq);
 			return;
-		w->next = ior;
+		}
+		if (w->next == NULL)
+			break;
+		w = w->next;
 	}
-	else
-	{
-		work_queue = w = ior;
 
-		if ((w->lba == dentry_lba) && (w->buffer == dentry_buf))
-			process_buffer(w->buffer, w->lba);
-		else if ((w->lba == fat_lba) && (w->buffer == fat_buf))
-			process_buffer(w->buffer, w->lba);
-		else
-			sd->begin_read(w->lba, 1, w->buffer, this);
+	ior->next  = NULL;
+	ior->fini  = 0;
+	ior->error = FAT_ERR_NONE;
 
-		// else do nothing
-	}
+	if (w)
+		w->next = ior;
+	else
+		work_queue = ior;
+
+	irq_restore(irq);
 
+#ifdef FATDEBUG
 	queue_walk();
+#endif
+
+	// it starts from sd_wake() if there's room for it
+	sd->wake(this);
+}
+
+void Fat::sd_wake(SD*)
+{
+	process_buffer(NULL, 0xFFFFFFFF);
 }
 
 void Fat::dequeue(_fat_ioresult* w)
@@ -170,7 +258,7 @@ void Fat::dequeue(_fat_ioresult* w)
 	else
 	{
 		_fat_ioresult* j = work_queue;
-		while (j->next && j->next != w)
+		while (j && j->next != w)
 			j = j->next;
 		if (j)
 			j->next = w->next;
@@ -179,494 +267,2458 @@ void Fat::dequeue(_fat_ioresult* w)
 	w->fini = 1;
 }
 
+// w is done, one way or another. Tell its owner and get the next one going
+void Fat::complete(_fat_ioresult* w)
+{
+	dequeue(w);
+
+	if (alloc_owner == w)
+		alloc_owner = NULL;
+
+	if (w->owner)
+		w->owner->_fat_io(w);
+
+	process_buffer(NULL, 0xFFFFFFFF);
+
+#if FAT_FREEMAP_BYTES
+	freemap_read();
+#endif
+}
+
 int  Fat::f_open( _fat_file_ioresult* ior, const char* path)
 {
+	return open_path(ior, path, IOACTION_OPEN);
+}
+
+int Fat::open_path(_fat_file_ioresult* ior, const char* path, uint8_t action)
+{
+	if (f_mounted() == 0)
+		return -1;
+
 	// skip leading slash
 	while (path[0] == '/')
 		path++;
 
 	int l = strlen(path);
 	ior->file.path = (char*) malloc(l + 1);
-	strncpy(ior->file.path, path, l);
+	memcpy(ior->file.path, path, l + 1);
 
-	ior->action    = IOACTION_OPEN;
-	ior->ready     = 1;
-	if (ior->buffer == NULL)
-	{
-		ior->buffer    = dentry_buf;
-		ior->buflen    = 512;
-	}
-	ior->lba       = root_dir_sector;
+	ior->action        = action;
+	ior->ready         = 1;
+	ior->lba           = root_dir_sector;
+	ior->path_traverse = 0;
+	ior->lfn_seq       = 0;
 
 	ior->file.root_cluster     = 0;
-	ior->file.direntry_cluster = 0;
+	ior->file.direntry_cluster = root_dir_cluster;
 	ior->file.direntry_index   = 0;
 	ior->file.current_cluster  = 0;
 	ior->file.byte_in_cluster  = 0;
+	ior->file.cluster_index    = 0;
 	ior->file.pathname_traversed_bytes = 0;
+	ior->file.n_extents        = 0;
+	ior->file.extent_clusters  = 0;
+	ior->file.extent_end       = 0;
+	ior->file.dirty            = 0;
 
-	ior->next = NULL;
-
-	printf("FAT: Open %s\n", path);
+	FDEBUG("FAT: Open %s\n", path);
 	enqueue(ior);
 
 	return 0;
 }
 
+/*
+ * buflen must be a whole number of sectors. At the end of the file it's cut
+ * down to the bytes actually read
+ */
 int  Fat::f_read_block( _fat_file_ioresult* ior, void* buffer, uint32_t buflen)
 {
-	printf("FAT: READ %s (%p)!\n", ior->file.path, ior);
+	FDEBUG("FAT: READ %s (%p)!\n", ior->file.path, ior);
 
 	ior->action = IOACTION_READ_ONE;
+	ior->ready  = 1;
+
+	uint32_t pos = ior->file.cluster_index * (sectors_per_cluster << 9) + ior->file.byte_in_cluster;
+	if (pos >= ior->file.size)
+		buflen = 0;
+	else if (buflen > ior->file.size - pos)
+		buflen = ior->file.size - pos;
 
 	ior->buffer = (uint8_t*) buffer;
 	ior->buflen = buflen;
 
-	if (ior->file.byte_in_cluster >= 512 * sectors_per_cluster)
-	{
-		if (fat_cache(fat_begin_lba + (ior->file.current_cluster >> 7)))
-		{
-			ior->file.current_cluster = ((uint32_t*) fat_buf)[ior->file.current_cluster & 0x7F];
-			ior->file.cluster_index++;
-			ior->file.byte_in_cluster -= (512 * sectors_per_cluster);
-		}
-	}
-
 	ior->bytes_remaining = ior->buflen;
 
-	ior->lba    = cluster_to_lba(ior->file.current_cluster) + (ior->file.byte_in_cluster >> 9);
-
 	enqueue(ior);
 
 	return 0;
 }
 
-int  Fat::f_write_block(_fat_file_ioresult* ior, void* buffer, uint32_t buflen)
+/*
+ * move to offset, or to the end of the file if it's further. Only needs the
+ * FAT for the part of the chain the file's extent map hasn't seen yet
+ */
+int  Fat::f_seek( _fat_file_ioresult* ior, uint32_t offset)
 {
-	printf("f_write: unimplementeed\n");
+	if (offset > ior->file.size)
+		offset = ior->file.size;
+
+	ior->action  = IOACTION_SEEK;
+	ior->ready   = 1;
+	ior->seek_to = offset;
+
+	enqueue(ior);
+
 	return 0;
 }
 
-int  Fat::f_close(_fat_file_ioresult* ior)
+/*
+ * write buflen bytes at the current position, growing the file if they go
+ * past its end. The data goes straight from buffer to the card a sector at
+ * a time, so buffer must run on to a sector boundary: a short last sector
+ * is written whole, though only buflen counts towards the size
+ *
+ * returns -1 unless the position is on a sector boundary. The new size
+ * reaches the directory entry on f_sync() or f_close()
+ */
+int  Fat::f_write_block(_fat_file_ioresult* ior, void* buffer, uint32_t buflen)
 {
+	if (ior->file.byte_in_cluster & 511)
+		return -1;
+
+	FDEBUG("FAT: WRITE %s (%p)!\n", ior->file.path, ior);
+
+	ior->action = IOACTION_WRITE_ONE;
+	ior->ready  = 1;
+
+	ior->buffer = (uint8_t*) buffer;
+	ior->buflen = buflen;
+
+	ior->bytes_remaining = ior->buflen;
+
+	enqueue(ior);
+
 	return 0;
 }
 
-// void Fat::_sd_callback(_sd_work_stack* w)
-void Fat::sd_read_complete(SD*, uint32_t sector, void* buf, int err)
+/*
+ * a file that's been written to has its directory entry brought up to date
+ * first. Returns 1 if that's been queued, and the file's closed once fini
+ * is set, otherwise 0 and it's closed already
+ */
+int  Fat::f_close(_fat_file_ioresult* ior)
 {
-	if (err == 0)
+	if (ior->file.dirty)
 	{
-		printf("FAT: lba %lu read ok\n", sector);
-
-		process_buffer((uint8_t*) buf, sector);
-
-		printf("FAT: end process lba %lu\n", sector);
-		return;
+		ior->action = IOACTION_CLOSE;
+		ior->ready  = 1;
+		enqueue(ior);
+		return 1;
 	}
 
-	printf("FAT: lba %lu read ERROR!\n", sector);
-}
+	free(ior->file.path);
+	ior->file.path = NULL;
 
-void Fat::sd_write_complete(SD*, uint32_t sector, void* buf, int err)
-{
-	// TODO:
+	return 0;
 }
 
-void Fat::process_buffer(uint8_t* buffer, uint32_t lba)
+int  Fat::f_sync(_fat_file_ioresult* ior)
 {
-	printf("FAT: --PROCBUF-- (%p lba %lu)\n", buffer, lba);
+	ior->action = IOACTION_SYNC;
+	ior->ready  = 1;
 
-	for (int i = 0; i < 512; i++)
-	{
-		printf("0x%X%c", buffer[i], ((i & 31) == 31)?'\n':' ');
-	}
+	enqueue(ior);
 
-	if (work_queue == NULL)
-		return;
+	return 0;
+}
 
-	_fat_ioresult* w = work_queue;
+int  Fat::f_opendir(_fat_dir_ioresult* ior, const char* path)
+{
+	return open_path(ior, path, IOACTION_OPENDIR);
+}
 
-	if (buffer == fat_buf)
-		fat_lba = lba;
-	if (buffer == dentry_buf)
-		dentry_lba = lba;
+int  Fat::f_readdir(_fat_dir_ioresult* ior, _fat_dirreceiver* reader)
+{
+	ior->action  = IOACTION_READDIR;
+	ior->ready   = 1;
+	ior->reader  = reader;
+	ior->at_end  = 0;
+	ior->lfn_seq = 0;
+
+	// back to the start. The extent map's kept, so a second listing needn't
+	// look at the FAT
+	ior->file.current_cluster = ior->file.root_cluster;
+	ior->file.cluster_index   = 0;
+	ior->file.byte_in_cluster = 0;
+	ior->lba = ior->file.root_cluster?cluster_to_lba(ior->file.root_cluster):root_dir_sector;
 
-	printf("FAT: action is %u (%s)\n", w->action, action_name((_fat_ioaction) w->action));
+	enqueue(ior);
 
-	switch(w->action)
-	{
-		case IOACTION_MOUNT:
-			ioaction_mount((_fat_mount_ioresult*) w, buffer, lba);
-			break;
-		case IOACTION_OPEN:
-			ioaction_open((_fat_file_ioresult*) w, buffer, lba);
-			break;
-		case IOACTION_READ_ONE:
-			ioaction_read_one((_fat_file_ioresult*) w, buffer, lba);
-			break;
-	}
+	return 0;
 }
 
-void Fat::ioaction_mount(_fat_mount_ioresult* w, uint8_t* buffer, uint32_t lba)
+int  Fat::f_closedir(_fat_dir_ioresult* ior)
 {
-	while ((w->stage == FAT_MOUNT_STAGE_ROOT_DIR) && (lba >= root_dir_sector) && (lba <= w->root_dir_end))
-	{
-		printf("FAT: got Root Dir at LBA %lu, searching for Volume Label\n", lba);
-		_fat_direntry* d = (_fat_direntry*) buffer;
-		// TODO: don't assume that volume label is in first sector of root cluster
-		for (int i = 0; i < 16; i++)
-		{
-			if ((d[i].name[0] == 0) || (w->lba >= w->root_dir_end))
-			{
-				printf("FAT: mount succeeded! End of Root Dir, no label found\n");
-				w->label[0] = 0;
-				w->fini = 1;
-				dequeue(w);
-				return;
-			}
+	free(ior->file.path);
+	ior->file.path = NULL;
 
-			if (d[i].attr == 0x0F)
-			{
-				char name[14];
-				// LFN entry
-				_fat_lfnentry* lfn = (_fat_lfnentry*) &d[i];
-				for (int j = 0; j < 13; j++)
-				{
-					if ((j >= 0) && (j <= 4))
-						name[j] = lfn->name0[j];
-					if ((j >= 5) && (j <= 10))
-						name[j] = lfn->name1[j - 5];
-					if ((j >= 11) && (j <= 12))
-						name[j] = lfn->name2[j - 11];
-					if ((name[j] > 127) || (name[j] < 32))
-						name[j] = '?';
-				}
-				name[13] = 0;
-				if (d[i].name[0] == 0xE5)
-					printf("\tLFN:     %s [deleted]\n", name);
-				else
-					printf("\tLFN: (%d) %s %s\n", lfn->sequence, name, (lfn->final?"[last]":""));
-			}
-			else
-			{
-				char name[12];
-				// normal entry
-				for (int j = 0; j < 11; j++)
-				{
-					name[j] = d[i].name[j];
-					if ((name[j] > 127) || (name[j] < 32))
-						name[j] = '?';
-				}
-				name[11] = 0;
-				printf("\t%s, attr: 0x%X, cluster: %lu, size: %lub %s\n", name, d[i].attr, (((uint32_t) d[i].ch) << 16) | d[i].cl, d[i].size, (d[i].name[0] == 0xE5)?"[deleted]":"");
-			}
+	return 0;
+}
 
-			if (d[i].attr == 0x08)
-			{
-				memcpy(w->label, d[i].name, 11);
-				w->label[11] = 0;
-				w->fini = 1;
+const fat_cache_stats_t* Fat::get_cache_stats()
+{
+	return &cache_stats;
+}
 
-				printf("FAT: mount succeeded! label is %s\n", w->label);
+// void Fat::_sd_callback(_sd_work_stack* w)
+void Fat::sd_read_complete(SD*, uint32_t sector, void* buf, int err)
+{
+	int cached = 0;
 
-				dequeue(w);
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+	{
+		if (cache[i].buf != buf)
+			continue;
 
-				return;
-			}
-		}
+		cached = 1;
 
-		w->lba++;
+		cache[i].flags &= ~FAT_CACHE_READING;
+		if (err == 0)
+			cache[i].flags |= FAT_CACHE_VALID;
+		else
+			cache[i].flags |= FAT_CACHE_FAILED;
+	}
 
-		if (dentry_cache(w->lba) == 0) return;
+#if FAT_FREEMAP_BYTES
+	// the map's scan comes in the driver's own buffers
+	if ((cached == 0) && freemap_end && (sector >= fat_begin_lba) && (sector <= freemap_end))
+	{
+		freemap_block(sector, buf, err);
+		return;
 	}
 
-	_fat_bootblock* bootblock = (_fat_bootblock*) buffer;
+	freemap_read();
+#endif
 
-	if (bootblock->magic != 0xAA55)
+	if (err)
+		printf("FAT: lba %lu read ERROR!\n", sector);
+
+	// whoever's waiting for a cached sector finds out for themselves,
+	// including that it couldn't be read
+	if (cached)
 	{
-		printf("bad magic at LBA %lu, corrupt disk?\n", lba);
+		process_buffer(NULL, 0xFFFFFFFF);
 		return;
 	}
 
-	printf("FAT: magic ok, trying partition table\n");
-	for (int i = 0; i < 4; i++)
+	if (err == 0)
 	{
-		printf("FAT: Partition table %u:\n\ttype: %X\n\tlba_begin: %lu\n\tn_sectors: %lu\n\tend: %lu\n\tdisk blocks: %lu\n",
-			i,
-			bootblock->partition[i].type,
-			bootblock->partition[i].lba_begin,
-			bootblock->partition[i].n_sectors,
-			bootblock->partition[i].lba_begin + bootblock->partition[i].n_sectors,
-			sd->n_sectors()
-		);
-		if (
-			(
-				bootblock->partition[i].type == 0x01 ||
-				bootblock->partition[i].type == 0x04 ||
-				bootblock->partition[i].type == 0x06 ||
-				bootblock->partition[i].type == 0x0B ||
-				bootblock->partition[i].type == 0x0C ||
-				bootblock->partition[i].type == 0x0E ||
-				bootblock->partition[i].type == 0x0F
-			) &&
-			bootblock->partition[i].lba_begin < sd->n_sectors() &&
-			bootblock->partition[i].n_sectors + bootblock->partition[i].lba_begin <= sd->n_sectors()
-		)
-		{
-			printf("FAT: Found a partition!\n");
+		FDEBUG("FAT: lba %lu read ok\n", sector);
 
-			if (dentry_cache(bootblock->partition[i].lba_begin) == 0) return;
-		}
-	}
+		process_buffer((uint8_t*) buf, sector);
 
-	printf("FAT: didn't look like a partition table, trying FAT superblock\n");
+		FDEBUG("FAT: end process lba %lu\n", sector);
+		return;
+	}
 
-	_fat_volid*   volid     = (_fat_volid  *) buffer;
+	_fat_ioresult* w = claimant((uint8_t*) buf, sector);
+	if (w)
+	{
+		// a directory listing's stream is in the driver's buffers, and it
+		// stops here
+		if (buf && (w->action == IOACTION_READDIR))
+			sd->clean_buffer(buf);
+
+		w->ready = 1;
+		w->error = FAT_ERR_IO;
+		complete(w);
+	}
+}
 
-	uint32_t nsec   = (volid->total_sectors)?volid->total_sectors:volid->total_sectors_32;
-	uint32_t nclust = nsec / volid->sectors_per_cluster;
+void Fat::sd_write_complete(SD*, uint32_t sector, void* buf, int err)
+{
+	int cached = 0;
 
-	printf("FAT: superblock:\n\tid: %c%c%c%c%c%c%c%c\n\tbytes_per_sector: %u\n\tn_fats: %u\n\tsectors_per_cluster: %u\n\tn_reserved_sectors: %u\n\tsectors_per_fat: %u\n\t\n\thidden_sectors: %lu\n\ttotal_sectors: %lu (%luMB)\n",
-			volid->oem_id[0],volid->oem_id[1],volid->oem_id[2],volid->oem_id[3],volid->oem_id[4],volid->oem_id[5],volid->oem_id[6],volid->oem_id[7],
-		volid->bytes_per_sector,
-		volid->num_fats,
-		volid->sectors_per_cluster,
-		volid->num_boot_sectors,
-		volid->sectors_per_fat,
-		volid->hidden_sectors,
-		nsec,
-		nsec / 2048
-	);
+#if FAT_FREEMAP_BYTES
+	// in case the scan couldn't get a request in last time
+	freemap_read();
+#endif
 
-	if (volid->bytes_per_sector == 512 &&
-		volid->num_fats == 2             &&
-		(	volid->sectors_per_cluster == 1   ||
-			volid->sectors_per_cluster == 2   ||
-			volid->sectors_per_cluster == 4   ||
-			volid->sectors_per_cluster == 8   ||
-			volid->sectors_per_cluster == 16  ||
-			volid->sectors_per_cluster == 32  ||
-			volid->sectors_per_cluster == 64  ||
-			volid->sectors_per_cluster == 128
-		) &&
-		(nsec <= sd->n_sectors())
-	)
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
 	{
-		fat_type = 12;
-		if (nclust >= 4086U)
-			fat_type = 16;
-		if (nclust >= 65526U)
-			fat_type = 32;
-
-		printf("FAT: Found a FAT%d superblock!\n", fat_type);
-		// looks like a volid
+		if (cache[i].buf != buf)
+			continue;
 
-		fat_begin_lba       = lba + volid->num_boot_sectors;
-		sectors_per_cluster = volid->sectors_per_cluster;
-// 		bytes_per_sector    = volid->bytes_per_sector;
+		cached = 1;
 
-		if (fat_type == 32)
-		{
-			uint32_t nsec_per_fat = volid->fat32.sectors_per_fat_32;
-			cluster_begin_lba     = lba + volid->num_boot_sectors + (volid->num_fats * nsec_per_fat);
-			root_dir_sector       = cluster_to_lba(volid->fat32.root_dir_cluster);
-			w->root_dir_end       = cluster_to_lba(volid->fat32.root_dir_cluster + 1) - 1;
-
-			printf("\tSectors per fat: %lu\n", nsec_per_fat);
-			printf("\tRoot dir cluster: %lu (LBA:%lu)\n", volid->fat32.root_dir_cluster, root_dir_sector);
-			printf("\tCluster begin LBA: %lu\n", lba + volid->num_boot_sectors + (volid->num_fats * nsec_per_fat));
-		}
+		if (sector == cache[i].lba)
+			cache[i].flags &= ~FAT_CACHE_WRITING;
 		else
+			cache[i].flags &= ~FAT_CACHE_MIRROR;
+
+		if (err)
 		{
-			uint32_t nsec_per_fat = volid->sectors_per_fat;
-			root_dir_sector       = lba + volid->num_boot_sectors + (volid->num_fats * nsec_per_fat);
-			cluster_begin_lba     = root_dir_sector + (volid->num_root_dir_ents / 16);
-			w->root_dir_end       = cluster_begin_lba - 1;
+			printf("FAT: lba %lu write ERROR!\n", sector);
+			cache[i].flags |= FAT_CACHE_DIRTY;
+			cache_error = 1;
 		}
+	}
 
-		w->stage = FAT_MOUNT_STAGE_ROOT_DIR;
-		w->lba = root_dir_sector;
+	if (cached)
+	{
+		// anything waiting for a cache entry to come free can have another go
+		process_buffer(NULL, 0xFFFFFFFF);
+		return;
+	}
 
-		if (dentry_cache(w->lba) == 0) return;
+	// otherwise it's file data, from the buffer of whoever's writing it
+	if (err == 0)
+	{
+		process_buffer((uint8_t*) buf, sector);
+		return;
 	}
 
-	printf("did not recognise disk image: looks like neither FAT volid or partition table.\n");
-	dequeue(w);
-	return;
+	printf("FAT: lba %lu write ERROR!\n", sector);
+
+	_fat_ioresult* w = claimant((uint8_t*) buf, sector);
+	if (w)
+	{
+		w->ready = 1;
+		w->error = FAT_ERR_IO;
+		complete(w);
+	}
 }
 
-void Fat::ioaction_open(_fat_file_ioresult* w, uint8_t* buffer, uint32_t lba)
+/*
+ * a block of file data has arrived, or buffer is NULL and everything that's
+ * started wants a look anyway. Actions pick up from wherever they left off,
+ * so running one again for something it isn't waiting on does no harm
+ *
+ * a pass runs the first FAT_ACTIVE items in turn, oldest first. Anything
+ * that changes the queue while one's running, an item finishing or a new
+ * one arriving, has the pass start over once that item returns
+ *
+ * only the card's interrupt is ever in here, with its callbacks and
+ * sd_wake(). So a buffer can't turn up in the middle of a pass, and passing
+ * needn't be atomic
+ */
+void Fat::process_buffer(uint8_t* buffer, uint32_t lba)
 {
-	// in f_open, we pre-request the root dir
-	// so now we're free to scan each direntry and traverse as necessary
-
-	// scan for file of interest
+	FDEBUG("FAT: --PROCBUF-- (%p lba %lu)\n", buffer, lba);
 
-	char* fn = w->file.path + w->file.pathname_traversed_bytes;
-	char matchname[14];
-	int i, j;
-	uint8_t dir = 0;
-	for (i = 0, j = 0; i < 11; i++, j++)
+	if (buffer == NULL)
 	{
-		if (fn[i] == '/')
-		{
-			dir = i;
-			break;
-		}
-		if (fn[i] == '.')
-		{
-			for (;i < 8; i++)
-				matchname[i] = 32;
-			i--;
-		}
-		else
-			matchname[i] = fn[j];
+		rerun = 1;
+		if (passing)
+			return;
 	}
-	matchname[i] = 0;
 
-	printf("FAT: Matchname is '%s'\n", matchname);
+	// someone couldn't get a request in last time, and something's just
+	// finished
+	if (refused)
+		rerun = 1;
 
-	dump_buffer(buffer);
+	int outer = (passing == 0);
+	passing = 1;
 
-	_fat_direntry* d = (_fat_direntry*) buffer;
-	_fat_lfnentry* l = (_fat_lfnentry*) buffer;
-	int lfn_match = 0;
-	for (i = 0; i < 16 && d[i].name[0] != 0; i++)
+	if (buffer)
 	{
-		if (dir == 0 && (d[i].attr & 0x1F) == 0 && d[i].name[0] != 0xE5)
-		{
-			// FILE entry
-			printf("checking '%s' vs '%s'(%d): %d\n", matchname, d[i].name, d[i].attr, strncasecmp(matchname, (char*) d[i].name, 11));
-			if (strncasecmp(matchname, (char*) d[i].name, 11) == 0 || lfn_match)
-			{
-				// found it!
-				printf("Found! First cluster: %u, size: %lub\n", (d[i].ch << 16) | d[i].cl, d[i].size);
-
-				w->action                = IOACTION_READ_ONE;
-
-				w->file.direntry_cluster = lba_to_cluster(lba);
-				w->file.direntry_index   = i;
-
-				w->file.root_cluster     = (d[i].ch << 16) | d[i].cl;
-
-				w->file.current_cluster  = w->file.root_cluster;
-				w->file.byte_in_cluster  = 0;
-				w->file.cluster_index    = 0;
-
-				w->file.size             = d[i].size;
+		_fat_ioresult* w = claimant(buffer, lba);
+		if (w)
+			run(w, buffer, lba);
+	}
 
-				w->lba                   = cluster_to_lba(w->file.root_cluster);
+	if (outer == 0)
+		return;
 
-				dequeue(w);
+	while (rerun)
+	{
+		rerun   = 0;
+		refused = 0;
 
-				break;
-			}
-		}
-		// 				else if (d[i].attr & 0x8)
-		// 				{
-		// VOLUME LABEL
-		// 				}
-		else if (dir == 0 && d[i].attr == 0xF)
-		{
-			// LFN entry
-			if (l[i].final || lfn_match)
-			{
-// 				char lfn[14];
-// 				lfn[0]  = l[i].name0[0];
-// 				lfn[1]  = l[i].name0[1];
-// 				lfn[2]  = l[i].name0[2];
-// 				lfn[3]  = l[i].name0[3];
-// 				lfn[4]  = l[i].name0[4];
-// 				lfn[5]  = l[i].name1[0];
-// 				lfn[6]  = l[i].name1[1];
-// 				lfn[7]  = l[i].name1[2];
-// 				lfn[8]  = l[i].name1[3];
-// 				lfn[9]  = l[i].name1[4];
-// 				lfn[10] = l[i].name1[5];
-// 				lfn[11] = l[i].name2[0];
-// 				lfn[12] = l[i].name2[1];
-// 				lfn[13] = 0;
-//
-// 				int off = (l[i].sequence - 1) * 13;
-			}
-		}
-		else if (dir == 1 && d[i].attr & 0x10)
+		_fat_ioresult* w = work_queue;
+		for (int n = 0; w && (n < FAT_ACTIVE); n++)
 		{
-			// FOLDER entry
-			if (strncasecmp(matchname, (char*) d[i].name, 11) == 0 || lfn_match)
-			{
-				w->file.pathname_traversed_bytes += dir + 1;
-
-				w->file.direntry_cluster = (d[i].ch << 16) | d[i].cl;
-
-				w->lba = cluster_to_lba(w->file.direntry_cluster);
+			run(w, NULL, 0xFFFFFFFF);
+			if (rerun)
+				break;
 
-				if (dentry_cache(cluster_to_lba(w->file.direntry_cluster)) == 0) return;
-			}
+			// a mount changes everything the others would be working from
+			if (w->action == IOACTION_MOUNT)
+				break;
+			w = w->next;
 		}
 	}
-}
 
-void Fat::ioaction_read_one(_fat_file_ioresult* w, uint8_t* buffer, uint32_t lba)
-{
-	if (w->file.byte_in_cluster >= 512 * sectors_per_cluster)
+	// everyone who wanted a sector that couldn't be read has been told
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
 	{
-		if (fat_cache(fat_begin_lba + (w->file.current_cluster >> 7)))
+		if (cache[i].flags & FAT_CACHE_FAILED)
 		{
-			w->file.current_cluster = ((uint32_t*) fat_buf)[w->file.current_cluster & 0x7F];
-			w->file.cluster_index++;
-			w->file.byte_in_cluster -= (512 * sectors_per_cluster);
+			cache[i].lba   = 0xFFFFFFFF;
+			cache[i].flags = 0;
 		}
-		else
-			return;
 	}
 
-	uint32_t l = cluster_to_lba(w->file.current_cluster) + (w->file.byte_in_cluster >> 9);
-
-	if (l == lba)
-	{
-		w->file.byte_in_cluster += 512;
-		w->bytes_remaining -= 512;
-		if (w->bytes_remaining == 0)
-			dequeue(w);
-			if (w->owner)
-				w->owner->_fat_io(w);
-	}
+	passing = 0;
 }
 
-void Fat::queue_walk()
+_fat_ioresult* Fat::claimant(uint8_t* buffer, uint32_t lba)
 {
-	printf("FAT: Queue walk\n");
-	_fat_ioresult* j = work_queue;
-	while (j)
+	_fat_ioresult* w = work_queue;
+	for (int n = 0; w && (n < FAT_ACTIVE); n++, w = w->next)
 	{
-		printf("FAT: Queue item %p:\n\taction : %d (%s)\n\tbuffer : %p\n\tbuflen : %lu\n\tcluster: %lu\n\tlba    : %lu\n\towner  : %p\n\tnext   : %p\n", j, j->action, action_name((_fat_ioaction) j->action), j->buffer, j->buflen, lba_to_cluster(j->lba), j->lba, j->owner, j->next);
-		j = j->next;
+		// only reads, writes and listings wait on transfers of their own
+		if (w->ready)
+			continue;
+
+		_fat_file_ioresult* f = (_fat_file_ioresult*) w;
+		if ((lba < w->lba) || (lba > f->run_end))
+			continue;
+
+		// file data goes to and from the caller's buffer, a listing
+		// streams through the driver's. Two of those reading the same
+		// sectors can take each other's, as they're the same
+		if ((w->action == IOACTION_READDIR) || (buffer == NULL) ||
+			((buffer >= w->buffer) && (buffer < w->buffer + w->buflen)))
+			return w;
 	}
-	printf("FAT: end queue\n");
+	return NULL;
 }
 
-int Fat::fat_cache(uint32_t lba)
+int Fat::shared()
 {
-	printf("Fat cache: %s on %lu\n", (fat_lba == lba)?"hit":"miss", lba);
-
-	if (fat_lba == lba)
-		return 1;
-
-	sd->begin_read(lba, 0, fat_buf, this);
-
-	return 0;
+	return work_queue && work_queue->next;
 }
 
-int Fat::dentry_cache(uint32_t lba)
+void Fat::run(_fat_ioresult* w, uint8_t* buffer, uint32_t lba)
 {
-	printf("Dentry cache: %s on %lu\n", (dentry_lba == lba)?"hit":"miss", lba);
-
-	if (dentry_lba == lba)
-		return 1;
+	cache_failed = 0;
 
-	sd->begin_read(lba, 1, dentry_buf, this);
+	FDEBUG("FAT: action is %u (%s)\n", w->action, action_name((_fat_ioaction) w->action));
 
-	return 0;
+	switch(w->action)
+	{
+		case IOACTION_MOUNT:
+			ioaction_mount((_fat_mount_ioresult*) w, buffer, lba);
+			break;
+		case IOACTION_OPEN:
+		case IOACTION_OPENDIR:
+			ioaction_open((_fat_file_ioresult*) w, buffer, lba);
+			break;
+		case IOACTION_READ_ONE:
+			ioaction_read_one((_fat_file_ioresult*) w, buffer, lba);
+			break;
+		case IOACTION_WRITE_ONE:
+			ioaction_write_one((_fat_file_ioresult*) w, buffer, lba);
+			break;
+		case IOACTION_SEEK:
+			ioaction_seek((_fat_file_ioresult*) w, buffer, lba);
+			break;
+		case IOACTION_SYNC:
+		case IOACTION_CLOSE:
+			ioaction_sync((_fat_file_ioresult*) w, buffer, lba);
+			break;
+		case IOACTION_READDIR:
+			ioaction_readdir((_fat_dir_ioresult*) w, buffer, lba);
+			break;
+	}
+
+	if (cache_failed && (w->fini == 0))
+	{
+		cache_failed = 0;
+		w->error = FAT_ERR_IO;
+		complete(w);
+	}
+}
+
+void Fat::ioaction_mount(_fat_mount_ioresult* w, uint8_t* buffer, uint32_t lba)
+{
+	for (;;)
+	{
+		if (dentry_cache(w->lba) == 0)
+			return;
+
+		buffer = dentry_buf;
+		lba    = w->lba;
+
+		if (w->stage == FAT_MOUNT_STAGE_FSINFO)
+		{
+			_fat_fsinfo* fsinfo = (_fat_fsinfo*) buffer;
+
+			if ((fsinfo->lead_sig == 0x41615252) && (fsinfo->struct_sig == 0x61417272))
+			{
+				// only hints, so ignore anything that can't be right
+				if ((fsinfo->next_free >= 2) && (fsinfo->next_free < max_cluster))
+					next_free = fsinfo->next_free;
+				if (fsinfo->free_count <= max_cluster - 2)
+					free_count = fsinfo->free_count;
+
+				FDEBUG("FAT: FSInfo: next free %lu, %lu free\n", fsinfo->next_free, fsinfo->free_count);
+			}
+			else
+			{
+				// not one we'll be writing back
+				fsinfo_lba = 0;
+			}
+
+			w->stage = FAT_MOUNT_STAGE_ROOT_DIR;
+			w->lba   = root_dir_sector;
+			continue;
+		}
+
+		if (w->stage == FAT_MOUNT_STAGE_ROOT_DIR)
+		{
+			FDEBUG("FAT: got Root Dir at LBA %lu, searching for Volume Label\n", lba);
+			_fat_direntry* d = (_fat_direntry*) buffer;
+			// TODO: don't assume that volume label is in first cluster of root dir
+			for (int i = 0; i < 16; i++)
+			{
+				if (d[i].name[0] == 0)
+				{
+					printf("FAT: mount succeeded! End of Root Dir, no label found\n");
+					w->label[0] = 0;
+					complete(w);
+					return;
+				}
+
+#ifdef FATDEBUG
+				if (d[i].attr == 0x0F)
+				{
+					char name[14];
+					// LFN entry
+					_fat_lfnentry* lfn = (_fat_lfnentry*) &d[i];
+					for (int j = 0; j < 13; j++)
+					{
+						if ((j >= 0) && (j <= 4))
+							name[j] = lfn->name0[j];
+						if ((j >= 5) && (j <= 10))
+							name[j] = lfn->name1[j - 5];
+						if ((j >= 11) && (j <= 12))
+							name[j] = lfn->name2[j - 11];
+						if ((name[j] > 127) || (name[j] < 32))
+							name[j] = '?';
+					}
+					name[13] = 0;
+					if (d[i].name[0] == 0xE5)
+						printf("\tLFN:     %s [deleted]\n", name);
+					else
+						printf("\tLFN: (%d) %s %s\n", lfn->sequence, name, (lfn->final?"[last]":""));
+				}
+				else
+				{
+					char name[12];
+					// normal entry
+					for (int j = 0; j < 11; j++)
+					{
+						name[j] = d[i].name[j];
+						if ((name[j] > 127) || (name[j] < 32))
+							name[j] = '?';
+					}
+					name[11] = 0;
+					printf("\t%s, attr: 0x%X, cluster: %lu, size: %lub %s\n", name, d[i].attr, (((uint32_t) d[i].ch) << 16) | d[i].cl, d[i].size, (d[i].name[0] == 0xE5)?"[deleted]":"");
+				}
+#endif
+
+				if (d[i].attr == 0x08)
+				{
+					memcpy(w->label, d[i].name, 11);
+					w->label[11] = 0;
+
+					printf("FAT: mount succeeded! label is %s\n", w->label);
+
+					complete(w);
+
+					return;
+				}
+			}
+
+			if (w->lba >= root_dir_end)
+			{
+				printf("FAT: mount succeeded! End of Root Dir, no label found\n");
+				w->label[0] = 0;
+				complete(w);
+				return;
+			}
+
+			w->lba++;
+			continue;
+		}
+
+		_fat_bootblock* bootblock = (_fat_bootblock*) buffer;
+
+		if (bootblock->magic != 0xAA55)
+		{
+			printf("bad magic at LBA %lu, corrupt disk?\n", lba);
+			w->error = FAT_ERR_NOFS;
+			complete(w);
+			return;
+		}
+
+		FDEBUG("FAT: magic ok, trying partition table\n");
+		int found = 0;
+		for (int i = 0; (i < 4) && (found == 0); i++)
+		{
+			FDEBUG("FAT: Partition table %u:\n\ttype: %X\n\tlba_begin: %lu\n\tn_sectors: %lu\n\tend: %lu\n\tdisk blocks: %lu\n",
+				i,
+				bootblock->partition[i].type,
+				bootblock->partition[i].lba_begin,
+				bootblock->partition[i].n_sectors,
+				bootblock->partition[i].lba_begin + bootblock->partition[i].n_sectors,
+				sd->n_sectors()
+			);
+			if (
+				(
+					bootblock->partition[i].type == 0x01 ||
+					bootblock->partition[i].type == 0x04 ||
+					bootblock->partition[i].type == 0x06 ||
+					bootblock->partition[i].type == 0x0B ||
+					bootblock->partition[i].type == 0x0C ||
+					bootblock->partition[i].type == 0x0E ||
+					bootblock->partition[i].type == 0x0F
+				) &&
+				bootblock->partition[i].lba_begin != lba &&
+				bootblock->partition[i].lba_begin < sd->n_sectors() &&
+				bootblock->partition[i].n_sectors + bootblock->partition[i].lba_begin <= sd->n_sectors()
+			)
+			{
+				FDEBUG("FAT: Found a partition!\n");
+
+				w->lba = bootblock->partition[i].lba_begin;
+				found = 1;
+			}
+		}
+		if (found)
+			continue;
+
+		FDEBUG("FAT: didn't look like a partition table, trying FAT superblock\n");
+
+		_fat_volid*   volid     = (_fat_volid  *) buffer;
+
+		uint32_t nsec   = (volid->total_sectors)?volid->total_sectors:volid->total_sectors_32;
+
+		FDEBUG("FAT: superblock:\n\tid: %c%c%c%c%c%c%c%c\n\tbytes_per_sector: %u\n\tn_fats: %u\n\tsectors_per_cluster: %u\n\tn_reserved_sectors: %u\n\tsectors_per_fat: %u\n\t\n\thidden_sectors: %lu\n\ttotal_sectors: %lu (%luMB)\n",
+				volid->oem_id[0],volid->oem_id[1],volid->oem_id[2],volid->oem_id[3],volid->oem_id[4],volid->oem_id[5],volid->oem_id[6],volid->oem_id[7],
+			volid->bytes_per_sector,
+			volid->num_fats,
+			volid->sectors_per_cluster,
+			volid->num_boot_sectors,
+			volid->sectors_per_fat,
+			volid->hidden_sectors,
+			nsec,
+			nsec / 2048
+		);
+
+		if (volid->bytes_per_sector == 512 &&
+			volid->num_fats == 2             &&
+			(	volid->sectors_per_cluster == 1   ||
+				volid->sectors_per_cluster == 2   ||
+				volid->sectors_per_cluster == 4   ||
+				volid->sectors_per_cluster == 8   ||
+				volid->sectors_per_cluster == 16  ||
+				volid->sectors_per_cluster == 32  ||
+				volid->sectors_per_cluster == 64  ||
+				volid->sectors_per_cluster == 128
+			) &&
+			(nsec <= sd->n_sectors())
+		)
+		{
+			// the type goes by the clusters left for data once the reserved
+			// sectors, the FATs and the root directory are out of the way
+			uint32_t fat_size = volid->sectors_per_fat?volid->sectors_per_fat:volid->fat32.sectors_per_fat_32;
+			uint32_t root_sec = (volid->num_root_dir_ents * 32 + 511) >> 9;
+			uint32_t overhead = volid->num_boot_sectors + volid->num_fats * fat_size + root_sec;
+			uint32_t nclust   = (nsec > overhead)?((nsec - overhead) / volid->sectors_per_cluster):0;
+
+			uint8_t type = 12;
+			if (nclust >= 4085U)
+				type = 16;
+			if (nclust >= 65525U)
+				type = 32;
+
+			printf("FAT: Found a FAT%d superblock!\n", type);
+			// looks like a volid
+
+			fat_begin_lba       = lba + volid->num_boot_sectors;
+			sectors_per_cluster = volid->sectors_per_cluster;
+// 			bytes_per_sector    = volid->bytes_per_sector;
+
+			if (type == 32)
+			{
+				uint32_t nsec_per_fat = volid->fat32.sectors_per_fat_32;
+				cluster_begin_lba     = lba + volid->num_boot_sectors + (volid->num_fats * nsec_per_fat);
+				root_dir_cluster      = volid->fat32.root_dir_cluster;
+				root_dir_sector       = cluster_to_lba(root_dir_cluster);
+				root_dir_end          = cluster_to_lba(root_dir_cluster + 1) - 1;
+				fat_sectors           = nsec_per_fat;
+
+				if ((volid->fat32.fsinfo_sector != 0) && (volid->fat32.fsinfo_sector != 0xFFFF))
+					fsinfo_lba = lba + volid->fat32.fsinfo_sector;
+
+				FDEBUG("\tSectors per fat: %lu\n", nsec_per_fat);
+				FDEBUG("\tRoot dir cluster: %lu (LBA:%lu)\n", volid->fat32.root_dir_cluster, root_dir_sector);
+				FDEBUG("\tCluster begin LBA: %lu\n", lba + volid->num_boot_sectors + (volid->num_fats * nsec_per_fat));
+			}
+			else
+			{
+				uint32_t nsec_per_fat = volid->sectors_per_fat;
+				root_dir_sector       = lba + volid->num_boot_sectors + (volid->num_fats * nsec_per_fat);
+				root_dir_cluster      = 0;
+				cluster_begin_lba     = root_dir_sector + root_sec;
+				root_dir_end          = cluster_begin_lba - 1;
+				fat_sectors           = nsec_per_fat;
+			}
+
+			// everything that walks or changes the FAT goes through these
+			table = &table_ops[(type == 12)?0:((type == 16)?1:2)];
+
+			// no more clusters than the FAT has entries for
+			uint32_t entries = ((uint64_t) fat_sectors << 12) / type;
+			max_cluster = (nsec - (cluster_begin_lba - lba)) / sectors_per_cluster + 2;
+			if (max_cluster > entries)
+				max_cluster = entries;
+
+#if FAT_FREEMAP_BYTES
+			freemap_start();
+#endif
+
+			// last, as it's what f_mounted() looks at
+			fat_type = type;
+
+			if (fsinfo_lba)
+			{
+				w->stage = FAT_MOUNT_STAGE_FSINFO;
+				w->lba   = fsinfo_lba;
+			}
+			else
+			{
+				w->stage = FAT_MOUNT_STAGE_ROOT_DIR;
+				w->lba   = root_dir_sector;
+			}
+
+			continue;
+		}
+
+		printf("did not recognise disk image: looks like neither FAT volid or partition table.\n");
+		w->error = FAT_ERR_NOFS;
+		complete(w);
+		return;
+	}
+}
+
+/*
+ * the next path component in directory entry form, "file.txt" becoming
+ * "FILE    TXT". Returns its length in the path
+ */
+static int fat_name83(const char* fn, char* name)
+{
+	memset(name, ' ', 11);
+
+	int i, j = 0;
+	for (i = 0; fn[i] && (fn[i] != '/'); i++)
+	{
+		// "." and ".." are names in their own right
+		if ((fn[i] == '.') && (fn[0] != '.'))
+			j = 8;
+		else if (j < 11)
+			name[j++] = toupper(fn[i]);
+	}
+
+	return i;
+}
+
+// the checksum long name entries carry of the 8.3 name they go with
+static uint8_t fat_lfn_checksum(const uint8_t* name)
+{
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	return sum;
+}
+
+// character j of the 13 a long name entry holds
+static uint16_t fat_lfn_char(const _fat_lfnentry* l, int j)
+{
+	if (j < 5)
+		return l->name0[j];
+	if (j < 11)
+		return l->name1[j - 5];
+	return l->name2[j - 11];
+}
+
+/*
+ * whether a long name entry agrees with the path component fn, len long,
+ * ignoring case. Entry k holds the name from character (k - 1) * 13 on,
+ * with a 0 after its last character if there's room
+ */
+static int fat_lfn_match(const _fat_lfnentry* l, const char* fn, int len)
+{
+	int p = ((l->flags & 0x1F) - 1) * 13;
+
+	for (int j = 0; (j < 13) && (p <= len); j++, p++)
+	{
+		uint16_t c = fat_lfn_char(l, j);
+
+		if (p == len)
+			return (c == 0);
+		if ((c >= 128) || (toupper(c) != toupper(fn[p])))
+			return 0;
+	}
+	return 1;
+}
+
+void Fat::ioaction_open(_fat_file_ioresult* w, uint8_t* buffer, uint32_t lba)
+{
+#if FAT_NAME_CACHE
+	// it only knows about files
+	if ((w->path_traverse == 0) && (w->action == IOACTION_OPEN))
+	{
+		w->path_traverse = 1;
+		if (name_cache_find(w))
+		{
+			complete(w);
+			return;
+		}
+	}
+#endif
+
+	// f_open pointed us at the root dir. Scan each sector for the next part
+	// of the path, descending into directories as we find them
+
+	for (;;)
+	{
+		char* fn = w->file.path + w->file.pathname_traversed_bytes;
+
+		// a directory's path can end in the directory itself, "" being
+		// the root
+		if ((fn[0] == 0) && (w->action == IOACTION_OPENDIR))
+		{
+			open_found(w, 0, 0, w->file.direntry_cluster, 0);
+			complete(w);
+			return;
+		}
+
+		if (dentry_cache(w->lba) == 0)
+			return;
+
+		char matchname[11];
+		int len  = fat_name83(fn, matchname);
+		int last = (fn[len] == 0);
+
+		FDEBUG("FAT: Matchname is '%.11s'\n", matchname);
+
+		// a long name's checked against the path as its entries go by. We
+		// may be back at this sector after a FAT read, so how far it's got
+		// is only kept once we're done with the sector
+		uint8_t seq = w->lfn_seq, sum = w->lfn_sum, match = w->lfn_match;
+
+		_fat_direntry* d = (_fat_direntry*) dentry_buf;
+		int i;
+		for (i = 0; i < 16; i++)
+		{
+			if (d[i].name[0] == 0)
+			{
+				// end of directory
+				w->error = FAT_ERR_NOENT;
+				complete(w);
+				return;
+			}
+
+			if (d[i].name[0] == 0xE5)
+			{
+				seq = 0;
+				continue;
+			}
+
+			if (d[i].attr == 0x0F)
+			{
+				_fat_lfnentry* l = (_fat_lfnentry*) &d[i];
+				uint8_t k = l->flags & 0x1F;
+
+				if (l->flags & 0x40)
+				{
+					seq   = k;
+					sum   = l->checksum;
+					match = (k > 0) && (len <= k * 13);
+				}
+				else if (seq && (k == seq - 1) && (l->checksum == sum))
+					seq = k;
+				else
+				{
+					seq = 0;
+					continue;
+				}
+
+				if (match)
+					match = fat_lfn_match(l, fn, len);
+				continue;
+			}
+
+			int lfn = (seq == 1) && match && (fat_lfn_checksum(d[i].name) == sum);
+			seq = 0;
+
+			if (d[i].attr & 0x08)
+				continue;
+
+			if ((lfn == 0) && memcmp(matchname, d[i].name, 11))
+				continue;
+
+			uint32_t cluster = (((uint32_t) d[i].ch) << 16) | d[i].cl;
+
+			if (last && (w->action == IOACTION_OPENDIR))
+			{
+				if ((d[i].attr & 0x10) == 0)
+					w->error = FAT_ERR_NOENT;
+				else
+					open_found(w, 0, 0, cluster?cluster:root_dir_cluster, 0);
+				complete(w);
+				return;
+			}
+
+			if (last)
+			{
+				// found it!
+				FDEBUG("Found! First cluster: %lu, size: %lub\n", cluster, d[i].size);
+
+				uint32_t dir = (w->lba < cluster_begin_lba)?0:lba_to_cluster(w->lba);
+
+				open_found(w, dir, ((w->lba - (dir?cluster_to_lba(dir):root_dir_sector)) << 4) + i, cluster, d[i].size);
+#if FAT_NAME_CACHE
+				name_cache_add(&w->file);
+#endif
+
+				complete(w);
+				return;
+			}
+
+			if ((d[i].attr & 0x10) == 0)
+			{
+				// a file where the path wants a directory
+				w->error = FAT_ERR_NOENT;
+				complete(w);
+				return;
+			}
+
+			// FOLDER entry. ".." in a top level directory points at cluster 0
+			w->file.pathname_traversed_bytes += len + 1;
+			w->file.direntry_cluster = cluster?cluster:root_dir_cluster;
+			w->lba = cluster?cluster_to_lba(cluster):root_dir_sector;
+			w->lfn_seq = 0;
+			break;
+		}
+		if (i < 16)
+			continue;
+
+		// not in this sector, try the next one
+		uint32_t next = w->lba;
+		if (dir_next_sector(&next) == 0)
+			return;
+		if (next == 0)
+		{
+			w->error = FAT_ERR_NOENT;
+			complete(w);
+			return;
+		}
+		w->lba       = next;
+		w->lfn_seq   = seq;
+		w->lfn_sum   = sum;
+		w->lfn_match = match;
+	}
+}
+
+void Fat::open_found(_fat_file_ioresult* w, uint32_t dir, uint16_t index, uint32_t cluster, uint32_t size)
+{
+	w->action                = IOACTION_READ_ONE;
+
+	w->file.direntry_cluster = dir;
+	w->file.direntry_index   = index;
+
+	w->file.root_cluster     = cluster;
+
+	w->file.current_cluster  = cluster;
+	w->file.byte_in_cluster  = 0;
+	w->file.cluster_index    = 0;
+
+	w->file.size             = size;
+
+	w->file.n_extents        = 0;
+	w->file.extent_clusters  = 0;
+	w->file.extent_end       = (cluster == 0);
+	w->file.walk_cluster     = cluster;
+	w->file.walk_index       = 0;
+	w->file.dirty            = 0;
+	if (cluster)
+	{
+		w->file.extent[0].cluster = cluster;
+		w->file.extent[0].length  = 1;
+		w->file.n_extents         = 1;
+		w->file.extent_clusters   = 1;
+	}
+
+	w->lba                   = cluster_to_lba(cluster);
+}
+
+/*
+ * clusters after index's that follow on from it on the disk, as far as the
+ * extent map knows
+ */
+static uint32_t extent_follows(FIL* f, uint32_t index)
+{
+	for (int i = 0; i < f->n_extents; i++)
+	{
+		if (index < f->extent[i].length)
+			return f->extent[i].length - index - 1;
+		index -= f->extent[i].length;
+	}
+	return 0;
+}
+
+/*
+ * a long name comes as entries numbered from its end back to 1, in front
+ * of the 8.3 entry, each holding 13 UCS-2 characters. We only keep ASCII
+ */
+static void fat_lfn_entry(_fat_dir_ioresult* w, _fat_lfnentry* l)
+{
+	uint8_t seq = l->flags & 0x1F;
+
+	if (l->flags & 0x40)
+	{
+		if ((seq == 0) || (seq > 20))
+		{
+			w->lfn_seq = 0;
+			return;
+		}
+		w->lfn_sum = l->checksum;
+		w->lfn[seq * 13] = 0;
+	}
+	else if ((w->lfn_seq == 0) || (seq != w->lfn_seq - 1) || (l->checksum != w->lfn_sum))
+	{
+		// out of step, so there's no name to be had
+		w->lfn_seq = 0;
+		return;
+	}
+	w->lfn_seq = seq;
+
+	char* p = &w->lfn[(seq - 1) * 13];
+	for (int j = 0; j < 13; j++)
+	{
+		uint16_t c = fat_lfn_char(l, j);
+		if ((c == 0) || (c == 0xFFFF))
+			p[j] = 0;
+		else
+			p[j] = (c < 128)?c:'?';
+	}
+}
+
+// "NAME    EXT" as NAME.EXT, in lower case where Windows NT flagged it so
+static int fat_name_83(const _fat_direntry* d, char* out)
+{
+	int n = 0;
+	for (int j = 0; (j < 8) && (d->name[j] != ' '); j++)
+	{
+		char c = ((j == 0) && (d->name[0] == 0x05))?0xE5:d->name[j];
+		out[n++] = (d->irrelevant0[0] & 0x08)?tolower(c):c;
+	}
+	if (d->name[8] != ' ')
+	{
+		out[n++] = '.';
+		for (int j = 8; (j < 11) && (d->name[j] != ' '); j++)
+			out[n++] = (d->irrelevant0[0] & 0x10)?tolower(d->name[j]):d->name[j];
+	}
+	out[n] = 0;
+	return n;
+}
+
+void Fat::dir_sector(_fat_dir_ioresult* w, uint8_t* buf)
+{
+	if (w->at_end)
+		return;
+
+	_fat_direntry* d = (_fat_direntry*) buf;
+	fat_dirent_t entry[16];
+	uint32_t used = 0;
+	int n = 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		if (d[i].name[0] == 0)
+		{
+			w->at_end = 1;
+			break;
+		}
+
+		if (d[i].name[0] == 0xE5)
+		{
+			w->lfn_seq = 0;
+			continue;
+		}
+
+		if (d[i].attr == 0x0F)
+		{
+			fat_lfn_entry(w, (_fat_lfnentry*) &d[i]);
+			continue;
+		}
+
+		if ((d[i].attr & 0x08) == 0)
+		{
+			fat_dirent_t* e = &entry[n++];
+			char* name = w->names + used;
+
+			if ((w->lfn_seq == 1) && (w->lfn_sum == fat_lfn_checksum(d[i].name)) && w->lfn[0])
+			{
+				strcpy(name, w->lfn);
+				used += strlen(name) + 1;
+			}
+			else
+				used += fat_name_83(&d[i], name) + 1;
+
+			e->name    = name;
+			e->attr    = d[i].attr;
+			e->cluster = (((uint32_t) d[i].ch) << 16) | d[i].cl;
+			e->size    = d[i].size;
+		}
+
+		w->lfn_seq = 0;
+	}
+
+	if (n && w->reader)
+		w->reader->_fat_dirents(w, entry, n);
+}
+
+/*
+ * go through a directory a sector at a time, following its chain like a
+ * file's. Runs of sectors that follow on from each other on the disk
+ * stream in through the driver's buffers. A sector on its own, or one
+ * that's cached, comes from the cache
+ */
+void Fat::ioaction_readdir(_fat_dir_ioresult* w, uint8_t* buffer, uint32_t lba)
+{
+	uint32_t cluster_bytes = sectors_per_cluster << 9;
+
+	for (;;)
+	{
+		if (w->ready == 0)
+		{
+			if ((buffer == NULL) || (lba != w->lba))
+				return;
+
+			// runs only carry on into clusters that follow on
+			if (w->file.root_cluster && (w->file.byte_in_cluster >= cluster_bytes))
+			{
+				w->file.current_cluster++;
+				w->file.cluster_index++;
+				w->file.byte_in_cluster -= cluster_bytes;
+			}
+			w->file.byte_in_cluster += 512;
+
+			// the cache may have changes the card hasn't seen yet
+			uint8_t* c = cache_peek(lba);
+			dir_sector(w, c?c:buffer);
+			sd->clean_buffer(buffer);
+			buffer = NULL;
+
+			w->lba++;
+			if (lba != w->run_end)
+				return;
+
+			// nothing more will turn up for us, so we can stop
+			w->ready = 1;
+			if (w->at_end)
+			{
+				complete(w);
+				return;
+			}
+			continue;
+		}
+
+		uint32_t n;
+		if (w->file.root_cluster)
+		{
+			if (w->file.byte_in_cluster >= cluster_bytes)
+			{
+				uint32_t next;
+				if (file_cluster(&w->file, w->file.cluster_index + 1, &next) == 0)
+					return;
+				if (next == 0)
+				{
+					complete(w);
+					return;
+				}
+				w->file.current_cluster = next;
+				w->file.cluster_index++;
+				w->file.byte_in_cluster = 0;
+				w->lba = cluster_to_lba(next);
+			}
+
+			// find out where the chain goes from here, if we don't know
+			uint32_t follows = extent_follows(&w->file, w->file.cluster_index);
+			if ((follows == 0) && (w->file.cluster_index + 1 >= w->file.extent_clusters))
+			{
+				uint32_t next;
+				if (file_cluster(&w->file, w->file.cluster_index + 1, &next) == 0)
+					return;
+				follows = extent_follows(&w->file, w->file.cluster_index);
+			}
+
+			n = ((cluster_bytes - w->file.byte_in_cluster) >> 9) + follows * sectors_per_cluster;
+		}
+		else
+		{
+			// the fixed FAT12/16 root directory
+			if (w->lba > root_dir_end)
+			{
+				complete(w);
+				return;
+			}
+			n = root_dir_end - w->lba + 1;
+		}
+
+		if ((n == 1) || cache_peek(w->lba))
+		{
+			if (dentry_cache(w->lba) == 0)
+				return;
+
+			w->file.byte_in_cluster += 512;
+			dir_sector(w, dentry_buf);
+			w->lba++;
+
+			if (w->at_end)
+			{
+				complete(w);
+				return;
+			}
+			continue;
+		}
+
+		w->run_end = w->lba + n - 1;
+		w->ready   = 0;
+		if (sd->begin_read(w->lba, n, NULL, this) < 0)
+		{
+			// the card's queue is full, so we'll be back
+			w->ready = 1;
+			refused  = 1;
+		}
+		return;
+	}
+}
+
+#if FAT_NAME_CACHE
+/*
+ * two independent hashes of a path, ignoring case as FAT does. Together
+ * they're long enough that two paths a card might hold won't share them
+ */
+static void fat_path_hash(const char* path, uint32_t* hash)
+{
+	uint32_t fnv = 2166136261UL, djb = 5381;
+
+	for (; *path; path++)
+	{
+		uint8_t c = toupper(*path);
+		fnv = (fnv ^ c) * 16777619UL;
+		djb = ((djb << 5) + djb) ^ c;
+	}
+
+	hash[0] = fnv;
+	hash[1] = djb?djb:1;
+}
+
+int Fat::name_cache_find(_fat_file_ioresult* w)
+{
+	uint32_t hash[2];
+	fat_path_hash(w->file.path, hash);
+
+	for (int i = 0; i < FAT_NAME_CACHE; i++)
+	{
+		if ((names[i].hash[0] != hash[0]) || (names[i].hash[1] != hash[1]))
+			continue;
+
+		FDEBUG("FAT: %s is in the name cache\n", w->file.path);
+
+		open_found(w, names[i].dir, names[i].index, names[i].cluster, names[i].size);
+		names[i].used = ++name_clock;
+		cache_stats.name_hits++;
+		return 1;
+	}
+
+	cache_stats.name_misses++;
+	return 0;
+}
+
+void Fat::name_cache_add(FIL* f)
+{
+	uint32_t hash[2];
+	fat_path_hash(f->path, hash);
+
+	// the same path again, an unused slot, or the least recently used
+	int n = 0;
+	for (int i = 0; i < FAT_NAME_CACHE; i++)
+	{
+		if ((names[i].hash[0] == hash[0]) && (names[i].hash[1] == hash[1]))
+		{
+			n = i;
+			break;
+		}
+		if (names[i].used < names[n].used)
+			n = i;
+	}
+
+	names[n].hash[0] = hash[0];
+	names[n].hash[1] = hash[1];
+	names[n].dir     = f->direntry_cluster;
+	names[n].index   = f->direntry_index;
+	names[n].cluster = f->root_cluster;
+	names[n].size    = f->size;
+	names[n].used    = ++name_clock;
+}
+
+// the directory entry's just been written, so keep up with it
+void Fat::name_cache_update(FIL* f)
+{
+	for (int i = 0; i < FAT_NAME_CACHE; i++)
+	{
+		if ((names[i].hash[1] == 0) || (names[i].dir != f->direntry_cluster) || (names[i].index != f->direntry_index))
+			continue;
+
+		names[i].cluster = f->root_cluster;
+		names[i].size    = f->size;
+	}
+}
+#endif
+
+void Fat::ioaction_read_one(_fat_file_ioresult* w, uint8_t* buffer, uint32_t lba)
+{
+	uint32_t cluster_bytes = sectors_per_cluster << 9;
+
+	while (w->bytes_remaining)
+	{
+		uint8_t* dest = w->buffer + (w->buflen - w->bytes_remaining);
+
+		if (w->ready == 0)
+		{
+			// a run is on its way in, a sector at a time, each one
+			// straight to where it belongs in the caller's buffer
+			if ((buffer != dest) || (lba != w->lba))
+				return;
+
+			// runs only carry on into clusters that follow on
+			if (w->file.byte_in_cluster >= cluster_bytes)
+			{
+				w->file.current_cluster++;
+				w->file.cluster_index++;
+				w->file.byte_in_cluster -= cluster_bytes;
+			}
+
+			uint32_t n = (w->bytes_remaining < 512)?w->bytes_remaining:512;
+			w->file.byte_in_cluster += n;
+			w->bytes_remaining -= n;
+
+			if (w->lba == w->run_end)
+				w->ready = 1;
+			else
+			{
+				// the card's waiting to be told where the next one goes
+				w->lba++;
+				sd->clean_buffer(dest + 512);
+			}
+			buffer = NULL;
+			continue;
+		}
+
+		if (w->file.byte_in_cluster >= cluster_bytes)
+		{
+			uint32_t next;
+			if (file_cluster(&w->file, w->file.cluster_index + 1, &next) == 0)
+				return;
+			if (next == 0)
+			{
+				printf("FAT: %s: cluster chain ends before the file does\n", w->file.path);
+				w->error = FAT_ERR_IO;
+				break;
+			}
+			w->file.current_cluster = next;
+			w->file.cluster_index++;
+			w->file.byte_in_cluster -= cluster_bytes;
+		}
+
+		// the rest of this cluster, and of any clusters next to it on the
+		// disk, in one multi-block read. If that's not enough and the map
+		// doesn't say what comes next, find out first
+		uint32_t want = (w->bytes_remaining + 511) >> 9;
+		uint32_t n    = (cluster_bytes - w->file.byte_in_cluster) >> 9;
+		uint32_t follows = extent_follows(&w->file, w->file.cluster_index);
+
+		if ((n < want) && (follows == 0) && (w->file.cluster_index + 1 >= w->file.extent_clusters))
+		{
+			uint32_t next;
+			if (file_cluster(&w->file, w->file.cluster_index + 1, &next) == 0)
+				return;
+			follows = extent_follows(&w->file, w->file.cluster_index);
+		}
+
+		n += follows * sectors_per_cluster;
+		if (n > want)
+			n = want;
+		if ((n > FAT_SHARE_SECTORS) && shared())
+			n = FAT_SHARE_SECTORS;
+
+		w->lba     = cluster_to_lba(w->file.current_cluster) + (w->file.byte_in_cluster >> 9);
+		w->run_end = w->lba + n - 1;
+		w->ready   = 0;
+		if (sd->begin_read(w->lba, n, dest, this) < 0)
+		{
+			// the card's queue is full, so we'll be back
+			w->ready = 1;
+			refused  = 1;
+		}
+		return;
+	}
+
+	w->buflen -= w->bytes_remaining;
+	w->bytes_remaining = 0;
+	complete(w);
+}
+
+void Fat::ioaction_seek(_fat_file_ioresult* w, uint8_t* buffer, uint32_t lba)
+{
+	uint32_t cluster_bytes = sectors_per_cluster << 9;
+	uint32_t index         = w->seek_to / cluster_bytes;
+	uint32_t byte          = w->seek_to % cluster_bytes;
+
+	// on a cluster boundary, stay at the end of the one before. Reading on
+	// moves to the next, and a seek to the end doesn't need a link that
+	// isn't there
+	if ((byte == 0) && (index > 0))
+	{
+		index--;
+		byte = cluster_bytes;
+	}
+
+	uint32_t cluster = w->file.root_cluster;
+	if ((index > 0) || (cluster == 0))
+	{
+		if (file_cluster(&w->file, index, &cluster) == 0)
+			return;
+	}
+
+	if ((cluster == 0) && (w->seek_to > 0))
+	{
+		printf("FAT: %s: cluster chain ends before the file does\n", w->file.path);
+		w->error = FAT_ERR_IO;
+	}
+	else
+	{
+		w->file.current_cluster = cluster;
+		w->file.cluster_index   = index;
+		w->file.byte_in_cluster = byte;
+	}
+
+	complete(w);
+}
+
+void Fat::ioaction_write_one(_fat_file_ioresult* w, uint8_t* buffer, uint32_t lba)
+{
+	uint32_t cluster_bytes = sectors_per_cluster << 9;
+
+	while (w->bytes_remaining)
+	{
+		uint8_t* src = w->buffer + (w->buflen - w->bytes_remaining);
+
+		if (w->ready == 0)
+		{
+			// a run is on its way out, each sector reported as it goes
+			if ((buffer != src) || (lba != w->lba))
+				return;
+
+			// runs only carry on into clusters that follow on
+			if (w->file.byte_in_cluster >= cluster_bytes)
+			{
+				w->file.current_cluster++;
+				w->file.cluster_index++;
+				w->file.byte_in_cluster -= cluster_bytes;
+			}
+
+			uint32_t n = (w->bytes_remaining < 512)?w->bytes_remaining:512;
+			w->file.byte_in_cluster += n;
+			w->bytes_remaining -= n;
+
+			uint32_t pos = w->file.cluster_index * cluster_bytes + w->file.byte_in_cluster;
+			if (pos > w->file.size)
+			{
+				w->file.size  = pos;
+				w->file.dirty = 1;
+			}
+
+			if (w->lba == w->run_end)
+				w->ready = 1;
+			else
+				w->lba++;
+			buffer = NULL;
+			continue;
+		}
+
+		// everything this write needs is allocated before any of it goes
+		// out, so it can go in as few runs as possible
+		uint32_t pos = w->file.cluster_index * cluster_bytes + w->file.byte_in_cluster;
+		if (file_extend(w, (pos + w->bytes_remaining + cluster_bytes - 1) / cluster_bytes) == 0)
+			return;
+		if (w->error)
+			break;
+
+		if (w->file.byte_in_cluster >= cluster_bytes)
+		{
+			uint32_t next;
+			if (file_cluster(&w->file, w->file.cluster_index + 1, &next) == 0)
+				return;
+			if (next == 0)
+			{
+				printf("FAT: %s: cluster chain ends before the file does\n", w->file.path);
+				w->error = FAT_ERR_IO;
+				break;
+			}
+			w->file.current_cluster = next;
+			w->file.cluster_index++;
+			w->file.byte_in_cluster -= cluster_bytes;
+		}
+
+		// the rest of this cluster, and of any clusters next to it on the
+		// disk, in one multi-block write
+		uint32_t n = (cluster_bytes - w->file.byte_in_cluster) >> 9;
+		n += extent_follows(&w->file, w->file.cluster_index) * sectors_per_cluster;
+		if (n > ((w->bytes_remaining + 511) >> 9))
+			n = (w->bytes_remaining + 511) >> 9;
+		if ((n > FAT_SHARE_SECTORS) && shared())
+			n = FAT_SHARE_SECTORS;
+
+		w->lba     = cluster_to_lba(w->file.current_cluster) + (w->file.byte_in_cluster >> 9);
+		w->run_end = w->lba + n - 1;
+		w->ready   = 0;
+		if (sd->begin_write(w->lba, n, src, this) < 0)
+		{
+			// the card's queue is full, so we'll be back
+			w->ready = 1;
+			refused  = 1;
+		}
+		return;
+	}
+
+	w->buflen -= w->bytes_remaining;
+	w->bytes_remaining = 0;
+	complete(w);
+}
+
+void Fat::ioaction_sync(_fat_file_ioresult* w, uint8_t* buffer, uint32_t lba)
+{
+	FIL* f = &w->file;
+
+	if (f->dirty)
+	{
+		uint32_t dir = f->direntry_cluster;
+		if (dentry_cache((dir?cluster_to_lba(dir):root_dir_sector) + (f->direntry_index >> 4)) == 0)
+			return;
+
+		_fat_direntry* d = ((_fat_direntry*) dentry_buf) + (f->direntry_index & 15);
+		d->size = f->size;
+		d->ch   = f->root_cluster >> 16;
+		d->cl   = f->root_cluster & 0xFFFF;
+		cache_dirty(dentry_buf);
+
+#if FAT_NAME_CACHE
+		name_cache_update(f);
+#endif
+
+		f->dirty = 0;
+	}
+
+	if (fsinfo_dirty && fsinfo_lba)
+	{
+		if (dentry_cache(fsinfo_lba) == 0)
+			return;
+
+		_fat_fsinfo* fsinfo = (_fat_fsinfo*) dentry_buf;
+		fsinfo->free_count = free_count;
+		fsinfo->next_free  = next_free;
+		cache_dirty(dentry_buf);
+
+		fsinfo_dirty = 0;
+	}
+
+	// we're run again as each write back finishes. One that failed ends
+	// the wait, though it's tried again next time
+	int busy = cache_flush();
+	if (cache_error)
+	{
+		cache_error = 0;
+		w->error = FAT_ERR_IO;
+	}
+	else if (busy)
+		return;
+
+	if (w->action == IOACTION_CLOSE)
+	{
+		free(f->path);
+		f->path = NULL;
+	}
+
+	complete(w);
+}
+
+void Fat::queue_walk()
+{
+	printf("FAT: Queue walk\n");
+	_fat_ioresult* j = work_queue;
+	while (j)
+	{
+		// there are no clusters until a mount has found some
+		uint32_t cluster = f_mounted()?lba_to_cluster(j->lba):0;
+		printf("FAT: Queue item %p:\n\taction : %d (%s)\n\tbuffer : %p\n\tbuflen : %lu\n\tcluster: %lu\n\tlba    : %lu\n\towner  : %p\n\tnext   : %p\n", j, j->action, action_name((_fat_ioaction) j->action), j->buffer, j->buflen, cluster, j->lba, j->owner, j->next);
+		j = j->next;
+	}
+	printf("FAT: end queue\n");
+}
+
+/*
+ * find lba in the cache. On a miss, evict the least recently used sector
+ * that isn't on its way to or from the card and start reading into it.
+ * A dirty victim is written back first, unless there's a clean one to use
+ */
+uint8_t* Fat::cache_get(uint32_t lba)
+{
+	int lru = -1, clean = -1;
+
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+	{
+		if (cache[i].buf == NULL)
+			continue;
+
+		if (cache[i].lba == lba)
+		{
+			if (cache[i].flags & FAT_CACHE_VALID)
+			{
+				cache[i].used = ++cache_clock;
+				cache_stats.hits++;
+				return cache[i].buf;
+			}
+			// already on its way
+			if (cache[i].flags & FAT_CACHE_READING)
+				return NULL;
+			// the card couldn't read it, and run() fails whoever asked
+			if (cache[i].flags & FAT_CACHE_FAILED)
+			{
+				cache_failed = 1;
+				return NULL;
+			}
+		}
+
+		if (cache[i].flags & (FAT_CACHE_BUSY | FAT_CACHE_FAILED))
+			continue;
+
+		if ((lru < 0) || (cache[i].used < cache[lru].used))
+			lru = i;
+		if (((cache[i].flags & FAT_CACHE_DIRTY) == 0) && ((clean < 0) || (cache[i].used < cache[clean].used)))
+			clean = i;
+	}
+
+	// everything's busy. We'll be run again as something finishes
+	if (lru < 0)
+		return NULL;
+
+	if (cache[lru].flags & FAT_CACHE_DIRTY)
+	{
+		cache_write(lru);
+		if (clean < 0)
+			return NULL;
+		lru = clean;
+	}
+
+	cache_stats.misses++;
+
+	FDEBUG("Fat cache: miss on %lu\n", lba);
+
+	cache[lru].lba   = lba;
+	cache[lru].flags = FAT_CACHE_READING;
+	cache[lru].used  = ++cache_clock;
+
+	if (sd->begin_read(lba, 1, cache[lru].buf, this) < 0)
+	{
+		FDEBUG("FAT: couldn't queue a read of lba %lu\n", lba);
+		cache[lru].lba   = 0xFFFFFFFF;
+		cache[lru].flags = 0;
+		refused = 1;
+	}
+
+	return NULL;
+}
+
+uint8_t* Fat::cache_peek(uint32_t lba)
+{
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+	{
+		if ((cache[i].buf != NULL) && (cache[i].lba == lba) && (cache[i].flags & FAT_CACHE_VALID))
+		{
+			cache[i].used = ++cache_clock;
+			return cache[i].buf;
+		}
+	}
+	return NULL;
+}
+
+void Fat::cache_dirty(uint8_t* buf)
+{
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+		if (cache[i].buf == buf)
+			cache[i].flags |= FAT_CACHE_DIRTY;
+}
+
+// FAT sectors go to both copies
+void Fat::cache_write(uint8_t i)
+{
+	uint32_t lba    = cache[i].lba;
+	uint8_t  mirror = ((lba >= fat_begin_lba) && (lba < fat_begin_lba + fat_sectors));
+
+	cache[i].flags = (cache[i].flags & ~FAT_CACHE_DIRTY) | FAT_CACHE_WRITING | (mirror?FAT_CACHE_MIRROR:0);
+	cache_stats.writebacks++;
+
+	if (sd->begin_write(lba, 1, cache[i].buf, this) < 0)
+	{
+		cache[i].flags = (cache[i].flags & ~(FAT_CACHE_WRITING | FAT_CACHE_MIRROR)) | FAT_CACHE_DIRTY;
+		refused = 1;
+		return;
+	}
+
+	if (mirror && (sd->begin_write(lba + fat_sectors, 1, cache[i].buf, this) < 0))
+	{
+		cache[i].flags = (cache[i].flags & ~FAT_CACHE_MIRROR) | FAT_CACHE_DIRTY;
+		refused = 1;
+	}
+}
+
+int Fat::cache_flush()
+{
+	int n = 0;
+
+	for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+	{
+		if ((cache[i].flags & (FAT_CACHE_DIRTY | FAT_CACHE_BUSY)) == FAT_CACHE_DIRTY)
+			cache_write(i);
+		if (cache[i].flags & (FAT_CACHE_DIRTY | FAT_CACHE_WRITING | FAT_CACHE_MIRROR))
+			n++;
+	}
+
+	return n;
+}
+
+int Fat::fat_cache(uint32_t lba)
+{
+	uint8_t* b = cache_get(lba);
+	if (b == NULL)
+		return 0;
+
+	fat_buf = b;
+	return 1;
+}
+
+int Fat::dentry_cache(uint32_t lba)
+{
+	uint8_t* b = cache_get(lba);
+	if (b == NULL)
+		return 0;
+
+	dentry_buf = b;
+	return 1;
+}
+
+/*
+ * how each type of FAT lays out its entries. A FAT12 entry takes a byte
+ * and a half, so one in every three sectors or so has its first byte at
+ * the end of one sector and the rest at the start of the next
+ */
+template <int T> struct fat_table
+{
+	static constexpr uint32_t bad = (T == 32)?0x0FFFFFF7:((T == 16)?0xFFF7:0xFF7);
+	static constexpr uint32_t eoc = bad + 8;
+
+	static constexpr uint32_t offset(uint32_t c) { return (T == 12)?(c + (c >> 1)):(c * (T / 8)); }
+
+	// first cluster whose entry starts in FAT sector s
+	static constexpr uint32_t first(uint32_t s) { return (T == 12)?((s * 1024 + 2) / 3):(s * (4096 / T)); }
+
+	static constexpr bool straddles(uint32_t c) { return (T == 12) && ((offset(c) & 511) == 511); }
+
+	// FAT12 entries share a byte, the odd one having the top nibble
+	static constexpr uint32_t unpack(uint32_t raw, uint32_t c) { return (c & 1)?(raw >> 4):(raw & 0xFFF); }
+	static constexpr uint32_t repack(uint32_t raw, uint32_t c, uint32_t v) { return (c & 1)?((raw & 0x000F) | (v << 4)):((raw & 0xF000) | v); }
+
+	// an entry that's all in the sector at b, o bytes in
+	static uint32_t load(const uint8_t* b, uint32_t o, uint32_t c)
+	{
+		if (T == 32)
+			return *((const uint32_t*) (b + o)) & 0x0FFFFFFF;
+		if (T == 16)
+			return *((const uint16_t*) (b + o));
+		return unpack(b[o] | (b[o + 1] << 8), c);
+	}
+
+	static void store(uint8_t* b, uint32_t o, uint32_t c, uint32_t v)
+	{
+		if (T == 32)
+		{
+			// the top four bits are reserved
+			uint32_t* e = (uint32_t*) (b + o);
+			*e = (*e & 0xF0000000) | v;
+		}
+		else if (T == 16)
+			*((uint16_t*) (b + o)) = v;
+		else
+		{
+			uint32_t raw = repack(b[o] | (b[o + 1] << 8), c, v);
+			b[o]     = raw;
+			b[o + 1] = raw >> 8;
+		}
+	}
+};
+
+template <int T> int Fat::table_get(uint32_t cluster, uint32_t* entry, int peek)
+{
+	typedef fat_table<T> t;
+
+	uint32_t off = t::offset(cluster);
+	uint32_t lba = fat_begin_lba + (off >> 9);
+
+	uint8_t* b = peek?cache_peek(lba):(fat_cache(lba)?fat_buf:NULL);
+	if (b == NULL)
+		return 0;
+
+	if (t::straddles(cluster))
+	{
+		uint8_t lo = b[511];
+
+		b = peek?cache_peek(lba + 1):(fat_cache(lba + 1)?fat_buf:NULL);
+		if (b == NULL)
+			return 0;
+
+		*entry = t::unpack(lo | (b[0] << 8), cluster);
+		return 1;
+	}
+
+	*entry = t::load(b, off & 511, cluster);
+	return 1;
+}
+
+template <int T> int Fat::table_put(uint32_t cluster, uint32_t entry)
+{
+	typedef fat_table<T> t;
+
+	uint32_t off = t::offset(cluster);
+	uint32_t lba = fat_begin_lba + (off >> 9);
+
+	if (fat_cache(lba) == 0)
+		return 0;
+	uint8_t* b = fat_buf;
+
+	if (t::straddles(cluster))
+	{
+		if (fat_cache(lba + 1) == 0)
+			return 0;
+		uint8_t* h = fat_buf;
+
+		// both halves have to be in at once, and a small cache may have
+		// let the first go to make room for the second
+		if (cache_peek(lba) != b)
+		{
+			fat_cache(lba);
+			return 0;
+		}
+
+		uint32_t raw = t::repack(b[511] | (h[0] << 8), cluster, entry);
+		b[511] = raw;
+		h[0]   = raw >> 8;
+		cache_dirty(b);
+		cache_dirty(h);
+		return 1;
+	}
+
+	t::store(b, off & 511, cluster, entry);
+	cache_dirty(b);
+	return 1;
+}
+
+template <int T> uint32_t Fat::table_run(uint32_t cluster, uint32_t max)
+{
+	typedef fat_table<T> t;
+
+	uint32_t s = t::offset(cluster) >> 9;
+	uint8_t* b = cache_peek(fat_begin_lba + s);
+	if (b == NULL)
+		return 0;
+
+	uint32_t end = t::first(s + 1);
+	uint32_t n   = 0;
+
+	for (uint32_t c = cluster; (n < max) && (c < end) && !t::straddles(c); c++, n++)
+		if (t::load(b, t::offset(c) & 511, c) != c + 1)
+			break;
+
+	return n;
+}
+
+template <int T> int Fat::table_free(uint32_t* cluster, uint32_t* end)
+{
+	typedef fat_table<T> t;
+
+	uint32_t c = *cluster;
+	uint32_t s = t::offset(c) >> 9;
+	if (fat_cache(fat_begin_lba + s) == 0)
+		return 0;
+	uint8_t* b = fat_buf;
+
+	uint32_t e = t::first(s + 1);
+	if (e > max_cluster)
+		e = max_cluster;
+
+	for (; c < e; c++)
+	{
+		uint32_t v;
+		if (t::straddles(c))
+		{
+			// the last one in the sector, so we're done with b
+			if (table_get<T>(c, &v, 0) == 0)
+				return 0;
+		}
+		else
+			v = t::load(b, t::offset(c) & 511, c);
+
+		if (v == 0)
+			break;
+	}
+
+	*cluster = c;
+	*end     = e;
+	return 1;
+}
+
+#if FAT_FREEMAP_BYTES
+template <int T> void Fat::table_map(uint32_t lba, uint8_t* buf)
+{
+	typedef fat_table<T> t;
+
+	uint32_t s     = lba - fat_begin_lba;
+	uint32_t first = t::first(s);
+	uint32_t end   = t::first(s + 1);
+	if (end > max_cluster)
+		end = max_cluster;
+
+	uint32_t mask = (1UL << freemap_shift) - 1;
+
+	for (uint32_t c = first; c < end; c++)
+	{
+		uint32_t g = c >> freemap_shift;
+
+		// a group's free until something in it isn't. One split across
+		// sectors counts as used, the map only has to be right about
+		// what's free
+		if ((c & mask) == 0)
+			freemap[g >> 5] |= 1UL << (g & 31);
+		if ((c < 2) || t::straddles(c) || t::load(buf, t::offset(c) & 511, c))
+			freemap[g >> 5] &= ~(1UL << (g & 31));
+	}
+
+	freemap_scanned = end;
+}
+#endif
+
+#if FAT_FREEMAP_BYTES
+#define FAT_TABLE_OPS(T) { fat_table<T>::bad, fat_table<T>::eoc, &fat_table<T>::offset, \
+	&Fat::table_get<T>, &Fat::table_put<T>, &Fat::table_run<T>, &Fat::table_free<T>, &Fat::table_map<T> }
+#else
+#define FAT_TABLE_OPS(T) { fat_table<T>::bad, fat_table<T>::eoc, &fat_table<T>::offset, \
+	&Fat::table_get<T>, &Fat::table_put<T>, &Fat::table_run<T>, &Fat::table_free<T> }
+#endif
+
+const Fat::fat_table_ops Fat::table_ops[3] = {
+	FAT_TABLE_OPS(12),
+	FAT_TABLE_OPS(16),
+	FAT_TABLE_OPS(32),
+};
+
+int Fat::fat_next(uint32_t cluster, uint32_t* next)
+{
+	uint32_t n;
+	if ((this->*table->get)(cluster, &n, 0) == 0)
+		return 0;
+
+	// free, reserved, bad or end of chain all end the walk
+	*next = ((n < 2) || (n >= table->bad))?0:n;
+	return 1;
+}
+
+int Fat::fat_peek(uint32_t cluster, uint32_t* next)
+{
+	uint32_t n;
+	if ((this->*table->get)(cluster, &n, 1) == 0)
+		return 0;
+
+	*next = ((n < 2) || (n >= table->bad))?0:n;
+	return 1;
+}
+
+uint32_t Fat::fat_run(uint32_t cluster, uint32_t max)
+{
+	return (this->*table->run)(cluster, max);
+}
+
+// extend the map by one cluster, if index is the next one it's missing
+void Fat::extent_add(FIL* f, uint32_t index, uint32_t cluster)
+{
+	if ((index != f->extent_clusters) || (f->n_extents == 0))
+		return;
+
+	_fat_extent* e = &f->extent[f->n_extents - 1];
+	if (cluster == e->cluster + e->length)
+		e->length++;
+	else if (f->n_extents < FAT_EXTENTS)
+	{
+		e++;
+		e->cluster = cluster;
+		e->length  = 1;
+		f->n_extents++;
+	}
+	else
+		return;
+
+	f->extent_clusters++;
+}
+
+int Fat::file_cluster(FIL* f, uint32_t index, uint32_t* cluster)
+{
+	if (index < f->extent_clusters)
+	{
+		for (int i = 0; ; i++)
+		{
+			if (index < f->extent[i].length)
+			{
+				*cluster = f->extent[i].cluster + index;
+				return 1;
+			}
+			index -= f->extent[i].length;
+		}
+	}
+
+	if (f->extent_end)
+	{
+		*cluster = 0;
+		return 1;
+	}
+
+	// walk on from the furthest point we know that isn't past index
+	_fat_extent* e = &f->extent[f->n_extents - 1];
+	uint32_t c = e->cluster + e->length - 1;
+	uint32_t i = f->extent_clusters - 1;
+
+	if ((f->walk_index > i) && (f->walk_index <= index))
+	{
+		c = f->walk_cluster;
+		i = f->walk_index;
+	}
+	if ((f->cluster_index > i) && (f->cluster_index <= index))
+	{
+		c = f->current_cluster;
+		i = f->cluster_index;
+	}
+
+	while (i < index)
+	{
+		uint32_t next;
+		if (fat_next(c, &next) == 0)
+			return 0;
+
+		if (next == 0)
+		{
+			if (i + 1 == f->extent_clusters)
+				f->extent_end = 1;
+			// file_extend() carries on from here
+			f->walk_cluster = c;
+			f->walk_index   = i;
+			*cluster = 0;
+			return 1;
+		}
+
+		// a run of consecutive clusters in a cached FAT sector goes by
+		// without another lookup
+		uint32_t run = fat_run(next, index - i - 1);
+
+		for (uint32_t k = 0; k <= run; k++)
+			extent_add(f, i + 1 + k, next + k);
+
+		c  = next + run;
+		i += run + 1;
+
+		f->walk_cluster = c;
+		f->walk_index   = i;
+	}
+
+	*cluster = c;
+
+	// then map on through as much of the chain as the cached FAT sectors hold
+	while (f->extent_end == 0)
+	{
+		e = &f->extent[f->n_extents - 1];
+
+		uint32_t next, n = f->extent_clusters;
+		if (fat_peek(e->cluster + e->length - 1, &next) == 0)
+			break;
+		if (next == 0)
+		{
+			f->extent_end = 1;
+			break;
+		}
+
+		extent_add(f, n, next);
+		if (f->extent_clusters == n)
+			break;
+	}
+
+	return 1;
+}
+
+int Fat::fat_alloc(uint32_t tail, uint32_t want, uint32_t* cluster)
+{
+	if (alloc_left == 0)
+	{
+		alloc_left = max_cluster - 2;
+
+		// straight after the chain if that's free, otherwise somewhere
+		// with room for all that's wanted
+		if (tail && (tail + 1 < max_cluster))
+			next_free = tail + 1;
+#if FAT_FREEMAP_BYTES
+		else if (want > 1)
+		{
+			uint32_t c = freemap_find(next_free, want);
+			if (c)
+				next_free = c;
+		}
+#endif
+	}
+	if (next_free < 2)
+		next_free = 2;
+
+	// first free entry from next_free on, a FAT sector at a time
+	uint32_t c;
+	for (;;)
+	{
+		c = next_free;
+
+		uint32_t end;
+		if ((this->*table->scan)(&c, &end) == 0)
+			return 0;
+		if (c < end)
+			break;
+
+#if FAT_FREEMAP_BYTES
+		// the rest of this sector's in use, whatever the map thought. Go
+		// on to wherever it says is free rather than reading on through
+		// the FAT
+		freemap_clear(next_free, end);
+		c = freemap_find(end, want);
+		if (c)
+		{
+			next_free = c;
+			continue;
+		}
+#endif
+
+		if (alloc_left <= end - next_free)
+		{
+			printf("FAT: disk full\n");
+			alloc_left = 0;
+			*cluster = 0;
+			return 1;
+		}
+		alloc_left -= end - next_free;
+		next_free = (end >= max_cluster)?2:end;
+	}
+
+	// c's still free until the last step, so if a FAT sector has to be
+	// read on the way we'll find it again next time
+	next_free = c;
+
+	if (tail && ((this->*table->put)(tail, c) == 0))
+		return 0;
+	if ((this->*table->put)(c, table->eoc) == 0)
+		return 0;
+
+#if FAT_FREEMAP_BYTES
+	freemap_clear(c, c + 1);
+#endif
+
+	next_free  = (c + 1 < max_cluster)?(c + 1):2;
+	alloc_left = 0;
+	if ((free_count != 0xFFFFFFFF) && free_count)
+		free_count--;
+	fsinfo_dirty = 1;
+
+	*cluster = c;
+	return 1;
+}
+
+int Fat::file_extend(_fat_file_ioresult* w, uint32_t clusters)
+{
+	FIL* f = &w->file;
+
+	while (clusters)
+	{
+		uint32_t c;
+		if (file_cluster(f, clusters - 1, &c) == 0)
+			return 0;
+		if (c)
+			return 1;
+
+		// it's short. Carry on from the end of the map, or wherever the
+		// walk that found the end stopped
+		uint32_t tail = 0, index = 0;
+		if (f->root_cluster && f->extent_end)
+		{
+			_fat_extent* e = &f->extent[f->n_extents - 1];
+			tail  = e->cluster + e->length - 1;
+			index = f->extent_clusters;
+		}
+		else if (f->root_cluster)
+		{
+			tail  = f->walk_cluster;
+			index = f->walk_index + 1;
+		}
+
+		// a search that's waiting on the card mustn't have someone else
+		// take the cluster it's found
+		if (alloc_owner && (alloc_owner != w))
+		{
+			alloc_waiting = 1;
+			return 0;
+		}
+		alloc_owner = w;
+
+		if (fat_alloc(tail, clusters - index, &c) == 0)
+			return 0;
+
+		alloc_owner = NULL;
+		if (alloc_waiting)
+		{
+			alloc_waiting = 0;
+			process_buffer(NULL, 0xFFFFFFFF);
+		}
+
+		if (c == 0)
+		{
+			w->error = FAT_ERR_NOSPC;
+			return 1;
+		}
+
+		if (tail == 0)
+		{
+			// an empty file's first cluster, which its directory entry
+			// has to hear about
+			f->root_cluster       = c;
+			f->current_cluster    = c;
+			f->extent[0].cluster  = c;
+			f->extent[0].length   = 1;
+			f->n_extents          = 1;
+			f->extent_clusters    = 1;
+			f->dirty              = 1;
+		}
+		else
+			extent_add(f, index, c);
+
+		f->extent_end   = (f->extent_clusters == index + 1);
+		f->walk_cluster = c;
+		f->walk_index   = index;
+	}
+
+	return 1;
+}
+
+#if FAT_FREEMAP_BYTES
+void Fat::freemap_start()
+{
+	uint32_t bits = FAT_FREEMAP_BYTES * 8;
+
+	if (freemap == NULL)
+		freemap = (uint32_t*) AHB0.alloc(FAT_FREEMAP_BYTES);
+	if (freemap == NULL)
+		freemap = (uint32_t*) AHB1.alloc(FAT_FREEMAP_BYTES);
+	if (freemap == NULL)
+		return;
+
+	freemap_shift = 0;
+	while (((max_cluster - 1) >> freemap_shift) >= bits)
+		freemap_shift++;
+
+	memset(freemap, 0, FAT_FREEMAP_BYTES);
+	freemap_scanned = 0;
+	freemap_lba     = fat_begin_lba;
+
+	FDEBUG("FAT: free map of %lu clusters per bit\n", 1UL << freemap_shift);
+
+	freemap_read();
+}
+
+// the scan only runs while there's nothing else for us to do, and picks
+// up again from complete() once the queue's empty
+void Fat::freemap_read()
+{
+	if ((freemap_lba == 0) || freemap_end || work_queue)
+		return;
+
+	uint32_t last = fat_begin_lba + (table->offset(max_cluster - 1) >> 9);
+	uint32_t n    = last - freemap_lba + 1;
+	if (n > FAT_FREEMAP_CHUNK)
+		n = FAT_FREEMAP_CHUNK;
+
+	// only multi-block reads stream through the driver's buffers, so a
+	// last sector on its own brings the one after it along. The second FAT
+	// is always there to read
+	if (n < 2)
+		n = 2;
+
+	// with the queue full, we're back here on the next completion
+	if (sd->begin_read(freemap_lba, n, NULL, this) == 0)
+		freemap_end = freemap_lba + n - 1;
+}
+
+void Fat::freemap_block(uint32_t lba, void* buf, int err)
+{
+	if ((err == 0) && (freemap_stale == 0) && (lba == freemap_lba))
+	{
+		// a cached copy may have allocations the card hasn't seen yet
+		uint8_t* e = (uint8_t*) buf;
+		for (int i = 0; i < FAT_CACHE_SECTORS; i++)
+			if ((cache[i].lba == lba) && (cache[i].flags & FAT_CACHE_VALID))
+				e = cache[i].buf;
+
+		(this->*table->map)(lba, e);
+		freemap_lba = (freemap_scanned < max_cluster)?(lba + 1):0;
+	}
+	else if (err && (freemap_stale == 0))
+	{
+		printf("FAT: lba %lu read ERROR, free map stops at cluster %lu\n", lba, freemap_scanned);
+		freemap_lba = 0;
+	}
+
+	if (buf)
+		sd->clean_buffer(buf);
+
+	// an error ends the read early
+	if (err || (lba == freemap_end))
+	{
+		freemap_end   = 0;
+		freemap_stale = 0;
+		freemap_read();
+	}
+}
+
+void Fat::freemap_clear(uint32_t from, uint32_t to)
+{
+	if ((freemap == NULL) || (from >= to))
+		return;
+
+	for (uint32_t g = from >> freemap_shift; g <= ((to - 1) >> freemap_shift); g++)
+		freemap[g >> 5] &= ~(1UL << (g & 31));
+}
+
+uint32_t Fat::freemap_find(uint32_t cluster, uint32_t want)
+{
+	if (freemap == NULL)
+		return 0;
+
+	// only groups the scan has finished with
+	uint32_t groups = freemap_scanned >> freemap_shift;
+	uint32_t size   = 1UL << freemap_shift;
+	uint32_t need   = (want + size - 1) >> freemap_shift;
+	uint32_t start  = (cluster + size - 1) >> freemap_shift;
+
+	if (groups == 0)
+		return 0;
+	if (start >= groups)
+		start = 0;
+	if (need < 1)
+		need = 1;
+
+	uint32_t any = 0xFFFFFFFF;
+
+	// from start to the end of the disk, then from the beginning back to
+	// start. Runs don't wrap round the end of the disk
+	for (int pass = 0; pass < 2; pass++)
+	{
+		uint32_t g     = pass?0:start;
+		uint32_t end   = pass?start:groups;
+		uint32_t run   = 0;
+		uint32_t first = 0;
+
+		while (g < end)
+		{
+			// what's left of this word of the map that we're looking at
+			uint32_t len  = 32 - (g & 31);
+			if (len > end - g)
+				len = end - g;
+			uint32_t bits = freemap[g >> 5] >> (g & 31);
+			if (len < 32)
+				bits &= (1UL << len) - 1;
+
+			// a run of free groups or used ones at a time
+			while (len)
+			{
+				uint32_t k;
+				if (bits & 1)
+				{
+					k = (~bits)?__builtin_ctz(~bits):32;
+					if (k > len)
+						k = len;
+
+					if (any == 0xFFFFFFFF)
+						any = g;
+					if (run == 0)
+						first = g;
+					run += k;
+					if (run >= need)
+						return first << freemap_shift;
+				}
+				else
+				{
+					k = bits?__builtin_ctz(bits):32;
+					if (k > len)
+						k = len;
+					run = 0;
+				}
+
+				bits = (k < 32)?(bits >> k):0;
+				g   += k;
+				len -= k;
+			}
+		}
+	}
+
+	return (any != 0xFFFFFFFF)?(any << freemap_shift):0;
+}
+#endif
+
+int Fat::dir_next_sector(uint32_t* lba)
+{
+	// the fixed root directory just runs on to root_dir_end
+	if (*lba < cluster_begin_lba)
+	{
+		*lba = (*lba < root_dir_end)?(*lba + 1):0;
+		return 1;
+	}
+
+	if (((*lba - cluster_begin_lba + 1) % sectors_per_cluster) != 0)
+	{
+		(*lba)++;
+		return 1;
+	}
+
+	uint32_t next;
+	if (fat_next(lba_to_cluster(*lba), &next) == 0)
+		return 0;
+
+	*lba = next?cluster_to_lba(next):0;
+	return 1;
 }
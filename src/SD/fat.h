@@ -25,8 +25,9 @@
  *     Internal tasks (eg traverse FAT, read directory, etc) are placed at the
  *     head of the queue.
  *
- * When a new block of data arrives, we examine the first item in the queue.
- * Usually, it can do something useful with the newly arrived data.
+ * When a new block of data arrives, it goes to the item waiting for it. A
+ *     FAT or directory sector arriving in the cache wakes every item that's
+ *     started, and each picks up from wherever it left off.
  *
  * When a queue item has finished, it is removed from the queue, and the next
  *     item is activated.
@@ -117,12 +118,102 @@
  *
  */
 
+/*
+ * sector cache
+ *
+ * FAT and directory sectors live in FAT_CACHE_SECTORS 512 byte buffers
+ * from the AHB pools. A miss evicts the least recently used sector that
+ * isn't waiting on the card, writing it back first if it's dirty, so a walk
+ * that goes back and forth between FAT and directory sectors only reads
+ * each one once
+ */
+#ifndef FAT_CACHE_SECTORS
+#define FAT_CACHE_SECTORS 8
+#endif
+
+// a directory walk holds a directory sector while it looks up the FAT
+#if FAT_CACHE_SECTORS < 2
+#error FAT_CACHE_SECTORS must be at least 2
+#endif
+
+/*
+ * free cluster map
+ *
+ * a bit per group of clusters, set when every cluster in the group is free,
+ * so the allocator can go straight to free space instead of reading its
+ * way through the FAT. Groups are as small a power of two as fits the
+ * disk in FAT_FREEMAP_BYTES. The map's built after mount by streaming the
+ * FAT through FAT_FREEMAP_CHUNK sector reads, and until it's done only
+ * covers what's been read. 0 leaves it out
+ */
+#ifndef FAT_FREEMAP_BYTES
+#define FAT_FREEMAP_BYTES 512
+#endif
+
+#ifndef FAT_FREEMAP_CHUNK
+#define FAT_FREEMAP_CHUNK 16
+#endif
+
+/*
+ * paths f_open() has found, by hash, with what it found for them. Opening
+ * one again needs no directory reads at all. Writing a file's directory
+ * entry updates its copy here. 0 leaves it out
+ */
+#ifndef FAT_NAME_CACHE
+#define FAT_NAME_CACHE 8
+#endif
+
+/*
+ * concurrent work
+ *
+ * the first FAT_ACTIVE items in the queue run at once, each with its own
+ * requests on the card, so a small file can be opened and read while a big
+ * one streams in. Anything behind them starts as one finishes. While more
+ * than one item's queued, reads and writes go to the card in runs of no
+ * more than FAT_SHARE_SECTORS, so the card's scheduler has a chance to fit
+ * everyone else's requests in between
+ */
+#ifndef FAT_ACTIVE
+#define FAT_ACTIVE 4
+#endif
+
+#if FAT_ACTIVE < 1
+#error FAT_ACTIVE must be at least 1
+#endif
+
+#ifndef FAT_SHARE_SECTORS
+#define FAT_SHARE_SECTORS 32
+#endif
+
+#ifdef FATDEBUG
+	#define FDEBUG(...) printf(__VA_ARGS__)
+#else
+	#define FDEBUG(...) do {} while (0)
+#endif
+
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t writebacks;
+
+	uint32_t name_hits;   // opens served from the name cache
+	uint32_t name_misses;
+} fat_cache_stats_t;
+
 class _fat_ioreceiver
 {
 public:
 	virtual void _fat_io(_fat_ioresult*) = 0;
 };
 
+class _fat_dirreceiver
+{
+public:
+	// a sector's worth of entries from f_readdir(), only good until this
+	// returns. Called from interrupt context, like _fat_io()
+	virtual void _fat_dirents(_fat_dir_ioresult*, const fat_dirent_t*, int n) = 0;
+};
+
 class Fat : public SD_async_receiver
 {
 public:
@@ -145,8 +236,30 @@ public:
 	int  f_write_block(_fat_file_ioresult*, void*, uint32_t);
 	int  f_close(_fat_file_ioresult*);
 
+	/*
+	 * write the file's directory entry if its size has changed, then
+	 * everything else we're holding dirty. Done once it's all on the card
+	 */
+	int  f_sync(_fat_file_ioresult*);
+
+	/*
+	 * list a directory, "" or "/" being the root. f_readdir() goes through
+	 * it from the start, handing each sector's entries to reader as they
+	 * come off the card, and sets fini at the end. Runs of sectors that
+	 * follow on from each other are read in one go. Deleted entries and
+	 * the volume label are left out
+	 */
+	int  f_opendir( _fat_dir_ioresult*, const char*);
+	int  f_readdir( _fat_dir_ioresult*, _fat_dirreceiver*);
+	int  f_closedir(_fat_dir_ioresult*);
+
 	int  f_mounted(void);
 
+	// the free cluster map covers the whole disk
+	int  f_freemap_complete(void);
+
+	const fat_cache_stats_t* get_cache_stats(void);
+
 	/*
 	 * this method receives completion messages from the disk
 	 */
@@ -154,15 +267,23 @@ public:
 	void sd_read_complete(SD*, uint32_t sector, void* buf, int err);
 	void sd_write_complete(SD*, uint32_t sector, void* buf, int err);
 
+	// enqueue() has something for process_buffer()
+	void sd_wake(SD*);
+
 	/*
-	 * this is where we crunch received (or cached) data
+	 * this is where we crunch received (or cached) data. A buffer goes to
+	 * the item waiting on it, NULL has everything that's started take
+	 * another look
 	 */
 	void process_buffer(uint8_t* buffer, uint32_t lba);
 
 	void ioaction_mount(    _fat_mount_ioresult* w, uint8_t* buffer, uint32_t lba);
 	void ioaction_open(     _fat_file_ioresult*  w, uint8_t* buffer, uint32_t lba);
 	void ioaction_read_one( _fat_file_ioresult*  w, uint8_t* buffer, uint32_t lba);
+	void ioaction_seek(     _fat_file_ioresult*  w, uint8_t* buffer, uint32_t lba);
 	void ioaction_write_one(_fat_file_ioresult*  w, uint8_t* buffer, uint32_t lba);
+	void ioaction_sync(     _fat_file_ioresult*  w, uint8_t* buffer, uint32_t lba);
+	void ioaction_readdir(  _fat_dir_ioresult*   w, uint8_t* buffer, uint32_t lba);
 
 	/*
 	 * debug function, prints queue contents
@@ -176,9 +297,28 @@ protected:
 	uint32_t cluster_begin_lba;
 	uint32_t sectors_per_cluster;
 	uint32_t root_dir_sector;
+	uint32_t root_dir_cluster; // 0 for the fixed FAT12/16 root directory
+	uint32_t root_dir_end;
 
 	uint8_t  fat_type; // 12, 16 or 32
 
+	uint32_t fat_sectors;  // in each copy. The second follows the first
+	uint32_t max_cluster;  // one past the last cluster on the disk
+
+	/*
+	 * allocation. next_free is where the search for a free cluster starts,
+	 * from FSInfo on FAT32, and alloc_left counts down the clusters an
+	 * unfinished search has still to look at, so a full disk is noticed
+	 */
+	uint32_t fsinfo_lba;   // 0 if there isn't one
+	uint32_t next_free;
+	uint32_t free_count;   // 0xFFFFFFFF if unknown
+	uint32_t alloc_left;
+	uint8_t  fsinfo_dirty;
+
+	// f_open() and f_opendir()
+	int      open_path(_fat_file_ioresult*, const char*, uint8_t action);
+
 	/*
 	 * conversion between cluster and lba
 	 */
@@ -190,25 +330,207 @@ protected:
 	 */
 	void     enqueue(_fat_ioresult*);
 	void     dequeue(_fat_ioresult*);
+	void     complete(_fat_ioresult*);
 	void     byte2cluster(_fat_ioresult*, uint32_t);
 
+	// one item's action, failing it if it wanted a sector the card
+	// couldn't read
+	void     run(_fat_ioresult*, uint8_t* buffer, uint32_t lba);
+
+	// the started item a block of file data or a streamed directory
+	// sector is for, NULL if nobody's waiting on it
+	_fat_ioresult* claimant(uint8_t* buffer, uint32_t lba);
+
+	// more than one item's queued, so nobody gets the card for long
+	int      shared(void);
+
+	/*
+	 * both return 1 with fat_buf or dentry_buf pointing at the sector if
+	 * it's cached. Otherwise they start reading it and return 0, and
+	 * everything that's started is run again once it arrives
+	 */
 	int      fat_cache(   uint32_t lba);
 	int      dentry_cache(uint32_t lba);
 
+	/*
+	 * next cluster in a chain. Returns 0 if its FAT sector is being read,
+	 * otherwise 1 with *next set, to 0 at the end of the chain
+	 */
+	int      fat_next(uint32_t cluster, uint32_t* next);
+
+	// fat_next() that won't go to the card, returning 0 instead
+	int      fat_peek(uint32_t cluster, uint32_t* next);
+
+	// links from cluster on that just go to the next cluster, up to max,
+	// as far as the cached FAT sector holding cluster's entry shows
+	uint32_t fat_run(uint32_t cluster, uint32_t max);
+
+	/*
+	 * the table itself, for each width of entry. T is 12, 16 or 32, and
+	 * FAT12 entries can be split across two sectors. table_get() and
+	 * table_put() have fat_next()'s return, and table_free() moves
+	 * *cluster on to the first free one in its FAT sector, or to *end,
+	 * the first cluster of the next
+	 */
+	template <int T> int      table_get( uint32_t cluster, uint32_t* entry, int peek);
+	template <int T> int      table_put( uint32_t cluster, uint32_t entry);
+	template <int T> uint32_t table_run( uint32_t cluster, uint32_t max);
+	template <int T> int      table_free(uint32_t* cluster, uint32_t* end);
+#if FAT_FREEMAP_BYTES
+	template <int T> void     table_map( uint32_t lba, uint8_t* buf);
+#endif
+
+	// the set of them for the mounted FAT's type, picked by f_mount()
+	struct fat_table_ops
+	{
+		uint32_t bad;                         // entries from here up end a chain
+		uint32_t eoc;
+		uint32_t (*offset)(uint32_t cluster); // of its entry in the FAT, in bytes
+
+		int      (Fat::*get)( uint32_t, uint32_t*, int);
+		int      (Fat::*put)( uint32_t, uint32_t);
+		uint32_t (Fat::*run)( uint32_t, uint32_t);
+		int      (Fat::*scan)(uint32_t*, uint32_t*);
+#if FAT_FREEMAP_BYTES
+		void     (Fat::*map)( uint32_t, uint8_t*);
+#endif
+	};
+	static const fat_table_ops table_ops[3];
+	const fat_table_ops* table;
+
+	/*
+	 * the cluster holding a file's index'th cluster, from its extent map
+	 * where possible. Same return as fat_next()
+	 */
+	int      file_cluster(FIL*, uint32_t index, uint32_t* cluster);
+	void     extent_add(FIL*, uint32_t index, uint32_t cluster);
+
+	/*
+	 * take a free cluster and hang it off tail, or start a chain if tail is
+	 * 0. want is how many the caller's after in all, for finding room for
+	 * them together. Same return as fat_next(), *cluster is 0 if the disk
+	 * is full
+	 */
+	int      fat_alloc(uint32_t tail, uint32_t want, uint32_t* cluster);
+
+	// grow a file's chain to at least clusters long. Returns 0 while
+	// waiting on the card, sets FAT_ERR_NOSPC if it can't
+	int      file_extend(_fat_file_ioresult*, uint32_t clusters);
+
+	// the directory sector after *lba, or 0 past the end. Returns 0 if
+	// the FAT sector saying where it is is being read
+	int      dir_next_sector(uint32_t* lba);
+
+	// fill in an opened file from its directory entry's location and contents
+	void     open_found(_fat_file_ioresult*, uint32_t dir, uint16_t index, uint32_t cluster, uint32_t size);
+
+	// hand a directory sector's entries to the reader
+	void     dir_sector(_fat_dir_ioresult*, uint8_t* buf);
+
+#if FAT_NAME_CACHE
+	int      name_cache_find(_fat_file_ioresult*);
+	void     name_cache_add(FIL*);
+	void     name_cache_update(FIL*);
+#endif
+
+	uint8_t* cache_get(uint32_t lba);
+	uint8_t* cache_peek(uint32_t lba);
+	void     cache_dirty(uint8_t* buf);
+	void     cache_write(uint8_t i);
+
+	// start writing back everything dirty. Returns how many sectors are
+	// still dirty or on their way to the card
+	int      cache_flush(void);
+
+#if FAT_FREEMAP_BYTES
+	void     freemap_start(void);
+	void     freemap_read(void);
+	void     freemap_block(uint32_t lba, void* buf, int err);
+	void     freemap_clear(uint32_t from, uint32_t to);
+
+	/*
+	 * first cluster of a run of free groups big enough for want clusters,
+	 * from cluster on, or of any free group. 0 if there's none. It goes
+	 * through the map a word at a time, and a run of free or used groups
+	 * at a time within a word. So a lookup costs a step for each of the
+	 * map's FAT_FREEMAP_BYTES / 4 words, plus one for each run it passes,
+	 * and a full stretch of disk costs one step per 32 groups
+	 */
+	uint32_t freemap_find(uint32_t cluster, uint32_t want);
+#endif
+
 private:
 	SD* sd;
 	/*
-	 * these buffers are used internally for traversing cluster chains and directory entries
+	 * where the last fat_cache() and dentry_cache() found their sectors
 	 */
 	uint8_t* fat_buf;
-	uint32_t fat_lba;
 	uint8_t* dentry_buf;
-	uint32_t dentry_lba;
+
+	enum {
+		FAT_CACHE_VALID   = 1,
+		FAT_CACHE_DIRTY   = 2,
+		FAT_CACHE_READING = 4,
+		FAT_CACHE_WRITING = 8,
+		FAT_CACHE_MIRROR  = 16, // a FAT sector going to the second copy
+		FAT_CACHE_FAILED  = 32, // the read failed, kept until its waiters have been told
+
+		FAT_CACHE_BUSY    = FAT_CACHE_READING | FAT_CACHE_WRITING | FAT_CACHE_MIRROR
+	};
+
+	struct {
+		uint8_t* buf;
+		uint32_t lba;
+		uint32_t used; // cache_clock at last use
+		uint8_t  flags;
+	} cache[FAT_CACHE_SECTORS];
+	uint32_t cache_clock;
+
+	fat_cache_stats_t cache_stats;
+
+	// a write back failed since the last f_sync() looked
+	uint8_t  cache_error;
+
+#if FAT_NAME_CACHE
+	struct {
+		uint32_t hash[2];  // both 0 if unused
+		uint32_t dir;      // where the directory entry is
+		uint16_t index;
+		uint32_t cluster;  // and what it says
+		uint32_t size;
+		uint32_t used;
+	} names[FAT_NAME_CACHE];
+	uint32_t name_clock;
+#endif
+
+#if FAT_FREEMAP_BYTES
+	uint32_t* freemap;
+	uint8_t   freemap_shift;   // log2 clusters per group
+	uint8_t   freemap_stale;   // what's in flight is from before a remount
+	uint32_t  freemap_scanned; // clusters the map covers, from 0
+	uint32_t  freemap_lba;     // next FAT sector the scan wants, 0 once stopped
+	uint32_t  freemap_end;     // last sector of the read in flight, 0 if none
+#endif
 
 	/*
 	 * this is the head of the queue, which is a linked list
 	 */
 	_fat_ioresult* work_queue;
+
+	/*
+	 * process_buffer() goes over everything that's started. Asked again
+	 * while it's at it, it starts over instead, once the item it's running
+	 * returns. Only touched from the card's interrupt
+	 */
+	uint8_t  passing;
+	uint8_t  rerun;
+	uint8_t  refused;      // the card's queue was full, so try again as things finish
+	uint8_t  cache_failed; // run(): the item wanted a sector the card couldn't read
+
+	// clusters are taken by one item at a time, from the search for a free
+	// one to linking it in
+	_fat_ioresult* alloc_owner;
+	uint8_t  alloc_waiting;
 };
 
 #endif /* _FAT_H */
@@ -74,6 +74,21 @@ typedef struct __attribute__ ((packed))
 	uint16_t magic;                 // always ntohs(0x55AA)			// 511-512
 } _fat_volid;
 
+/*
+ * FAT32 FSInfo sector, hints for the allocator. Either count can be
+ * 0xFFFFFFFF for unknown
+ */
+typedef struct __attribute__ ((packed))
+{
+	uint32_t lead_sig;              // 0x41615252
+	uint8_t  reserved0[480];
+	uint32_t struct_sig;            // 0x61417272
+	uint32_t free_count;
+	uint32_t next_free;
+	uint8_t  reserved1[12];
+	uint32_t trail_sig;             // 0xAA550000
+} _fat_fsinfo;
+
 /*
  * Directory entries
  *
@@ -112,14 +127,29 @@ typedef struct __attribute__ ((packed))
 	uint16_t name2[2];
 } _fat_lfnentry;
 
+/*
+ * runs of consecutive clusters in a file's chain, filled in as the chain is
+ * walked. Once a file's chain has been seen, finding its nth cluster needs
+ * no FAT reads, as long as it's in no more than FAT_EXTENTS pieces
+ */
+#ifndef FAT_EXTENTS
+#define FAT_EXTENTS 8
+#endif
+
+typedef struct __attribute__ ((packed))
+{
+	uint32_t cluster;
+	uint32_t length;
+} _fat_extent;
+
 typedef struct __attribute__ ((packed))
 {
 	char* path;
 
 	uint32_t root_cluster;
 
-	uint32_t direntry_cluster;
-	uint8_t  direntry_index;
+	uint32_t direntry_cluster; // 0 for the fixed FAT12/16 root directory
+	uint16_t direntry_index;   // counted from the start of that cluster
 
 	/*
 	 * where are we now?
@@ -136,6 +166,23 @@ typedef struct __attribute__ ((packed))
 		uint32_t size;
 		uint32_t pathname_traversed_bytes;
 	};
+
+	/*
+	 * the chain as far as we know it. extent_clusters is how many clusters
+	 * the extents cover, and extent_end is set once the chain's been
+	 * followed to its end. Past a full map, walk_cluster and walk_index
+	 * keep a long walk from starting over
+	 */
+	_fat_extent extent[FAT_EXTENTS];
+	uint8_t     n_extents;
+	uint8_t     extent_end;
+	uint32_t    extent_clusters;
+
+	uint32_t    walk_cluster;
+	uint32_t    walk_index;
+
+	// size or first cluster changed since the directory entry was written
+	uint8_t     dirty;
 } FIL;
 
 typedef enum
@@ -146,10 +193,24 @@ typedef enum
 	IOACTION_READ_ONE,
 	IOACTION_WRITE_ONE,
 	IOACTION_SEEK,
+	IOACTION_SYNC,
+	IOACTION_CLOSE,
+	IOACTION_OPENDIR,
+	IOACTION_READDIR,
 } _fat_ioaction;
 
+typedef enum
+{
+	FAT_ERR_NONE  =  0,
+	FAT_ERR_IO    = -1, // the card failed a read or write
+	FAT_ERR_NOENT = -2, // no such file or directory
+	FAT_ERR_NOFS  = -3, // no FAT filesystem we recognise
+	FAT_ERR_NOSPC = -4, // no free clusters left
+} _fat_error;
+
 class Fat;
 class _fat_ioreceiver;
+class _fat_dirreceiver;
 struct __fat_ioresult;
 
 struct __attribute__ ((packed))
@@ -159,6 +220,7 @@ _fat_ioresult
 	uint8_t  action:6;
 	uint8_t  ready :1;
 	uint8_t  fini  :1;
+	int8_t   error;     // 0, or what went wrong once fini is set
 
 	uint8_t* buffer;
 	uint32_t buflen;
@@ -184,15 +246,52 @@ _fat_file_ioresult : _fat_ioresult
 	char*    path;
 	uint8_t  path_traverse;
 
+	// the long name entries before the next 8.3 one, which can start a
+	// sector or more back
+	uint8_t  lfn_seq;         // sequence number of the last, 0 if none
+	uint8_t  lfn_sum;         // checksum of the 8.3 name they're meant for
+	uint8_t  lfn_match;       // f_open(): they agree with the path so far
+
 	uint32_t bytes_remaining;
+	uint32_t seek_to;         // IOACTION_SEEK: byte offset it's going to
+	uint32_t run_end;         // last lba of the multi-block read or write in flight
 
 	FIL      file;
 
 	_fat_traverse_ioresult traverse;
 };
 
+/*
+ * an entry as f_readdir() hands it over. name is the long name if there's
+ * one that goes with the entry, otherwise its 8.3 name as NAME.EXT
+ */
+typedef struct
+{
+	const char* name;
+	uint8_t     attr;
+	uint32_t    cluster;
+	uint32_t    size;
+} fat_dirent_t;
+
+/*
+ * a directory being listed, with the long name being put together in
+ * lfn[]. Names for a batch go in names[]: a sector holds 16 entries, so
+ * with a long name carried in from before, they need no more than
+ * 261 + 16 * 13 bytes
+ */
+struct __attribute__ ((packed))
+_fat_dir_ioresult : _fat_file_ioresult
+{
+	_fat_dirreceiver* reader;
+
+	uint8_t  at_end;   // seen the end marker, waiting for the rest of the read
+	char     lfn[261];
+	char     names[512];
+};
+
 enum _fat_mount_stage_t {
 	FAT_MOUNT_STAGE_SUPERBLOCK,
+	FAT_MOUNT_STAGE_FSINFO,
 	FAT_MOUNT_STAGE_ROOT_DIR
 };
 
@@ -202,9 +301,6 @@ _fat_mount_ioresult : _fat_ioresult
 	char label[12];
 	enum _fat_mount_stage_t stage;
 	uint32_t lba_start;
-	uint32_t root_dir_end;
-
-	_fat_ioreceiver* owner;
 };
 
 
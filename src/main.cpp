@@ -38,6 +38,7 @@
 
 #include "SPI.h"
 #include "SD.h"
+#include "bench.h"
 #include "fat.h"
 
 #include "USBClient.h"
@@ -87,6 +88,7 @@ public:
     sar()
     {
         last_sector = 0;
+        init_result = 0;
     }
 	void sd_read_complete(SD* sd, uint32_t sector, void* buf, int err)
 	{
@@ -110,7 +112,13 @@ public:
 	{
 	};
 
+	void sd_init_complete(SD* sd, int result)
+	{
+		init_result = result;
+	};
+
     uint32_t last_sector;
+    volatile int init_result;
 } sar_dumper;
 
 class test {
@@ -179,34 +187,52 @@ int main()
 
 	SD* sd = new SD(spi);
 
+	// the card takes a while to power up, so let USB enumerate meanwhile
+	sd->begin_init(&sar_dumper);
+
+    uint32_t clockflag = clock.request_flag();
+
+    USBClient usb;
+
+    DFU dfu;
+
+    usb.add_function(&dfu);
+
+    usb.connect();
+
+    // sleep between looks. The card's timer, USB and SysTick all wake us
+    while (sar_dumper.init_result == 0)
+    {
+        SD::on_idle_all();
+        usb.usbisr();
+        __WFI();
+    }
+
 	int r;
-	if ((r = sd->init()) < 1)
+	if ((r = sar_dumper.init_result) < 1)
 	{
 		printf("SD init failed: %d!\n", r);
 	}
 	else {
+        sd->dump_info();
+
         Fat* fat = new Fat();
 
         _fat_mount_ioresult fmount;
 
         fat->f_mount(&fmount, sd);
 
+        // card I/O runs from interrupts, keep USB going until it's done
         while (fmount.fini == 0)
-            sd->on_idle();
+        {
+            SD::on_idle_all();
+            usb.usbisr();
+            __WFI();
+        }
 
         printf("Mounted!\n");
     }
 
-    uint32_t clockflag = clock.request_flag();
-
-    USBClient usb;
-
-    DFU dfu;
-
-    usb.add_function(&dfu);
-
-    usb.connect();
-
 //     uint8_t* buf = (uint8_t*) AHB0.alloc(512);
 //     printf("Begin read Sectors 0-255\n");
 //     sd->begin_read(0, 256, buf, &sar_dumper);
@@ -220,7 +246,7 @@ int main()
 //         if (isp_btn->get() == 0)
 //             __debugbreak();
 
-		sd->on_idle();
+		SD::on_idle_all();
         dfu.on_idle();
         usb.usbisr();
 
@@ -241,16 +267,34 @@ int main()
             printf("S< ");
 
             uint8_t srx[32];
+            int dump = 0;
+            int bench = 0;
 
             while (r)
             {
                 uint32_t i = min(r, sizeof(srx));
                 uart->read(srx, i);
                 uart->write(srx, i);
+                for (uint32_t j = 0; j < i; j++)
+                    if (srx[j] == 's')
+                        dump = 1;
+                    else if (srx[j] == 'b')
+                        bench = 1;
                 r -= i;
             }
 
             printf("\n");
+
+            // 's' dumps the SD card statistics
+            if (dump)
+                sd->dump_stats();
+
+            // 'b' benchmarks the card. Reads only, anything on it is safe
+            if (bench)
+            {
+                SD_bench b(sd);
+                b.suite(0, sd->n_sectors(), 0);
+            }
         }
     }
 